@@ -0,0 +1,45 @@
+#include "aliastable.h"
+
+void aliasTable::build(const double *weights, unsigned int count) {
+
+    threshold.resize(count);
+    alias.resize(count);
+
+    double total = 0;
+    for (unsigned int i = 0; i < count; i++)
+        total += weights[i];
+
+    // scale so the average column holds exactly 1, stacks of under and over full columns on the stack
+    double scaled[MAX_SYMBOLS];
+    unsigned int small[MAX_SYMBOLS], large[MAX_SYMBOLS];
+    unsigned int n_small = 0, n_large = 0;
+
+    for (unsigned int i = 0; i < count; i++) {
+        scaled[i] = weights[i] * count / total;
+        if (scaled[i] < 1.0)
+            small[n_small++] = i;
+        else
+            large[n_large++] = i;
+        alias[i] = (uint8_t) i;
+    }
+
+    // Vose: fill each under-full column with mass from an over-full one
+    while (n_small > 0 && n_large > 0) {
+        unsigned int s = small[--n_small], l = large[n_large - 1];
+
+        threshold[s] = (uint64_t) (scaled[s] * 4294967296.0);
+        alias[s] = (uint8_t) l;
+
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) {
+            n_large--;
+            small[n_small++] = l;
+        }
+    }
+
+    // whatever is left is full up to rounding errors, always keep it
+    while (n_large > 0)
+        threshold[large[--n_large]] = 1ull << 32;
+    while (n_small > 0)
+        threshold[small[--n_small]] = 1ull << 32;
+}
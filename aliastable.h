@@ -0,0 +1,61 @@
+#ifndef CAV_GMZ_ALIASTABLE_H
+#define CAV_GMZ_ALIASTABLE_H
+
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+#define MAX_SYMBOLS 256
+
+/**
+ * Walker/Vose alias table: samples a discrete distribution with one random number and one comparison,
+ * whatever the number of symbols
+ */
+class aliasTable {
+public:
+
+    aliasTable() = default;
+
+    /**
+     * Builds the table of a distribution
+     * @param weights weight of each symbol, not necessarily normalized, at least one must be positive
+     * @param count number of symbols (up to 256)
+     */
+    aliasTable(const double *weights, unsigned int count) { build(weights, count); }
+
+    /**
+     * Rebuilds the table for another distribution, reusing its storage
+     * @param weights weight of each symbol, not necessarily normalized, at least one must be positive
+     * @param count number of symbols (up to 256)
+     */
+    void build(const double *weights, unsigned int count);
+
+    /**
+     * Picks a symbol
+     * @param random uniformly distributed 64 bit number
+     * @return index of the symbol
+     */
+    unsigned int sample(uint64_t random) const {
+
+        // high half picks the column, low half decides between the column and its alias
+        unsigned int column = (unsigned int) (((random >> 32) * threshold.size()) >> 32);
+
+        return (uint32_t) random < threshold[column] ? column : alias[column];
+    }
+
+private:
+
+    /**
+     * Probability of keeping each column, scaled to 2^32
+     */
+    vector<uint64_t> threshold;
+
+    /**
+     * Symbol picked when the column is not kept
+     */
+    vector<uint8_t> alias;
+};
+
+#endif //CAV_GMZ_ALIASTABLE_H
@@ -0,0 +1,26 @@
+#include "alphabet.h"
+
+// storage of the static members, needed when they are odr-used
+
+constexpr const char *englishAlphabet::name;
+constexpr unsigned int englishAlphabet::length;
+constexpr unsigned int englishAlphabet::max_order;
+constexpr const char *englishAlphabet::symbols;
+constexpr symbolTable englishAlphabet::encode;
+
+constexpr const char *portugueseAlphabet::name;
+constexpr unsigned int portugueseAlphabet::length;
+constexpr unsigned int portugueseAlphabet::max_order;
+constexpr const char *portugueseAlphabet::symbols;
+constexpr symbolTable portugueseAlphabet::encode;
+
+constexpr const char *dnaAlphabet::name;
+constexpr unsigned int dnaAlphabet::length;
+constexpr unsigned int dnaAlphabet::max_order;
+constexpr const char *dnaAlphabet::symbols;
+constexpr symbolTable dnaAlphabet::encode;
+
+constexpr const char *byteAlphabet::name;
+constexpr unsigned int byteAlphabet::length;
+constexpr unsigned int byteAlphabet::max_order;
+constexpr symbolTable byteAlphabet::encode;
@@ -0,0 +1,116 @@
+#ifndef CAV_GMZ_ALPHABET_H
+#define CAV_GMZ_ALPHABET_H
+
+
+#include <cstring>
+#include "normalize.h"
+
+/**
+ * Highest order whose context indexes fit 64 bits for an alphabet: the largest k where length^k <= 2^64 - 1
+ * @param length number of symbols of the alphabet
+ * @return highest order
+ */
+constexpr unsigned int maxOrder(uint64_t length) {
+
+    unsigned int order = 0;
+
+    for (uint64_t power = 1; power <= UINT64_MAX / length; power *= length)
+        order++;
+
+    return order;
+}
+
+/*
+ * Alphabet policies the model is specialized for. Each one provides:
+ *  - name: identifies the alphabet in the command line and in model files
+ *  - length: number of symbols, codes go from 0 to length - 1
+ *  - max_order: highest order supported with 64 bit context indexes
+ *  - encode: lookup table from bytes to codes
+ *  - valid(): whether a byte belongs to the alphabet
+ *  - decode(): byte of a code
+ *  - normalize(): converts a block of bytes to codes, dropping bytes outside the alphabet
+ */
+
+/**
+ * Lower case english letters and space, upper case letters are folded. The original alphabet of the model
+ */
+struct englishAlphabet {
+
+    static constexpr const char *name = "english";
+    static constexpr unsigned int length = 27;
+    static constexpr unsigned int max_order = maxOrder(length);
+    static constexpr const char *symbols = "abcdefghijklmnopqrstuvwxyz ";
+    static constexpr symbolTable encode = symbolTable(symbols, length, "ABCDEFGHIJKLMNOPQRSTUVWXYZ");
+
+    static bool valid(char c) { return encode.code[(uint8_t) c] != NOT_IN_ALPHABET; }
+
+    static char decode(unsigned int code) { return symbols[code]; }
+
+    static size_t normalize(const char *data, size_t count, uint8_t *codes) {
+        return normalizeLetters(data, count, codes);
+    }
+};
+
+/**
+ * Portuguese letters, including the accented ones, and space, in ISO-8859-1 (latin-1). Upper case is folded
+ */
+struct portugueseAlphabet {
+
+    static constexpr const char *name = "portuguese";
+    static constexpr unsigned int length = 40;
+    static constexpr unsigned int max_order = maxOrder(length);
+    static constexpr const char *symbols = "abcdefghijklmnopqrstuvwxyz"
+            "\xe0\xe1\xe2\xe3\xe7\xe9\xea\xed\xf3\xf4\xf5\xfa\xfc ";
+    static constexpr symbolTable encode = symbolTable(symbols, length, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+            "\xc0\xc1\xc2\xc3\xc7\xc9\xca\xcd\xd3\xd4\xd5\xda\xdc");
+
+    static bool valid(char c) { return encode.code[(uint8_t) c] != NOT_IN_ALPHABET; }
+
+    static char decode(unsigned int code) { return symbols[code]; }
+
+    static size_t normalize(const char *data, size_t count, uint8_t *codes) {
+        return normalizeWithTable(encode, data, count, codes);
+    }
+};
+
+/**
+ * DNA nucleotides, either case. Codes take 2 bits, so contexts go up to order 31
+ */
+struct dnaAlphabet {
+
+    static constexpr const char *name = "dna";
+    static constexpr unsigned int length = 4;
+    static constexpr unsigned int max_order = maxOrder(length);
+    static constexpr const char *symbols = "acgt";
+    static constexpr symbolTable encode = symbolTable(symbols, length, "ACGT");
+
+    static bool valid(char c) { return encode.code[(uint8_t) c] != NOT_IN_ALPHABET; }
+
+    static char decode(unsigned int code) { return symbols[code]; }
+
+    static size_t normalize(const char *data, size_t count, uint8_t *codes) {
+        return normalizeWithTable(encode, data, count, codes);
+    }
+};
+
+/**
+ * Raw bytes, every byte is a symbol and its own code
+ */
+struct byteAlphabet {
+
+    static constexpr const char *name = "bytes";
+    static constexpr unsigned int length = 256;
+    static constexpr unsigned int max_order = maxOrder(length);
+    static constexpr symbolTable encode = symbolTable();
+
+    static bool valid(char) { return true; }
+
+    static char decode(unsigned int code) { return (char) code; }
+
+    static size_t normalize(const char *data, size_t count, uint8_t *codes) {
+        memcpy(codes, data, count);
+        return count;
+    }
+};
+
+#endif //CAV_GMZ_ALPHABET_H
@@ -0,0 +1,57 @@
+#include "arena.h"
+
+/**
+ * @return size class of a block, its size in units of ARENA_ALIGNMENT
+ */
+static size_t sizeClass(size_t bytes) {
+    return (bytes + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT;
+}
+
+void *slabArena::allocate(size_t bytes) {
+
+    counters.allocations++;
+
+    if (bytes > ARENA_MAX_BLOCK)
+        return ::operator new(bytes);
+
+    size_t size_class = sizeClass(bytes);
+    size_t rounded = size_class * ARENA_ALIGNMENT;
+    void *block = free_lists[size_class];
+
+    counters.live_bytes += rounded;
+
+    if (block != nullptr) {
+        free_lists[size_class] = *static_cast<void **>(block);
+        counters.reuses++;
+        return block;
+    }
+
+    // the rest of a slab too short for the block is left unused
+    if ((size_t) (end - next) < rounded) {
+        slabs.emplace_back(new uint8_t[ARENA_SLAB_BYTES]);
+        next = slabs.back().get();
+        end = next + ARENA_SLAB_BYTES;
+
+        counters.slabs++;
+        counters.reserved_bytes += ARENA_SLAB_BYTES;
+    }
+
+    block = next;
+    next += rounded;
+
+    return block;
+}
+
+void slabArena::release(void *block, size_t bytes) {
+
+    if (bytes > ARENA_MAX_BLOCK) {
+        ::operator delete(block);
+        return;
+    }
+
+    size_t size_class = sizeClass(bytes);
+
+    *static_cast<void **>(block) = free_lists[size_class];
+    free_lists[size_class] = block;
+    counters.live_bytes -= size_class * ARENA_ALIGNMENT;
+}
@@ -0,0 +1,113 @@
+#ifndef CAV_GMZ_ARENA_H
+#define CAV_GMZ_ARENA_H
+
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+#define ARENA_SLAB_BYTES (1u << 20)     // bytes taken from the heap at once
+#define ARENA_ALIGNMENT 8               // blocks are rounded up to a multiple of this
+#define ARENA_MAX_BLOCK 4096            // larger blocks aren't pooled, they go straight to the heap
+
+/**
+ * Allocation counters of an arena, see slabArena
+ */
+struct arenaUsage {
+    size_t slabs = 0;               // slabs taken from the heap
+    size_t reserved_bytes = 0;      // bytes of the slabs
+    size_t live_bytes = 0;          // bytes of the blocks in use
+    uint64_t allocations = 0;       // blocks handed out since the arena was created
+    uint64_t reuses = 0;            // of them, blocks that came from a free list instead of a slab
+};
+
+/**
+ * Pool of small fixed size blocks carved out of large slabs. Freed blocks go to a free list of their size
+ * and are handed out again before the slabs are cut any further, so a model that keeps growing rows and
+ * nodes of a few sizes never calls malloc or free per row. Every slab is released at once with the arena.
+ * Not thread safe, each count table has its own
+ */
+class slabArena {
+public:
+
+    slabArena() : next(nullptr), end(nullptr), free_lists(ARENA_MAX_BLOCK / ARENA_ALIGNMENT + 1, nullptr) {}
+
+    slabArena(const slabArena &) = delete;
+
+    slabArena &operator=(const slabArena &) = delete;
+
+    /**
+     * @param bytes size of the block, not 0
+     * @return block of at least bytes, aligned to ARENA_ALIGNMENT
+     */
+    void *allocate(size_t bytes);
+
+    /**
+     * Returns a block to its free list
+     * @param block block given by allocate()
+     * @param bytes size it was allocated with
+     */
+    void release(void *block, size_t bytes);
+
+    /**
+     * @return allocation counters
+     */
+    const arenaUsage &usage() const { return counters; }
+
+private:
+
+    /**
+     * Slabs taken from the heap, freed with the arena
+     */
+    vector<unique_ptr<uint8_t[]>> slabs;
+
+    /**
+     * Unused part of the last slab
+     */
+    uint8_t *next, *end;
+
+    /**
+     * Head of the free list of each size, in units of ARENA_ALIGNMENT. Freed blocks hold the next one
+     */
+    vector<void *> free_lists;
+
+    arenaUsage counters;
+};
+
+/**
+ * Standard allocator handing out blocks of a slabArena, for the nodes of the containers of a table.
+ * Arrays past ARENA_MAX_BLOCK, like the buckets of a hash table, come from the heap
+ * @tparam T type of the objects allocated
+ */
+template<class T>
+class arenaAllocator {
+public:
+
+    typedef T value_type;
+
+    explicit arenaAllocator(slabArena *owner) : arena(owner) {}
+
+    template<class U>
+    arenaAllocator(const arenaAllocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_t n) { return static_cast<T *>(arena->allocate(n * sizeof(T))); }
+
+    void deallocate(T *p, size_t n) { arena->release(p, n * sizeof(T)); }
+
+    template<class U>
+    bool operator==(const arenaAllocator<U> &other) const { return arena == other.arena; }
+
+    template<class U>
+    bool operator!=(const arenaAllocator<U> &other) const { return arena != other.arena; }
+
+private:
+
+    template<class U> friend class arenaAllocator;
+
+    slabArena *arena;
+};
+
+#endif //CAV_GMZ_ARENA_H
@@ -0,0 +1,506 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "fcm.h"
+#include "codec.h"
+#include "sketch.h"
+
+#define DEFAULT_CORPUS_MB 8
+#define DEFAULT_CORPUS_ORDER 3
+#define DEFAULT_SKEW 1.2
+#define DEFAULT_SEED 42
+#define DEFAULT_GENERATED (1u << 22)    // symbols generated for each order
+#define DEFAULT_BUDGETS "1M,16M"        // memory budgets of the approximate models
+#define CORPUS_LINE_LENGTH 80           // symbols per line of the synthetic corpus
+#define GENERATED_LINE_LENGTH 100       // symbols per generated line
+#define TOP_SYMBOLS 10                  // symbols indexed and looked up per context by the topSymbols phases
+#define WRITE_BUFFER_LENGTH (1u << 20)
+
+typedef fcm<englishAlphabet> model;
+
+/**
+ * Measurement of one phase of the model for one order
+ */
+struct phaseResult {
+    unsigned int order;
+    string phase;
+    double seconds;
+    uint64_t bytes;         // bytes processed: input, table cells or model file
+    uint64_t symbols;       // symbols processed: input or generated symbols, or table cells
+    long peak_rss_kb;       // peak resident set size of the process up to the end of the phase
+    unsigned int threads;   // threads running the phase, throughput per core is divided by them
+    double bits_per_symbol; // entropy estimate or compressed size, 0 for the other phases
+    size_t memory_budget;   // budget of the approximate model, 0 for the exact one
+};
+
+/**
+ * Output stream buffer dropping everything, generated text is not worth writing anywhere
+ */
+class nullBuffer : public streambuf {
+protected:
+    int overflow(int c) override { return c; }
+
+    streamsize xsputn(const char *, streamsize count) override { return count; }
+};
+
+/**
+ * @return peak resident set size of the process, in KB
+ */
+static long peakRss() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/**
+ * splitmix64 finalizer, gives every context of the corpus its own symbol ranking
+ */
+static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b) {
+    return b == 0 ? a : gcd(b, a % b);
+}
+
+/**
+ * Writes a deterministic synthetic corpus: a Markov chain of the given order over the english alphabet.
+ * Every context ranks the symbols in its own order and draws them with Zipf probabilities 1/rank^skew,
+ * so a higher skew gives a lower entropy. Lines are broken with newlines, which are not alphabet symbols
+ * @param filename where to write the corpus
+ * @param length bytes of the corpus
+ * @param order order of the chain
+ * @param skew Zipf exponent
+ * @param seed seed of the generator, the same seed gives the same corpus
+ * @return number of alphabet symbols written
+ */
+static uint64_t writeCorpus(const string &filename, size_t length, unsigned int order, double skew, uint64_t seed) {
+
+    const unsigned int L = englishAlphabet::length;
+    vector<double> cumulative(L);
+    vector<unsigned int> steps;         // multipliers coprime with L, each one permutes the ranks
+    vector<char> buffer(WRITE_BUFFER_LENGTH);
+    mt19937_64 gen(seed);
+    uniform_real_distribution<double> uniform(0, 1);
+    uint64_t span = 1, context = 0, symbols = 0;
+    size_t used = 0;
+
+    for (unsigned int i = 0; i + 1 < order; i++)
+        span *= L;
+
+    double total = 0;
+    for (unsigned int r = 0; r < L; r++) {
+        total += 1 / pow(r + 1, skew);
+        cumulative[r] = total;
+    }
+
+    for (unsigned int a = 1; a < L; a++)
+        if (gcd(a, L) == 1)
+            steps.push_back(a);
+
+    ofstream out(filename, ios::binary | ios::trunc);
+
+    for (size_t i = 0; i < length; i++) {
+
+        if (i % (CORPUS_LINE_LENGTH + 1) == CORPUS_LINE_LENGTH) {
+            buffer[used++] = '\n';
+        } else {
+            unsigned int rank = (unsigned int) (lower_bound(cumulative.begin(), cumulative.end(),
+                                                            uniform(gen) * total) - cumulative.begin());
+            uint64_t hash = mix(seed ^ (context * 0x100000001b3ull));
+            unsigned int symbol = (unsigned int) ((min(rank, L - 1) * steps[hash % steps.size()] + (hash >> 32)) % L);
+
+            buffer[used++] = englishAlphabet::decode(symbol);
+            symbols++;
+
+            if (order > 0)
+                context = (context % span) * L + symbol;
+        }
+
+        if (used == buffer.size()) {
+            out.write(buffer.data(), used);
+            used = 0;
+        }
+    }
+
+    out.write(buffer.data(), used);
+
+    return out.good() ? symbols : 0;
+}
+
+/**
+ * Times the phases of the model, it can reach them one at a time as a friend of fcm
+ */
+class fcmBench {
+public:
+
+    fcmBench(const string &corpus, const string &model_file, uint64_t corpus_symbols, unsigned int generated,
+             unsigned int threads, const vector<pair<string, size_t>> &budgets) :
+            corpus(corpus), model_file(model_file), corpus_symbols(corpus_symbols), generated(generated),
+            threads(threads), budgets(budgets) {}
+
+    /**
+     * Runs every phase for an order
+     * @param order order of the model
+     * @param results where to append the measurements
+     * @return false if a phase failed
+     */
+    bool run(unsigned int order, vector<phaseResult> &results) {
+
+        inputSource input;
+        nullBuffer discard;
+        ostream text(&discard);
+
+        if (!input.open(corpus)) {
+            cerr << "Fail opening file '" << corpus << "' for reading" << endl;
+            return false;
+        }
+
+        // an empty model, then fed phase by phase
+        model m(order, nullptr, "", "", GENERATED_LINE_LENGTH, generated / GENERATED_LINE_LENGTH, 0, threads);
+        m.input = &input;
+
+        time(results, order, "occurrenceCounter", input.size(), corpus_symbols, threads,
+             [&] { m.occurrenceCounter(); });
+
+        uint64_t cells = (uint64_t) m.contexts() * englishAlphabet::length;
+        uint64_t model_bytes = modelFileSize(m.contexts(), englishAlphabet::length);
+        double entropy = 0;
+
+        time(results, order, "getEntropy", cells * sizeof(unsigned int), cells, threads,
+             [&] { entropy = m.getEntropy(); });
+        results.back().bits_per_symbol = entropy;
+
+        time(results, order, "calculateProbabilities", cells * sizeof(unsigned int), cells, 1,
+             [&] { m.calculateProbabilities(); });
+        // chunks of text are drawn in parallel, the same text for every run
+        m.setSeed(order);
+        time(results, order, "genText", generated + generated / GENERATED_LINE_LENGTH, generated, threads,
+             [&] { m.genText(text); });
+
+        // approximate models of the same corpus, their entropy is compared to the exact one above
+        for (auto &budget : budgets) {
+            model s(order, nullptr, "", "", GENERATED_LINE_LENGTH, generated / GENERATED_LINE_LENGTH, 0, threads,
+                    budget.second);
+            s.input = &input;
+
+            // the entropy is kept while counting, reading it takes no time worth a phase
+            time(results, order, "sketchCounter " + budget.first, input.size(), corpus_symbols, 1,
+                 [&] { s.occurrenceCounter(); });
+            results.back().bits_per_symbol = s.getEntropy();
+            results.back().memory_budget = budget.second;
+
+            time(results, order, "sketchGenText " + budget.first, generated + generated / GENERATED_LINE_LENGTH,
+                 generated, 1, [&] {
+                        s.calculateProbabilities();
+                        s.genText(text);
+                    });
+        }
+
+        int status = 0;
+        time(results, order, "save", model_bytes, cells, 1, [&] { status = m.save(model_file); });
+
+        if (status != 0)
+            return false;
+
+        model loaded(order, nullptr, "", "", 0, 0, 0, threads);
+        time(results, order, "load", model_bytes, cells, 1, [&] { status = loaded.load(model_file); });
+
+        unlink(model_file.c_str());
+        if (status != 0 || loaded.contexts() != m.contexts())
+            return false;
+
+        // autocomplete lookups of the server: every context of the model once, in random order
+        vector<uint64_t> queries;
+        vector<pair<unsigned int, unsigned int>> top;
+        uint64_t found = 0;
+        streamRng shuffle(order, 0);
+
+        loaded.table().forEachInPart(0, 1, [&](uint64_t context, const unsigned int *, unsigned int) {
+            queries.push_back(context);
+        });
+
+        for (size_t i = queries.size(); i > 1; i--)
+            swap(queries[i - 1], queries[shuffle.below(i)]);
+
+        time(results, order, "topIndex", model_bytes, cells, 1, [&] { loaded.prepareTopSymbols(TOP_SYMBOLS); });
+        time(results, order, "topSymbols", queries.size() * sizeof(uint64_t), queries.size(), 1, [&] {
+            for (auto context : queries)
+                found += loaded.topSymbols(context, TOP_SYMBOLS, top);
+        });
+
+        if (found != loaded.table().total())
+            return false;
+
+        // real compressed size of the corpus with an adaptive model of the order, next to the entropy
+        fcmCodec<englishAlphabet> codec(order, 0, threads);
+        ostringstream compressed;
+        codecStats compress_stats, decompress_stats;
+
+        time(results, order, "compress", input.size(), corpus_symbols, threads,
+             [&] { status = codec.compress(&input, compressed, compress_stats); });
+        results.back().bits_per_symbol = compress_stats.output_bytes * 8.0 / compress_stats.symbols;
+
+        if (status != 0)
+            return false;
+
+        string coded = compressed.str();
+        time(results, order, "decompress", corpus_symbols, corpus_symbols, threads,
+             [&] { status = codec.decompress(coded.data(), coded.size(), text, decompress_stats); });
+
+        return status == 0 && decompress_stats.symbols == corpus_symbols;
+    }
+
+private:
+
+    string corpus;
+    string model_file;
+    uint64_t corpus_symbols;
+    unsigned int generated;
+    unsigned int threads;
+    vector<pair<string, size_t>> budgets;   // memory budgets of the approximate models, as given and in bytes
+
+    template<class phase>
+    static void time(vector<phaseResult> &results, unsigned int order, const string &name, uint64_t bytes,
+                     uint64_t symbols, unsigned int threads, phase run) {
+
+        auto start = chrono::steady_clock::now();
+        run();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        results.push_back({order, name, seconds, bytes, symbols, peakRss(), threads, 0, 0});
+
+        const phaseResult &r = results.back();
+        cout << setw(6) << r.order << setw(26) << r.phase << setw(12) << fixed << setprecision(4) << r.seconds
+             << setw(12) << setprecision(1) << r.bytes / r.seconds / (1 << 20)
+             << setw(14) << r.bytes / r.seconds / (1 << 20) / r.threads
+             << setw(16) << setprecision(0) << r.symbols / r.seconds << setw(14) << r.peak_rss_kb << endl;
+    }
+};
+
+/**
+ * @return entropy of the exact model of an order, 0 if it wasn't measured
+ */
+static double exactEntropy(const vector<phaseResult> &results, unsigned int order) {
+
+    for (auto &r : results)
+        if (r.order == order && r.phase == "getEntropy")
+            return r.bits_per_symbol;
+
+    return 0;
+}
+
+/**
+ * Prints how far the entropy of every approximate model is from the exact one
+ */
+static void printErrors(const vector<phaseResult> &results) {
+
+    cout << setw(6) << "order" << setw(12) << "budget" << setw(12) << "exact" << setw(12) << "estimate"
+         << setw(12) << "error" << setw(12) << "error %" << endl;
+
+    for (auto &r : results) {
+        if (r.memory_budget == 0)
+            continue;
+
+        double exact = exactEntropy(results, r.order);
+        cout << setw(6) << r.order << setw(12) << r.memory_budget << setw(12) << setprecision(4) << exact
+             << setw(12) << r.bits_per_symbol << setw(12) << r.bits_per_symbol - exact
+             << setw(12) << setprecision(2) << (r.bits_per_symbol - exact) / exact * 100 << endl;
+    }
+}
+
+/**
+ * Writes the measurements as JSON
+ * @return 0 if written 1 otherwise
+ */
+static int writeJson(const string &filename, const vector<phaseResult> &results, size_t corpus_bytes,
+                     uint64_t corpus_symbols, unsigned int corpus_order, double skew, uint64_t seed,
+                     unsigned int threads) {
+
+    ofstream out(filename, ios::trunc);
+
+    out << "{" << endl;
+    out << "  \"corpus\": {\"bytes\": " << corpus_bytes << ", \"symbols\": " << corpus_symbols
+        << ", \"order\": " << corpus_order << ", \"skew\": " << skew << ", \"seed\": " << seed << "}," << endl;
+    out << "  \"threads\": " << threads << "," << endl;
+    out << "  \"results\": [" << endl;
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const phaseResult &r = results[i];
+
+        out << "    {\"k\": " << r.order << ", \"phase\": \"" << r.phase << "\""
+            << ", \"seconds\": " << setprecision(9) << r.seconds
+            << ", \"bytes\": " << r.bytes << ", \"symbols\": " << r.symbols
+            << ", \"mb_per_s\": " << setprecision(6) << r.bytes / r.seconds / (1 << 20)
+            << ", \"threads\": " << r.threads
+            << ", \"mb_per_s_per_core\": " << setprecision(6) << r.bytes / r.seconds / (1 << 20) / r.threads
+            << ", \"symbols_per_s\": " << setprecision(6) << r.symbols / r.seconds
+            << ", \"peak_rss_kb\": " << r.peak_rss_kb;
+
+        if (r.bits_per_symbol > 0)
+            out << ", \"bits_per_symbol\": " << setprecision(6) << r.bits_per_symbol;
+
+        if (r.memory_budget > 0)
+            out << ", \"memory_budget\": " << r.memory_budget
+                << ", \"entropy_error\": " << setprecision(6) << r.bits_per_symbol - exactEntropy(results, r.order);
+
+        out << "}" << (i + 1 < results.size() ? "," : "") << endl;
+    }
+
+    out << "  ]" << endl;
+    out << "}" << endl;
+
+    if (!out.good()) {
+        cerr << "Fail writing results to '" << filename << "'" << endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void print_help() {
+    cout << "Usage: fcm_bench [options]" << endl;
+    cout << " -s       : size of the synthetic corpus in MB (default: " << DEFAULT_CORPUS_MB << ")" << endl;
+    cout << " -m       : order of the Markov chain generating the corpus (default: " << DEFAULT_CORPUS_ORDER << ")"
+         << endl;
+    cout << " -z       : Zipf exponent of the symbols of each context, higher is more predictable (default: "
+         << DEFAULT_SKEW << ")" << endl;
+    cout << " -r       : seed of the corpus (default: " << DEFAULT_SEED << ")" << endl;
+    cout << " -K       : orders to benchmark, e.g. 1..5 (default: 1..5)" << endl;
+    cout << " -g       : symbols to generate for each order (default: " << DEFAULT_GENERATED << ")" << endl;
+    cout << " -M       : memory budgets of approximate models to compare with the exact one, e.g. 1M,16M, or none"
+         << " (default: " << DEFAULT_BUDGETS << ")" << endl;
+    cout << " -j       : number of threads counting the input and coding blocks (default: 1)" << endl;
+    cout << " -o       : JSON file of the results (default: fcm_bench.json)" << endl;
+    cout << " -t       : directory of the temporary corpus and model (default: .)" << endl;
+    cout << " -h       : display this help" << endl;
+}
+
+/**
+ * Benchmark suite of the model: trains every order of a range on a seeded synthetic corpus and times
+ * counting, entropy, probabilities, text generation, saving, loading, compression and decompression, and
+ * the error of the entropy of approximate models within a range of memory budgets.
+ * The results go to stdout and to a JSON file, to compare builds.
+ */
+int main(int argc, char **argv) {
+
+    size_t corpus_mb = DEFAULT_CORPUS_MB;
+    unsigned int corpus_order = DEFAULT_CORPUS_ORDER;
+    double skew = DEFAULT_SKEW;
+    uint64_t seed = DEFAULT_SEED;
+    unsigned int min_k = 1, max_k = 5;
+    unsigned int generated = DEFAULT_GENERATED;
+    unsigned int threads = 1;
+    string json = "fcm_bench.json";
+    string directory = ".";
+    string budget_list = DEFAULT_BUDGETS;
+    vector<pair<string, size_t>> budgets;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:m:z:r:K:g:M:j:o:t:h")) != -1) {
+        switch (opt) {
+            case 's':
+                corpus_mb = (size_t) atol(optarg);
+                break;
+            case 'm':
+                corpus_order = (unsigned) atoi(optarg);
+                break;
+            case 'z':
+                skew = stod(optarg);
+                break;
+            case 'r':
+                seed = (uint64_t) stoull(optarg);
+                break;
+            case 'K': {
+                const char *range = strstr(optarg, "..");
+                min_k = range == nullptr ? 1 : (unsigned) atoi(optarg);
+                max_k = (unsigned) atoi(range == nullptr ? optarg : range + 2);
+                break;
+            }
+            case 'g':
+                generated = (unsigned) atoi(optarg);
+                break;
+            case 'M':
+                budget_list = optarg;
+                break;
+            case 'j':
+                threads = (unsigned) atoi(optarg);
+                break;
+            case 'o':
+                json = optarg;
+                break;
+            case 't':
+                directory = optarg;
+                break;
+            default:
+                print_help();
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (budget_list != "none") {
+        istringstream list(budget_list);
+
+        for (string budget; getline(list, budget, ',');)
+            budgets.emplace_back(budget, parseMemory(budget));
+    }
+
+    for (auto &budget : budgets) {
+        if (budget.second == 0) {
+            cerr << "Memory budget '" << budget.first << "' is invalid" << endl;
+            return 1;
+        }
+    }
+
+    if (corpus_mb == 0 || min_k == 0 || max_k < min_k || max_k > englishAlphabet::max_order || threads == 0
+        || generated < GENERATED_LINE_LENGTH) {
+        cerr << "Invalid benchmark options, -h for help" << endl;
+        return 1;
+    }
+
+    clog.setstate(ios::failbit);
+
+    string corpus = directory + "/fcm_bench_corpus.txt";
+    string model_file = directory + "/fcm_bench_model.dat";
+    size_t corpus_bytes = corpus_mb << 20;
+
+    uint64_t corpus_symbols = writeCorpus(corpus, corpus_bytes, corpus_order, skew, seed);
+    if (corpus_symbols == 0) {
+        cerr << "Fail writing the corpus '" << corpus << "'" << endl;
+        return 1;
+    }
+
+    cout << "corpus: " << corpus_bytes << " bytes, " << corpus_symbols << " symbols, order " << corpus_order
+         << ", skew " << skew << ", seed " << seed << endl;
+    cout << setw(6) << "order" << setw(26) << "phase" << setw(12) << "seconds" << setw(12) << "MB/s"
+         << setw(14) << "MB/s/core" << setw(16) << "symbols/s" << setw(14) << "peak RSS KB" << endl;
+
+    fcmBench bench(corpus, model_file, corpus_symbols, generated, threads, budgets);
+    vector<phaseResult> results;
+    bool ok = true;
+
+    for (unsigned int k = min_k; k <= max_k && ok; k++)
+        ok = bench.run(k, results);
+
+    unlink(corpus.c_str());
+
+    if (!ok) {
+        cerr << "Benchmark failed" << endl;
+        return 1;
+    }
+
+    if (!budgets.empty())
+        printErrors(results);
+
+    return writeJson(json, results, corpus_bytes, corpus_symbols, corpus_order, skew, seed, threads);
+}
@@ -0,0 +1,356 @@
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include "codec.h"
+#include "rangecoder.h"
+#include "profile.h"
+
+#define CODEC_NORMALIZE_LENGTH (1u << 16)   // bytes normalized at once before coding
+
+template<class alphabet>
+fcmCodec<alphabet>::fcmCodec(unsigned int order, double alpha, unsigned int num_threads)
+        : k(order), numThreads(max(num_threads, 1u)) {
+
+    // the smallest alpha kept is one unit, a symbol never seen after a context must still be possible
+    alpha_units = (uint32_t) max(1l, lround((alpha > 0 ? alpha : CODEC_DEFAULT_ALPHA) * CODEC_ALPHA_ONE));
+}
+
+template<class alphabet>
+void fcmCodec<alphabet>::setOrder(unsigned int order, unsigned int lanes) {
+
+    k = order;
+
+    powers.resize(k + 1);
+    powers[0] = 1;
+    for (unsigned int i = 1; i <= k; i++)
+        powers[i] = powers[i - 1] * alphabet::length;
+
+    models.clear();
+    for (unsigned int i = 0; i < lanes; i++)
+        models.push_back(countTable::create(k, alphabet::length));
+}
+
+template<class alphabet>
+uint32_t fcmCodec<alphabet>::frequencies(const countTable &model, uint64_t context, uint32_t *frequencies) const {
+
+    unsigned int counts[alphabet::length];
+    uint64_t total = 0;
+
+    if (!model.row(context, counts))
+        fill_n(counts, alphabet::length, 0);
+
+    for (unsigned int i = 0; i < alphabet::length; i++)
+        total += counts[i];
+
+    // (count + alpha) / (total + length * alpha), as fcm::getProbability(), in 1 / CODEC_ALPHA_ONE units
+    uint64_t weights = total * CODEC_ALPHA_ONE + (uint64_t) alphabet::length * alpha_units;
+
+    if (weights <= RANGE_MAX_TOTAL) {
+        for (unsigned int i = 0; i < alphabet::length; i++)
+            frequencies[i] = counts[i] * CODEC_ALPHA_ONE + alpha_units;
+        return (uint32_t) weights;
+    }
+
+    // scaled down to the coder by the shift leaving the weights within 15 bits, so the frequencies, each one
+    // 1 at least, add up to 2^15 + alphabet::length at most. The coder keeps 15 bits of the probabilities
+    unsigned int shift = 64 - (unsigned int) __builtin_clzll(weights) - 15;
+    uint32_t sum = 0;
+
+    for (unsigned int i = 0; i < alphabet::length; i++) {
+        frequencies[i] = 1 + (uint32_t) (((uint64_t) counts[i] * CODEC_ALPHA_ONE + alpha_units) >> shift);
+        sum += frequencies[i];
+    }
+
+    return sum;
+}
+
+template<class alphabet>
+void fcmCodec<alphabet>::encodeBlock(const uint8_t *codes, size_t count, countTable &model,
+                                     vector<uint8_t> &out) const {
+
+    const uint64_t oldest_weight = powers[k - 1];
+    rangeEncoder coder(out);
+    uint64_t context = 0;
+    uint32_t frequency[alphabet::length];
+
+    for (size_t i = 0; i < count; i++) {
+        unsigned int symbol = codes[i];
+
+        // the first k codes of the block fill its context, they are coded as equally likely and aren't counted
+        if (i < k) coder.encode(symbol, 1, alphabet::length);
+        else {
+            uint32_t total = frequencies(model, context, frequency);
+            uint32_t cumulative = 0;
+
+            for (unsigned int s = 0; s < symbol; s++)
+                cumulative += frequency[s];
+
+            coder.encode(cumulative, frequency[symbol], total);
+            model.increment(context, symbol);
+        }
+
+        // the oldest symbol of the context is in the block past its first k codes, see fcm::scoreCodes()
+        uint64_t oldest = i >= k ? codes[i - k] : context / oldest_weight;
+        context = (context - oldest * oldest_weight) * alphabet::length + symbol;
+    }
+
+    coder.finish();
+}
+
+template<class alphabet>
+void fcmCodec<alphabet>::decodeBlock(const uint8_t *data, size_t length, size_t count, countTable &model,
+                                     uint8_t *codes) const {
+
+    const uint64_t oldest_weight = powers[k - 1];
+    rangeDecoder coder(data, length);
+    uint64_t context = 0;
+    uint32_t frequency[alphabet::length];
+
+    for (size_t i = 0; i < count; i++) {
+        unsigned int symbol;
+
+        if (i < k) {
+            symbol = coder.target(alphabet::length);
+            coder.decode(symbol, 1);
+        } else {
+            uint32_t target = coder.target(frequencies(model, context, frequency));
+            uint32_t cumulative = 0;
+            symbol = 0;
+
+            // target is below the total, so the search stops at the last symbol at most
+            while (cumulative + frequency[symbol] <= target)
+                cumulative += frequency[symbol++];
+
+            coder.decode(cumulative, frequency[symbol]);
+            model.increment(context, symbol);
+        }
+        codes[i] = (uint8_t) symbol;
+
+        uint64_t oldest = i >= k ? codes[i - k] : context / oldest_weight;
+        context = (context - oldest * oldest_weight) * alphabet::length + symbol;
+    }
+}
+
+template<class alphabet>
+void fcmCodec<alphabet>::parallelFor(size_t count, const function<void(size_t)> &work) {
+
+    atomic<size_t> next(0);
+
+    auto worker = [&]() {
+        for (size_t i; (i = next.fetch_add(1)) < count;)
+            work(i);
+    };
+
+    vector<thread> threads;
+    for (unsigned int t = 1; t < min((size_t) numThreads, count); t++)
+        threads.emplace_back(worker);
+
+    worker();
+
+    for (auto &t : threads)
+        t.join();
+}
+
+template<class alphabet>
+int fcmCodec<alphabet>::compress(inputSource *input, ostream &out, codecStats &stats) {
+
+    phaseTimer timer(phase::compress);
+    const size_t round = (size_t) CODEC_BLOCK_SYMBOLS * numThreads;
+    vector<uint8_t> pending;                    // codes not coded yet
+    vector<vector<uint8_t>> coded(numThreads);  // coded bytes of each block of a round
+    vector<uint32_t> checksums(numThreads);
+
+    // a lane per thread, each one starting from an empty model
+    setOrder(k, numThreads);
+
+    codecHeader header = {};
+    memcpy(header.magic, CODEC_MAGIC, sizeof(header.magic));
+    header.version = CODEC_VERSION;
+    header.order = k;
+    header.alphabet_length = alphabet::length;
+    header.block_symbols = CODEC_BLOCK_SYMBOLS;
+    header.lanes = numThreads;
+    header.alpha = alpha_units;
+    strncpy(header.alphabet, alphabet::name, sizeof(header.alphabet) - 1);
+
+    out.write((const char *) &header, sizeof(header));
+    stats.output_bytes += sizeof(header);
+
+    // codes the first count pending codes, up to a block per lane, and writes the blocks in order
+    auto codeRound = [&](size_t count) {
+        size_t blocks = (count + CODEC_BLOCK_SYMBOLS - 1) / CODEC_BLOCK_SYMBOLS;
+
+        parallelFor(blocks, [&](size_t b) {
+            const uint8_t *codes = pending.data() + b * CODEC_BLOCK_SYMBOLS;
+            size_t symbols = min((size_t) CODEC_BLOCK_SYMBOLS, count - b * CODEC_BLOCK_SYMBOLS);
+
+            coded[b].clear();
+            encodeBlock(codes, symbols, *models[b], coded[b]);
+            checksums[b] = blockChecksum(codes, symbols);
+        });
+
+        for (size_t b = 0; b < blocks; b++) {
+            codecBlock block = {(uint32_t) min((size_t) CODEC_BLOCK_SYMBOLS, count - b * CODEC_BLOCK_SYMBOLS),
+                                (uint32_t) coded[b].size(), checksums[b]};
+
+            out.write((const char *) &block, sizeof(block));
+            out.write((const char *) coded[b].data(), coded[b].size());
+            stats.output_bytes += sizeof(block) + coded[b].size();
+        }
+
+        stats.blocks += blocks;
+        stats.symbols += count;
+        pending.erase(pending.begin(), pending.begin() + count);
+    };
+
+    bool ok = input->forEachBlock([&](const char *data, size_t length) {
+        stats.input_bytes += length;
+
+        for (size_t offset = 0; offset < length; offset += CODEC_NORMALIZE_LENGTH) {
+            size_t chunk = min(length - offset, (size_t) CODEC_NORMALIZE_LENGTH);
+            size_t used = pending.size();
+
+            pending.resize(used + chunk + NORMALIZE_SLACK);
+            pending.resize(used + alphabet::normalize(data + offset, chunk, pending.data() + used));
+
+            if (pending.size() >= round)
+                codeRound(round);
+        }
+    });
+
+    if (!pending.empty())
+        codeRound(pending.size());
+
+    timer.symbols = stats.symbols;
+    timer.bytes = stats.input_bytes;
+
+    if (!ok || !out.good()) {
+        cerr << "Error compressing the input" << endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+template<class alphabet>
+int fcmCodec<alphabet>::decompress(const char *data, size_t length, ostream &out, codecStats &stats) {
+
+    phaseTimer timer(phase::decompress);
+    codecHeader header;
+
+    if (length < sizeof(header) || memcmp(data, CODEC_MAGIC, sizeof(header.magic)) != 0) {
+        cerr << "Input is not a compressed file" << endl;
+        return 1;
+    }
+
+    memcpy(&header, data, sizeof(header));
+    header.alphabet[sizeof(header.alphabet) - 1] = '\0';
+
+    if (header.version != CODEC_VERSION || header.block_symbols == 0) {
+        cerr << "Compressed file version " << header.version << " is not supported" << endl;
+        return 1;
+    }
+
+    if (strcmp(header.alphabet, alphabet::name) != 0 || header.alphabet_length != alphabet::length) {
+        cerr << "Input was compressed with the alphabet '" << header.alphabet << "', not '" << alphabet::name
+             << "'" << endl;
+        return 1;
+    }
+
+    if (header.order == 0 || header.order > alphabet::max_order) {
+        cerr << "Compressed file has an unsupported order" << endl;
+        return 1;
+    }
+
+    if (header.lanes == 0 || header.lanes > CODEC_MAX_LANES || header.alpha == 0) {
+        cerr << "Compressed file is corrupt" << endl;
+        return 1;
+    }
+
+    setOrder(header.order, header.lanes);
+    alpha_units = header.alpha;
+
+    // find every block first, then decode them a round of one per thread at a time
+    vector<pair<codecBlock, const uint8_t *>> blocks;
+
+    for (size_t pos = sizeof(header); pos < length;) {
+        codecBlock block;
+
+        if (length - pos < sizeof(block)) {
+            cerr << "Compressed file is truncated" << endl;
+            return 1;
+        }
+
+        memcpy(&block, data + pos, sizeof(block));
+        pos += sizeof(block);
+
+        if (block.bytes > length - pos || block.symbols > header.block_symbols) {
+            cerr << "Compressed file is truncated or corrupt" << endl;
+            return 1;
+        }
+
+        blocks.emplace_back(block, (const uint8_t *) data + pos);
+        pos += block.bytes;
+    }
+
+    vector<vector<uint8_t>> codes(header.lanes);
+    vector<string> text(header.lanes);
+    vector<char> intact(header.lanes);
+
+    // a round has a block of each lane, decoded by up to numThreads threads
+    for (size_t first = 0; first < blocks.size(); first += header.lanes) {
+        size_t count = min((size_t) header.lanes, blocks.size() - first);
+
+        parallelFor(count, [&](size_t b) {
+            const codecBlock &block = blocks[first + b].first;
+
+            codes[b].resize(block.symbols);
+            decodeBlock(blocks[first + b].second, block.bytes, block.symbols, *models[b], codes[b].data());
+            intact[b] = blockChecksum(codes[b].data(), block.symbols) == block.checksum;
+
+            text[b].resize(block.symbols);
+            for (size_t i = 0; i < block.symbols; i++)
+                text[b][i] = alphabet::decode(codes[b][i]);
+        });
+
+        for (size_t b = 0; b < count; b++) {
+            if (!intact[b]) {
+                cerr << "Block " << first + b << " of the compressed file is corrupt" << endl;
+                return 1;
+            }
+
+            out.write(text[b].data(), text[b].size());
+            stats.symbols += text[b].size();
+        }
+    }
+
+    stats.input_bytes = length;
+    stats.output_bytes = stats.symbols;
+    stats.blocks = blocks.size();
+
+    timer.symbols = stats.symbols;
+    timer.bytes = stats.input_bytes;
+
+    if (!out.good()) {
+        cerr << "Error writing the decompressed data" << endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+uint32_t blockChecksum(const uint8_t *codes, size_t count) {
+
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < count; i++)
+        hash = (hash ^ codes[i]) * 16777619u;
+
+    return hash;
+}
+
+template class fcmCodec<englishAlphabet>;
+template class fcmCodec<portugueseAlphabet>;
+template class fcmCodec<dnaAlphabet>;
+template class fcmCodec<byteAlphabet>;
@@ -0,0 +1,179 @@
+#ifndef CAV_GMZ_CODEC_H
+#define CAV_GMZ_CODEC_H
+
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "ingest.h"
+#include "alphabet.h"
+#include "counttable.h"
+
+using namespace std;
+
+#define CODEC_MAGIC "FCMZ"
+#define CODEC_VERSION 3
+#define CODEC_BLOCK_SYMBOLS (1u << 20)  // symbols of each block
+#define CODEC_MAX_LANES 1024            // most lanes of a compressed file
+#define CODEC_ALPHA_ONE 1024            // units of alpha in a compressed file, alpha is a multiple of 1 / 1024
+#define CODEC_DEFAULT_ALPHA (1.0 / 32)  // alpha of the estimator when none is given
+
+/**
+ * Header of a compressed file. The file layout, in native byte order, is:
+ *  - this header
+ *  - blocks one after the other, each one a codecBlock followed by its coded bytes
+ * Block i is coded by lane i % lanes. Each lane has its own model, carried over from one of its blocks to
+ * the next, so the lanes can be coded and decoded concurrently
+ */
+struct codecHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t order;
+    uint32_t alphabet_length;
+    uint32_t block_symbols;     // symbols of every block but the last one
+    uint32_t lanes;             // models coding the blocks, one after the other
+    uint32_t alpha;             // alpha of the estimator, in 1 / CODEC_ALPHA_ONE units
+    char alphabet[32];          // name of the alphabet policy
+};
+
+/**
+ * Header of a block of a compressed file
+ */
+struct codecBlock {
+    uint32_t symbols;           // symbols coded in the block
+    uint32_t bytes;             // coded bytes following this header
+    uint32_t checksum;          // FNV-1a of the alphabet codes of the block
+};
+
+/**
+ * Sizes of a compression or decompression
+ */
+struct codecStats {
+    uint64_t symbols = 0;       // alphabet symbols coded
+    uint64_t input_bytes = 0;
+    uint64_t output_bytes = 0;
+    uint64_t blocks = 0;
+};
+
+/**
+ * Compressor of the alphabet codes of an input with an adaptive order k model driving a range coder.
+ * The model is a count table, as the one fcm trains, counting each context exactly as its symbols are coded.
+ * The first k symbols of a block have no complete context yet: they are coded as equally likely and, as in
+ * fcm::countCodes(), not counted.
+ * A symbol is coded with the probability of fcm::getProbability(), (count + alpha) / (total + length * alpha),
+ * scaled to the frequencies the coder takes, so with alpha above 0 no symbol is ever impossible.
+ * Like the rest of the model, only the symbols of the alphabet are kept: decompressing gives back the
+ * normalized text, which is the original input for the bytes alphabet
+ * @tparam alphabet alphabet policy
+ */
+template<class alphabet>
+class fcmCodec {
+public:
+
+    /**
+     * @param order context order of the model, up to alphabet::max_order. Decompression uses the order
+     * stored in the file
+     * @param alpha alpha of the estimator, rounded to a multiple of 1 / CODEC_ALPHA_ONE, CODEC_DEFAULT_ALPHA if 0.
+     * Decompression uses the alpha stored in the file
+     * @param num_threads number of threads coding blocks, and lanes of a compression
+     */
+    fcmCodec(unsigned int order, double alpha, unsigned int num_threads);
+
+    /**
+     * Compresses an input
+     * @param input data to compress
+     * @param out where to write the compressed file
+     * @param stats where to store the sizes
+     * @return 0 if compression successful 1 if unsuccessful
+     */
+    int compress(inputSource *input, ostream &out, codecStats &stats);
+
+    /**
+     * Decompresses a compressed file
+     * @param data contents of the compressed file
+     * @param length length of the compressed file
+     * @param out where to write the decoded symbols
+     * @param stats where to store the sizes
+     * @return 0 if decompression successful 1 if unsuccessful (the reason is printed to cerr)
+     */
+    int decompress(const char *data, size_t length, ostream &out, codecStats &stats);
+
+private:
+
+    /**
+     * Context order
+     */
+    unsigned int k;
+
+    /**
+     * Alpha of the estimator, in 1 / CODEC_ALPHA_ONE units
+     */
+    uint32_t alpha_units;
+
+    /**
+     * Number of threads coding blocks
+     */
+    unsigned int numThreads;
+
+    /**
+     * Integer powers of the alphabet length, from 0 to k
+     */
+    vector<uint64_t> powers;
+
+    /**
+     * Model of each lane, carried over from block to block
+     */
+    vector<unique_ptr<countTable>> models;
+
+    /**
+     * Sets the order and makes empty models for it, models are made by compress() and decompress() only
+     * @param order context order
+     * @param lanes number of models
+     */
+    void setOrder(unsigned int order, unsigned int lanes);
+
+    /**
+     * Frequencies of the symbols after a context, the probabilities of the estimator scaled to the coder
+     * @param model counters
+     * @param context index of the context
+     * @param frequencies where to store the alphabet::length frequencies, none of them 0
+     * @return sum of the frequencies, up to RANGE_MAX_TOTAL
+     */
+    uint32_t frequencies(const countTable &model, uint64_t context, uint32_t *frequencies) const;
+
+    /**
+     * Codes a block, counting its symbols into the model
+     * @param codes alphabet codes of the block
+     * @param count number of codes
+     * @param model counters of the lane of the block
+     * @param out where to append the coded bytes
+     */
+    void encodeBlock(const uint8_t *codes, size_t count, countTable &model, vector<uint8_t> &out) const;
+
+    /**
+     * Decodes a block, see encodeBlock()
+     * @param data coded bytes
+     * @param length number of coded bytes
+     * @param count number of codes to decode
+     * @param model counters of the lane of the block
+     * @param codes where to store the codes
+     */
+    void decodeBlock(const uint8_t *data, size_t length, size_t count, countTable &model, uint8_t *codes) const;
+
+    /**
+     * Calls a function for every index from 0 to count - 1, in up to numThreads threads
+     * @param count number of indexes
+     * @param work function called with the index
+     */
+    void parallelFor(size_t count, const function<void(size_t index)> &work);
+};
+
+/**
+ * Checksum of the alphabet codes of a block, 32 bit FNV-1a
+ * @param codes alphabet codes
+ * @param count number of codes
+ * @return checksum of the codes
+ */
+uint32_t blockChecksum(const uint8_t *codes, size_t count);
+
+#endif //CAV_GMZ_CODEC_H
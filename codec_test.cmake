@@ -0,0 +1,40 @@
+# Round trip of the codec, run by ctest: compresses INPUT with an order ORDER model of the alphabet ALPHABET in
+# THREADS lanes, pipes it to the decompression and compares what comes out with INPUT normalized to the alphabet.
+# With LINES, the input is a text of LINES lines of 99 characters generated from an order 3 model of INPUT, long
+# enough for every lane to code several blocks. WORK is the prefix of the files written
+
+set(input ${INPUT})
+
+if (LINES)
+    execute_process(COMMAND ${FCM} -k 3 --seed 1 -c 99 -l ${LINES} --gen-file ${WORK}.txt ${INPUT}
+                    RESULT_VARIABLE status OUTPUT_QUIET)
+    if (NOT status EQUAL 0)
+        message(FATAL_ERROR "Generating the input failed: ${status}")
+    endif ()
+    set(input ${WORK}.txt)
+endif ()
+
+execute_process(COMMAND ${FCM} -A ${ALPHABET} -k ${ORDER} -j ${THREADS} --compress ${input}
+                COMMAND ${FCM} -A ${ALPHABET} -j ${THREADS} --decompress
+                OUTPUT_FILE ${WORK}.out RESULT_VARIABLE status)
+if (NOT status EQUAL 0)
+    message(FATAL_ERROR "Compressing and decompressing failed: ${status}")
+endif ()
+
+# the bytes alphabet keeps every byte, the english one folds upper case and drops the symbols it doesn't have
+if (ALPHABET STREQUAL "bytes")
+    set(expected ${input})
+elseif (ALPHABET STREQUAL "english")
+    file(READ ${input} text)
+    string(TOLOWER "${text}" text)
+    string(REGEX REPLACE "[^a-z ]" "" text "${text}")
+    file(WRITE ${WORK}.expected "${text}")
+    set(expected ${WORK}.expected)
+else ()
+    message(FATAL_ERROR "No normalization of the alphabet '${ALPHABET}' to compare with")
+endif ()
+
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${expected} ${WORK}.out RESULT_VARIABLE status)
+if (NOT status EQUAL 0)
+    message(FATAL_ERROR "Decompressed data differs from the input normalized to the alphabet")
+endif ()
@@ -0,0 +1,428 @@
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include "counttable.h"
+
+// biggest dense table allowed, in number of counters (64MB of unsigned int)
+#define DENSE_MAX_CELLS (1u << 24)
+
+unique_ptr<countTable> countTable::create(unsigned int order, unsigned int width, uint64_t symbols) {
+
+    // number of possible contexts is width^order, stop as soon as it doesn't fit the dense limit
+    size_t rows = 1;
+    for (unsigned int i = 0; i < order; i++) {
+        rows *= width;
+        if (rows * width > DENSE_MAX_CELLS || rows > symbols)
+            return unique_ptr<countTable>(new sparseCountTable(width));
+    }
+
+    return unique_ptr<countTable>(new denseCountTable(rows, width));
+}
+
+void countTable::merge(const countTable &other) {
+
+    other.forEach([this](uint64_t context, const unsigned int *row) {
+        add(context, row);
+    });
+}
+
+denseCountTable::denseCountTable(size_t rows, unsigned int row_width) : countTable(row_width),
+                                                                        cells(rows * row_width, 0),
+                                                                        totals(rows, 0),
+                                                                        seen_contexts(0) {
+}
+
+void denseCountTable::increment(uint64_t context, unsigned int symbol) {
+
+    if (totals[context]++ == 0)
+        seen_contexts++;
+
+    cells[(size_t) context * width + symbol]++;
+    total_count++;
+}
+
+void denseCountTable::add(uint64_t context, const unsigned int *counts) {
+
+    unsigned int *dst = &cells[(size_t) context * width];
+    unsigned int sum = 0;
+
+    for (unsigned int i = 0; i < width; i++) {
+        dst[i] += counts[i];
+        sum += counts[i];
+    }
+
+    // an empty row doesn't make the context seen
+    if (totals[context] == 0 && sum > 0)
+        seen_contexts++;
+
+    totals[context] += sum;
+    total_count += sum;
+}
+
+void denseCountTable::merge(const countTable &other) {
+
+    const denseCountTable *dense = dynamic_cast<const denseCountTable *>(&other);
+
+    // same layout on both sides, add the arrays cell by cell
+    if (dense == nullptr || dense->cells.size() != cells.size()) {
+        countTable::merge(other);
+        return;
+    }
+
+    for (size_t context = 0; context < totals.size(); context++) {
+        if (dense->totals[context] != 0 && totals[context] == 0)
+            seen_contexts++;
+
+        totals[context] += dense->totals[context];
+    }
+
+    for (size_t i = 0; i < cells.size(); i++)
+        cells[i] += dense->cells[i];
+
+    total_count += dense->total_count;
+}
+
+bool denseCountTable::row(uint64_t context, unsigned int *counts) const {
+
+    if (context >= totals.size() || totals[context] == 0)
+        return false;
+
+    copy_n(&cells[(size_t) context * width], width, counts);
+    return true;
+}
+
+void denseCountTable::forEach(const visitor &visit) const {
+
+    for (uint64_t context = 0; context < totals.size(); context++)
+        if (totals[context] != 0)
+            visit(context, &cells[context * width]);
+}
+
+void denseCountTable::forEachInPart(unsigned int part, unsigned int parts, const totalVisitor &visit) const {
+
+    size_t first = totals.size() * part / parts, last = totals.size() * (part + 1) / parts;
+
+    for (uint64_t context = first; context < last; context++)
+        if (totals[context] != 0)
+            visit(context, &cells[context * width], totals[context]);
+}
+
+bool denseCountTable::decay(size_t &dropped) {
+
+    size_t seen = seen_contexts;
+
+    seen_contexts = 0;
+    total_count = 0;
+
+    for (size_t context = 0; context < totals.size(); context++) {
+        if (totals[context] == 0)
+            continue;
+
+        unsigned int *row = &cells[context * width];
+        unsigned int sum = 0;
+
+        for (unsigned int i = 0; i < width; i++) {
+            row[i] >>= 1;
+            sum += row[i];
+        }
+
+        totals[context] = sum;
+        total_count += sum;
+
+        if (sum != 0)
+            seen_contexts++;
+    }
+
+    dropped = seen - seen_contexts;
+    return true;
+}
+
+compactRow::compactRow(compactRow &&other) noexcept : used(other.used), counter_width(other.counter_width) {
+
+    memcpy(symbols, other.symbols, sizeof(symbols));
+
+    if (counter_width != 0)
+        dense = other.dense;
+    else
+        memcpy(counts, other.counts, sizeof(counts));
+
+    // the array now belongs to this row
+    other.counter_width = 0;
+    other.used = 0;
+}
+
+uint32_t compactRow::denseGet(unsigned int symbol) const {
+
+    switch (counter_width) {
+        case 1:
+            return dense[symbol];
+        case 2:
+            return reinterpret_cast<const uint16_t *>(dense)[symbol];
+        default:
+            return reinterpret_cast<const uint32_t *>(dense)[symbol];
+    }
+}
+
+void compactRow::denseSet(unsigned int symbol, uint32_t value) {
+
+    if (counter_width == 1)
+        dense[symbol] = (uint8_t) value;
+    else if (counter_width == 2)
+        reinterpret_cast<uint16_t *>(dense)[symbol] = (uint16_t) value;
+    else
+        reinterpret_cast<uint32_t *>(dense)[symbol] = value;
+}
+
+void compactRow::toDense(unsigned int bytes, unsigned int width, slabArena &arena) {
+
+    uint8_t *array = static_cast<uint8_t *>(arena.allocate(sizeof(uint32_t) + (size_t) bytes * width));
+    unsigned int values[256];
+    uint32_t sum = total();
+
+    expand(values, width);
+
+    if (counter_width != 0)
+        arena.release(dense - sizeof(uint32_t), heapBytes(width));
+
+    dense = array + sizeof(uint32_t);
+    counter_width = (uint8_t) bytes;
+    denseTotal() = sum;
+
+    for (unsigned int i = 0; i < width; i++)
+        denseSet(i, values[i]);
+}
+
+void compactRow::add(unsigned int symbol, unsigned int count, unsigned int width, slabArena &arena) {
+
+    if (counter_width == 0) {
+        unsigned int i = 0;
+
+        while (i < used && symbols[i] != symbol)
+            i++;
+
+        if (i < used && counts[i] + count <= UINT16_MAX) {
+            counts[i] += count;
+            return;
+        }
+
+        if (i == used && used < INLINE_PAIRS && count <= UINT16_MAX) {
+            symbols[used] = (uint8_t) symbol;
+            counts[used++] = (uint16_t) count;
+            return;
+        }
+
+        // no room inline: an array of 8 bit counters, or 16 bit ones if a count doesn't fit
+        uint32_t largest = count + (i < used ? counts[i] : 0);
+        for (unsigned int j = 0; j < used; j++)
+            largest = max(largest, (uint32_t) counts[j]);
+
+        toDense(largest <= UINT8_MAX ? 1 : largest <= UINT16_MAX ? 2 : 4, width, arena);
+    }
+
+    uint32_t value = denseGet(symbol) + count;
+
+    // widen the whole array when a counter overflows
+    if (counter_width == 1 && value > UINT8_MAX)
+        toDense(value <= UINT16_MAX ? 2 : 4, width, arena);
+    else if (counter_width == 2 && value > UINT16_MAX)
+        toDense(4, width, arena);
+
+    denseSet(symbol, value);
+    denseTotal() += count;
+}
+
+void compactRow::expand(unsigned int *counts_out, unsigned int width) const {
+
+    if (counter_width != 0) {
+        for (unsigned int i = 0; i < width; i++)
+            counts_out[i] = denseGet(i);
+        return;
+    }
+
+    fill_n(counts_out, width, 0);
+    for (unsigned int i = 0; i < used; i++)
+        counts_out[symbols[i]] = counts[i];
+}
+
+unsigned int compactRow::total() const {
+
+    unsigned int sum = 0;
+
+    if (counter_width != 0)
+        return denseTotal();
+
+    for (unsigned int i = 0; i < used; i++)
+        sum += counts[i];
+
+    return sum;
+}
+
+unsigned int compactRow::halve(unsigned int width, slabArena &arena) {
+
+    unsigned int sum = 0;
+
+    if (counter_width == 0) {
+        unsigned int kept = 0;
+
+        for (unsigned int i = 0; i < used; i++) {
+            if (counts[i] < 2)
+                continue;
+
+            symbols[kept] = symbols[i];
+            counts[kept] = counts[i] >> 1;
+            sum += counts[kept++];
+        }
+
+        used = (uint8_t) kept;
+        return sum;
+    }
+
+    // halved counters still fit the width they have, the array is kept as it is
+    for (unsigned int i = 0; i < width; i++) {
+        uint32_t value = denseGet(i) >> 1;
+        denseSet(i, value);
+        sum += value;
+    }
+
+    if (sum == 0) {
+        arena.release(dense - sizeof(uint32_t), heapBytes(width));
+        counter_width = 0;
+        used = 0;
+    } else {
+        denseTotal() = sum;
+    }
+
+    return sum;
+}
+
+unsigned int compactRow::get(unsigned int symbol) const {
+
+    if (counter_width != 0)
+        return denseGet(symbol);
+
+    for (unsigned int i = 0; i < used; i++)
+        if (symbols[i] == symbol)
+            return counts[i];
+
+    return 0;
+}
+
+sparseCountTable::sparseCountTable(unsigned int row_width) : countTable(row_width),
+                                                              rows(0, hash<uint64_t>(), equal_to<uint64_t>(),
+                                                                   rowMap::allocator_type(&arena)) {
+}
+
+void sparseCountTable::increment(uint64_t context, unsigned int symbol) {
+
+    rows[context].add(symbol, 1, width, arena);
+    total_count++;
+}
+
+void sparseCountTable::add(uint64_t context, const unsigned int *counts) {
+
+    unsigned int sum = 0;
+    for (unsigned int i = 0; i < width; i++)
+        sum += counts[i];
+
+    // an empty row doesn't make the context seen
+    if (sum == 0)
+        return;
+
+    compactRow &counters = rows[context];
+
+    for (unsigned int i = 0; i < width; i++)
+        if (counts[i] != 0)
+            counters.add(i, counts[i], width, arena);
+
+    total_count += sum;
+}
+
+bool sparseCountTable::row(uint64_t context, unsigned int *counts) const {
+
+    auto it = rows.find(context);
+
+    if (it == rows.end())
+        return false;
+
+    it->second.expand(counts, width);
+    return true;
+}
+
+unsigned int sparseCountTable::rowTotal(uint64_t context) const {
+
+    auto it = rows.find(context);
+
+    return it == rows.end() ? 0 : it->second.total();
+}
+
+unsigned int sparseCountTable::lookup(uint64_t context, unsigned int symbol, unsigned int &row_total) const {
+
+    auto it = rows.find(context);
+
+    if (it == rows.end()) {
+        row_total = 0;
+        return 0;
+    }
+
+    row_total = it->second.total();
+    return it->second.get(symbol);
+}
+
+void sparseCountTable::forEach(const visitor &visit) const {
+
+    // hash table has no order, sort the contexts before visiting them
+    vector<uint64_t> contexts;
+    vector<unsigned int> counts(width);
+    contexts.reserve(rows.size());
+
+    for (auto &it : rows)
+        contexts.push_back(it.first);
+
+    sort(contexts.begin(), contexts.end());
+
+    for (auto context : contexts) {
+        rows.find(context)->second.expand(counts.data(), width);
+        visit(context, counts.data());
+    }
+}
+
+bool sparseCountTable::decay(size_t &dropped) {
+
+    dropped = 0;
+    total_count = 0;
+
+    // erased nodes go back to the free lists of the arena, for the contexts counted next
+    for (auto it = rows.begin(); it != rows.end();) {
+        unsigned int sum = it->second.halve(width, arena);
+
+        if (sum == 0) {
+            it = rows.erase(it);
+            dropped++;
+        } else {
+            total_count += sum;
+            ++it;
+        }
+    }
+
+    return true;
+}
+
+bool sparseCountTable::arenaStats(arenaUsage &usage) const {
+
+    usage = arena.usage();
+    return true;
+}
+
+void sparseCountTable::forEachInPart(unsigned int part, unsigned int parts, const totalVisitor &visit) const {
+
+    // parts are ranges of buckets, no need to sort
+    size_t first = rows.bucket_count() * part / parts, last = rows.bucket_count() * (part + 1) / parts;
+    vector<unsigned int> counts(width);
+
+    for (size_t bucket = first; bucket < last; bucket++) {
+        for (auto it = rows.begin(bucket); it != rows.end(bucket); ++it) {
+            it->second.expand(counts.data(), width);
+            visit(it->first, counts.data(), it->second.total());
+        }
+    }
+}
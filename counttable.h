@@ -0,0 +1,373 @@
+#ifndef CAV_GMZ_COUNTTABLE_H
+#define CAV_GMZ_COUNTTABLE_H
+
+
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include "arena.h"
+
+using namespace std;
+
+/**
+ * Storage for the occurrence counters of the model. Each row is a context (indexed as computed by
+ * fcm::mapPosCalc()) and each column is a symbol of the alphabet.
+ * The total of each row and of the whole table are kept up to date as counters are added,
+ * so they never need to be recomputed. Only a table read from a model file, which has no totals, adds
+ * up a row when asked for its total, and a sketch estimates the rows of the contexts it doesn't keep.
+ */
+class countTable {
+public:
+
+    /**
+     * Callback used to visit the rows of the table. The row may be a copy, only valid during the call
+     */
+    typedef function<void(uint64_t context, const unsigned int *row)> visitor;
+
+    /**
+     * Callback used to visit the rows of the table along with their totals. The row may be a copy,
+     * only valid during the call
+     */
+    typedef function<void(uint64_t context, const unsigned int *row, unsigned int total)> totalVisitor;
+
+    virtual ~countTable() = default;
+
+    /**
+     * Increments the counter of a symbol for the given context
+     * @param context index of the context
+     * @param symbol alphabet code of the symbol
+     */
+    virtual void increment(uint64_t context, unsigned int symbol) = 0;
+
+    /**
+     * Adds a whole row of counters to the given context
+     * @param context index of the context
+     * @param counts array with rowWidth() counters
+     */
+    virtual void add(uint64_t context, const unsigned int *counts) = 0;
+
+    /**
+     * Adds every row of another table to this one
+     * @param other table with the same row width
+     */
+    virtual void merge(const countTable &other);
+
+    /**
+     * Copies the counters of a context, rows aren't necessarily stored as an array of counters
+     * @param context index of the context
+     * @param counts array where to copy the rowWidth() counters
+     * @return false if the context was never seen, counts is left untouched then
+     */
+    virtual bool row(uint64_t context, unsigned int *counts) const = 0;
+
+    /**
+     * Returns the sum of the counters of a context
+     * @param context index of the context
+     * @return total of the row, 0 if the context was never seen
+     */
+    virtual unsigned int rowTotal(uint64_t context) const = 0;
+
+    /**
+     * Returns the counter of a symbol along with the total of its row, with a single lookup of the context
+     * @param context index of the context
+     * @param symbol alphabet code of the symbol
+     * @param row_total where to store the total of the row, 0 if the context was never seen
+     * @return counter of the symbol
+     */
+    virtual unsigned int lookup(uint64_t context, unsigned int symbol, unsigned int &row_total) const = 0;
+
+    /**
+     * Visits every seen context in ascending context order
+     * @param visit callback called for each row
+     */
+    virtual void forEach(const visitor &visit) const = 0;
+
+    /**
+     * Visits the seen contexts of one part of the table, in no particular order. The parts split the table
+     * in ranges that can be visited concurrently
+     * @param part part to visit, from 0 to parts - 1
+     * @param parts number of parts the table is split in
+     * @param visit callback called for each row
+     */
+    virtual void forEachInPart(unsigned int part, unsigned int parts, const totalVisitor &visit) const = 0;
+
+    /**
+     * @return number of contexts seen
+     */
+    virtual size_t size() const = 0;
+
+    /**
+     * Entropy kept up to date while counting, by the tables that can't visit every context they counted
+     * @param entropy where to store the entropy, in bits per symbol
+     * @return false if the entropy has to be summed from the rows
+     */
+    virtual bool runningEntropy(double &) const { return false; }
+
+    /**
+     * Allocation counters of the tables whose rows come from an arena
+     * @param usage where to store the counters
+     * @return false if the table has no arena
+     */
+    virtual bool arenaStats(arenaUsage &) const { return false; }
+
+    /**
+     * Halves every counter, rounding down, and drops the contexts left without counts. Done every n symbols,
+     * a count from m halvings ago weighs 2^-m, and the table never holds more than 2n contexts
+     * @param dropped where to store the number of contexts dropped
+     * @return false if the table can't be changed in place
+     */
+    virtual bool decay(size_t &) { return false; }
+
+    /**
+     * @return number of counters in each row (the alphabet length)
+     */
+    unsigned int rowWidth() const { return width; }
+
+    /**
+     * @return sum of every counter of the table
+     */
+    uint64_t total() const { return total_count; }
+
+    /**
+     * Creates the storage that better fits the given order: a dense table when every possible context fits in
+     * memory and a sparse hash table otherwise
+     * @param order context order
+     * @param width alphabet length
+     * @param symbols most symbols that will be counted, a dense table is only picked if they can visit
+     * every possible context, so small inputs don't pay for clearing a large array
+     * @return the new table
+     */
+    static unique_ptr<countTable> create(unsigned int order, unsigned int width, uint64_t symbols = UINT64_MAX);
+
+protected:
+
+    explicit countTable(unsigned int row_width) : width(row_width), total_count(0) {}
+
+    /**
+     * Number of counters per row
+     */
+    unsigned int width;
+
+    /**
+     * Sum of every counter
+     */
+    uint64_t total_count;
+};
+
+/**
+ * Count table holding every possible context in one contiguous array. Used for small orders,
+ * where updating a counter is a single indexed increment.
+ */
+class denseCountTable : public countTable {
+public:
+
+    /**
+     * @param rows number of possible contexts
+     * @param row_width alphabet length
+     */
+    denseCountTable(size_t rows, unsigned int row_width);
+
+    void increment(uint64_t context, unsigned int symbol) override;
+
+    void add(uint64_t context, const unsigned int *counts) override;
+
+    void merge(const countTable &other) override;
+
+    bool row(uint64_t context, unsigned int *counts) const override;
+
+    unsigned int rowTotal(uint64_t context) const override {
+        return context < totals.size() ? totals[context] : 0;
+    }
+
+    unsigned int lookup(uint64_t context, unsigned int symbol, unsigned int &row_total) const override {
+        row_total = rowTotal(context);
+        return row_total == 0 ? 0 : cells[(size_t) context * width + symbol];
+    }
+
+    void forEach(const visitor &visit) const override;
+
+    void forEachInPart(unsigned int part, unsigned int parts, const totalVisitor &visit) const override;
+
+    size_t size() const override { return seen_contexts; }
+
+    bool decay(size_t &dropped) override;
+
+private:
+
+    /**
+     * Counters, row after row
+     */
+    vector<unsigned int> cells;
+
+    /**
+     * Total of each row, a context has been seen when its total isn't zero
+     */
+    vector<unsigned int> totals;
+
+    /**
+     * Number of contexts seen
+     */
+    size_t seen_contexts;
+};
+
+#define INLINE_PAIRS 4
+
+/**
+ * Counters of a context of the sparse table, in 16 bytes. At high orders most contexts are followed by a few
+ * symbols only, so up to INLINE_PAIRS symbols are kept inline as (symbol, 16 bit count) pairs. Past that, or
+ * when a count overflows 16 bits, the row moves to an array with a counter per symbol of 8, 16 or 32 bits,
+ * which is widened whenever a counter overflows. The array starts with the total of the row, so a row with
+ * many symbols doesn't have to add up its counters for it.
+ * Rows don't know the alphabet length nor the arena of their table, they are passed to the methods that need
+ * them. Arrays come from the arena and go back to it when widened, the arena frees them with the table
+ */
+class compactRow {
+public:
+
+    compactRow() : used(0), counter_width(0) {}
+
+    compactRow(compactRow &&other) noexcept;
+
+    compactRow(const compactRow &) = delete;
+
+    compactRow &operator=(const compactRow &) = delete;
+
+    /**
+     * Adds to the counter of a symbol
+     * @param symbol alphabet code of the symbol
+     * @param count occurrences to add
+     * @param width alphabet length
+     * @param arena where to allocate the array of counters
+     */
+    void add(unsigned int symbol, unsigned int count, unsigned int width, slabArena &arena);
+
+    /**
+     * Copies the counters to an array
+     * @param counts array with width counters
+     * @param width alphabet length
+     */
+    void expand(unsigned int *counts, unsigned int width) const;
+
+    /**
+     * @return sum of the counters, added up only while they are inline
+     */
+    unsigned int total() const;
+
+    /**
+     * @param symbol alphabet code of the symbol
+     * @return counter of the symbol
+     */
+    unsigned int get(unsigned int symbol) const;
+
+    /**
+     * Halves the counters, rounding down. Inline pairs halved to 0 are removed, an array left without counts
+     * goes back to the arena
+     * @param width alphabet length
+     * @param arena where the array of counters was allocated
+     * @return sum of the counters once halved
+     */
+    unsigned int halve(unsigned int width, slabArena &arena);
+
+    /**
+     * @return bytes allocated outside of the row, for its array of counters
+     */
+    size_t heapBytes(unsigned int width) const {
+        return counter_width == 0 ? 0 : sizeof(uint32_t) + (size_t) counter_width * width;
+    }
+
+private:
+
+    union {
+        uint16_t counts[INLINE_PAIRS];      // inline counts, while counter_width is 0
+        uint8_t *dense;                     // array of counters, once counter_width isn't 0, after their total
+    };
+
+    /**
+     * Symbols of the inline counts
+     */
+    uint8_t symbols[INLINE_PAIRS];
+
+    /**
+     * Number of inline pairs in use
+     */
+    uint8_t used;
+
+    /**
+     * Bytes of each counter of the array, 0 while the counters are inline
+     */
+    uint8_t counter_width;
+
+    /**
+     * @return total of the counters of the array, stored right before them
+     */
+    uint32_t &denseTotal() const { return *reinterpret_cast<uint32_t *>(dense - sizeof(uint32_t)); }
+
+    /**
+     * @return counter of a symbol in the array
+     */
+    uint32_t denseGet(unsigned int symbol) const;
+
+    /**
+     * Sets the counter of a symbol in the array, the value must fit the counter width
+     */
+    void denseSet(unsigned int symbol, uint32_t value);
+
+    /**
+     * Moves the counters to an array of counters of the given width, returning the previous array to the arena
+     */
+    void toDense(unsigned int bytes, unsigned int width, slabArena &arena);
+};
+
+/**
+ * Count table storing only the seen contexts in a hash table. Used for large orders, where most of the
+ * possible contexts never occur. Rows are compactRow, so a context costs a few tens of bytes.
+ * The hash table nodes and the arrays of the rows come from the arena of the table, which releases them
+ * all at once with it.
+ */
+class sparseCountTable : public countTable {
+public:
+
+    /**
+     * @param row_width alphabet length
+     */
+    explicit sparseCountTable(unsigned int row_width);
+
+    void increment(uint64_t context, unsigned int symbol) override;
+
+    void add(uint64_t context, const unsigned int *counts) override;
+
+    bool row(uint64_t context, unsigned int *counts) const override;
+
+    unsigned int rowTotal(uint64_t context) const override;
+
+    unsigned int lookup(uint64_t context, unsigned int symbol, unsigned int &row_total) const override;
+
+    void forEach(const visitor &visit) const override;
+
+    void forEachInPart(unsigned int part, unsigned int parts, const totalVisitor &visit) const override;
+
+    size_t size() const override { return rows.size(); }
+
+    bool arenaStats(arenaUsage &usage) const override;
+
+    bool decay(size_t &dropped) override;
+
+private:
+
+    typedef unordered_map<uint64_t, compactRow, hash<uint64_t>, equal_to<uint64_t>,
+            arenaAllocator<pair<const uint64_t, compactRow>>> rowMap;
+
+    /**
+     * Storage of the nodes and arrays of rows, declared first so it outlives them
+     */
+    slabArena arena;
+
+    /**
+     * Rows of counters indexed by context
+     */
+    rowMap rows;
+};
+
+#endif //CAV_GMZ_COUNTTABLE_H
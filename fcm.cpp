@@ -1,414 +1,1437 @@
 #include <stdlib.h>
+#include <climits>
+#include <algorithm>
+#include <cctype>
+#include <atomic>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "fcm.h"
+#include "sketch.h"
+#include "profile.h"
+#include "trace.h"
+
+#define NORMALIZE_BLOCK_LENGTH (1u << 16)   // bytes normalized at once before counting
+#define MIN_CHUNK_LENGTH (1u << 16)     // smallest chunk worth counting in its own thread
+#define GENERATION_CHUNK_SYMBOLS (1u << 20)     // symbols of each independently drawn chunk of generated text
+#define ENTROPY_PARTS 64                // parts of the table whose entropy is summed independently
+#define SAMPLER_CACHE_SLOTS (1u << 16)  // most samplers cached by genText()
+#define SCORE_TABLE_CELLS (1u << 24)    // most code lengths precomputed by prepareScoring()
+#define TOP_INDEX_SLOTS (1u << 22)      // most possible contexts for topSymbols() to find rows by context index
+#define SCORE_RENORMALIZE 8              // symbols multiplied into the score mantissa before renormalizing it
+#define PROBABILITY(occurrences, total, alpha) ( (occurrences + alpha) / (total + (alphabet::length*alpha)))
+
+/**
+ * Symbols as shown in the tables, control and non ASCII bytes of the bytes alphabet are shown as '.'
+ */
+static char printable(char c) {
+    return isprint((unsigned char) c) ? c : '.';
+}
 
-#define ALPHABET "abcdefghijklmnopqrstuvwxyz "
-#define ALPHABET_LENGTH 27
-#define LOWER_DECIMAL_ASCII_LETTER 97
-#define PROBABILITY(occurrences, total, alpha) ( (occurrences + alpha) / (total + (ALPHABET_LENGTH*alpha)))
+static string printable(string str) {
+    for (auto &c : str)
+        c = printable(c);
+    return str;
+}
 
-fcm::fcm(unsigned int order, ifstream *input_file, fstream *save_file, fstream *load_file,
-         unsigned int number_characters, unsigned int number_lines, double probl_alpha) : k(order),
-                                                                                          input(input_file),
-                                                                                          outfile(save_file),
-                                                                                          infile(load_file),
+template<class alphabet>
+fcm<alphabet>::fcm(unsigned int order, inputSource *input_source, const string &save_filename, const string &load_filename,
+         unsigned int number_characters, unsigned int number_lines, double probl_alpha,
+         unsigned int num_threads, size_t memory_budget) : k(order),
+                                                                                          input(input_source),
+                                                                                          outfile(save_filename),
+                                                                                          infile(load_filename),
                                                                                           numChar(number_characters),
                                                                                           numLines(number_lines),
-                                                                                          alpha(probl_alpha) {
+                                                                                          alpha(probl_alpha),
+                                                                                          numThreads(num_threads) {
     clog << "FCM initialized" << endl;
 
-    p_statMatrix = make_unique<map<unsigned int, vector<unsigned int>>>();
-    most_occurring = make_pair(0, 0.0);
+    sampler_shift = 64;
+    sampler_slots = 0;
+    seed = streamRng::randomSeed();
 
-    if (load_file->is_open()) {
-        save_file->seekp(0);
-        load(load_file);
-        //finput->close();
+    if (memory_budget > 0) {
+        // the running entropy of the sketch can't be split between threads
+        p_statMatrix = unique_ptr<countTable>(new sketchCountTable(alphabet::length, memory_budget));
+        numThreads = 1;
+    } else if (infile.empty() || load(infile) != 0) {
+        p_statMatrix = countTable::create(k, alphabet::length);
     }
 
+    // integer powers of the alphabet length, used to roll and decode context indexes
+    powers.resize(k + 1);
+    powers[0] = 1;
+    for (unsigned int i = 1; i <= k; i++)
+        powers[i] = powers[i - 1] * alphabet::length;
+
     // process input data
     occurrenceCounter();
-    generate_sum_prob_Matrix();
 
-    if (save_file->is_open()) {
-        save_file->clear();
-        save_file->seekp(0);
-        save(save_file);
-        save_file->close();
-    }
+    if (!outfile.empty())
+        save(outfile);
 
     clog << "FCM initialized, NC|NL" << number_characters << "|" << number_lines << endl;
 }
 
-int fcm::save(fstream *s) {
+template<class alphabet>
+int fcm<alphabet>::save(const string &filename) {
+    phaseTimer timer(phase::save);
     clog << "Saving map to file... ";
 
-    if (s->fail()) {
-        cerr << "fail";
+    if (saveModel(*p_statMatrix, k, alphabet::name, filename) != 0)
         return 1;
-    }
-    archive::text_oarchive oa(*s);
-    oa << *p_statMatrix;
+
+    timer.contexts = p_statMatrix->size();
+    timer.symbols = timer.contexts * alphabet::length;
+    timer.bytes = modelFileSize(p_statMatrix->size(), alphabet::length);
 
     clog << "done." << endl;
     return 0;
 }
 
-int fcm::load(fstream *s) {
-    if (s->fail())
-        return 1;
+template<class alphabet>
+int fcm<alphabet>::load(const string &filename) {
+    phaseTimer timer(phase::load);
     clog << "Reading map from file... ";
-    archive::text_iarchive oa(*s);
-    oa >> *p_statMatrix;
+
+    unique_ptr<mappedCountTable> model = mappedCountTable::open(filename, alphabet::name, alphabet::length);
+
+    if (model == nullptr)
+        return 1;
+
+    if (model->order() == 0 || model->order() > alphabet::max_order) {
+        cerr << "Model '" << filename << "' has an unsupported order" << endl;
+        return 1;
+    }
+
+    if (model->order() != k) {
+        clog << "using the model order " << model->order() << "... ";
+        k = model->order();
+    }
+
+    if (input == nullptr) {
+        // nothing else to count, rows are used in place
+        p_statMatrix = move(model);
+    } else {
+        p_statMatrix = countTable::create(k, alphabet::length);
+        p_statMatrix->merge(*model);
+    }
+
+    timer.contexts = p_statMatrix->size();
+    timer.symbols = timer.contexts * alphabet::length;
+    timer.bytes = modelFileSize(p_statMatrix->size(), alphabet::length);
+
     clog << "done." << endl;
     return 0;
 }
 
-void fcm::occurrenceCounter() {
+template<class alphabet>
+void fcm<alphabet>::occurrenceCounter() {
+
+    uint64_t map_pos = 0;       // rolling index in the map of the last k symbols
+    unsigned int filled = 0;    // number of symbols in the context
+    vector<unique_ptr<countTable>> thread_tables;
+
+    if (input == nullptr)
+        return;
+
+    // profile: time outside of the spans is reading the input, countSpan() times the spans themselves
+    auto start = chrono::steady_clock::now();
+    uint64_t start_allocated = profiler::allocated();
+    size_t start_contexts = p_statMatrix->size();
+    double span_seconds = 0;
+    uint64_t bytes = 0;
 
-    unsigned int i = 0;     // debug info: loop counter
-    char c;
-    int pos;                // calculate index in the symbol column
-    unsigned int map_pos;   // calculate index in the map for the k order value
+    // the context carries over from one span to the next
+    if (!input->forEachBlock([&](const char *data, size_t length) {
+        auto span_start = chrono::steady_clock::now();
 
-    // circular buffer with the context and the current symbol
-    circular_buffer<char> buffer(k + 1);
+        if (numThreads > 1 && length >= (size_t) numThreads * MIN_CHUNK_LENGTH)
+            countSpanParallel(thread_tables, data, length, map_pos, filled);
+        else
+            countSpan(*p_statMatrix, data, length, map_pos, filled);
 
-    // fill the buffer with context, discarding non-alphabet characters
-    while (i < k && input->get(c)) {
-        if (charToAlphabet(c) < 0)
+        span_seconds += chrono::duration<double>(chrono::steady_clock::now() - span_start).count();
+        bytes += length;
+    }))
+        cerr << "Error reading input data" << endl;
+
+    auto merge_start = chrono::steady_clock::now();
+
+    // reduce the per thread counters
+    for (auto &table : thread_tables)
+        p_statMatrix->merge(*table);
+
+    if (profiler::enabled()) {
+        auto end = chrono::steady_clock::now();
+
+        // nothing is read from a mapped input, its pages are faulted in while normalizing
+        profiler::add(phase::ingest, chrono::duration<double>(merge_start - start).count() - span_seconds,
+                      0, 0, input->isMapped() ? 0 : bytes, 0);
+        profiler::add(phase::count, chrono::duration<double>(end - merge_start).count(), 0,
+                      p_statMatrix->size() - start_contexts, 0, profiler::allocated() - start_allocated);
+    }
+}
+
+template<class alphabet>
+void fcm<alphabet>::countSpan(countTable &table, const char *data, size_t length, uint64_t &map_pos, unsigned int &filled,
+                              spanSeconds *thread_seconds) {
+
+    vector<uint8_t> codes(min(length, (size_t) NORMALIZE_BLOCK_LENGTH) + NORMALIZE_SLACK);
+    bool profiling = profiler::enabled();
+    double normalize_seconds = 0, count_seconds = 0;
+    uint64_t symbols = 0;
+
+    // convert a block to alphabet codes, non-alphabet characters are dropped, then count it
+    for (size_t offset = 0; offset < length; offset += NORMALIZE_BLOCK_LENGTH) {
+
+        if (!profiling) {
+            size_t n = alphabet::normalize(data + offset, min(length - offset, (size_t) NORMALIZE_BLOCK_LENGTH), codes.data());
+            countCodes(table, codes.data(), n, map_pos, filled);
             continue;
-        buffer.push_back(c);
-        i++;
+        }
+
+        auto start = chrono::steady_clock::now();
+        size_t n = alphabet::normalize(data + offset, min(length - offset, (size_t) NORMALIZE_BLOCK_LENGTH), codes.data());
+        auto normalized = chrono::steady_clock::now();
+        countCodes(table, codes.data(), n, map_pos, filled);
+
+        normalize_seconds += chrono::duration<double>(normalized - start).count();
+        count_seconds += chrono::duration<double>(chrono::steady_clock::now() - normalized).count();
+        symbols += n;
     }
 
-    // get a symbol and keep pushing new chars to the buffer while there's input to process
-    while (input->get(c)) {
+    if (!profiling)
+        return;
 
-        // if symbol char is a non-alphabet character, just skip
-        if (charToAlphabet(c) < 0)
+    if (thread_seconds == nullptr) {
+        profiler::add(phase::normalize, normalize_seconds, symbols, 0, length, 0);
+        profiler::add(phase::count, count_seconds, symbols, 0, symbols, 0);
+        return;
+    }
+
+    thread_seconds->normalize += normalize_seconds;
+    thread_seconds->count += count_seconds;
+    profiler::add(phase::normalize, 0, symbols, 0, length, 0, normalize_seconds);
+    profiler::add(phase::count, 0, symbols, 0, symbols, 0, count_seconds);
+}
+
+template<class alphabet>
+void fcm<alphabet>::reportSpans(const vector<spanSeconds> &threads, double seconds) {
+
+    double normalize = 0, count = 0;
+
+    if (!profiler::enabled())
+        return;
+
+    for (auto &thread_seconds : threads) {
+        normalize += thread_seconds.normalize;
+        count += thread_seconds.count;
+    }
+
+    if (normalize + count > 0) {
+        profiler::add(phase::normalize, seconds * normalize / (normalize + count), 0, 0, 0, 0, 0);
+        profiler::add(phase::count, seconds * count / (normalize + count), 0, 0, 0, 0, 0);
+    }
+}
+
+template<class alphabet>
+void fcm<alphabet>::countCodes(countTable &table, const uint8_t *codes, size_t length, uint64_t &map_pos,
+                     unsigned int &filled) {
+
+    size_t i = 0;
+
+    // context still being filled, nothing to count yet
+    for (; i < length && filled < k; i++, filled++)
+        map_pos = map_pos * alphabet::length + codes[i];
+
+    for (; i < length; i++) {
+
+        // increment counter in symbol pos, the row is created if the context is new
+        table.increment(map_pos, codes[i]);
+
+        // debug information: show which counter was incremented
+        TRACE("Incremented symbol " << (int) codes[i] << " at position " << map_pos);
+
+        // drop the oldest symbol of the context and append the new one: (index * 27 + pos) mod 27^k
+        map_pos = (map_pos % powers[k - 1]) * alphabet::length + codes[i];
+    }
+}
+
+template<class alphabet>
+void fcm<alphabet>::rollContext(const char *data, size_t length, uint64_t &map_pos, unsigned int &filled) {
+
+    uint8_t pos;
+
+    for (size_t i = 0; i < length; i++) {
+        if (!alphabet::valid(data[i]))
             continue;
 
-        // push symbol to the buffer. buffer contains context + symbol
-        buffer.push_back(c);
+        pos = alphabet::encode.code[(uint8_t) data[i]];
+
+        if (filled < k)
+            filled++;
+
+        map_pos = (map_pos % powers[k - 1]) * alphabet::length + pos;
+    }
+}
+
+template<class alphabet>
+documentScore fcm<alphabet>::score(inputSource *document, bool per_line) const {
+
+    phaseTimer timer(phase::score);
+    vector<uint8_t> codes(NORMALIZE_BLOCK_LENGTH + NORMALIZE_SLACK);
+    uint64_t map_pos = 0;
+    unsigned int filled = 0;
+    codeLength length_acc;
+    documentScore result;
+    double line_start_bits = 0;
+    uint64_t line_start_symbols = 0;
+
+    // normalize and score a span in blocks, the context follows on from one span to the next
+    auto scoreSpan = [&](const char *data, size_t length) {
+        for (size_t offset = 0; offset < length; offset += NORMALIZE_BLOCK_LENGTH) {
+            size_t n = alphabet::normalize(data + offset, min(length - offset, (size_t) NORMALIZE_BLOCK_LENGTH),
+                                           codes.data());
+            scoreCodes(codes.data(), n, map_pos, filled, length_acc);
+        }
+    };
+
+    bool ok = document->forEachBlock([&](const char *data, size_t length) {
+        timer.bytes += length;
+
+        if (!per_line) {
+            scoreSpan(data, length);
+            return;
+        }
+
+        // the '\n' ends its line, it is scored with it when the alphabet has it
+        for (const char *end = data + length; data < end;) {
+            const char *newline = (const char *) memchr(data, '\n', (size_t) (end - data));
+            const char *next = newline == nullptr ? end : newline + 1;
+
+            scoreSpan(data, (size_t) (next - data));
+            data = next;
+
+            if (newline != nullptr) {
+                double bits = length_acc.bits();
+                result.lines.emplace_back(length_acc.symbols - line_start_symbols, bits - line_start_bits);
+                line_start_bits = bits;
+                line_start_symbols = length_acc.symbols;
+            }
+        }
+    });
+
+    if (!ok)
+        cerr << "Error reading the document" << endl;
+
+    // last line without a line break
+    if (per_line && length_acc.symbols > line_start_symbols)
+        result.lines.emplace_back(length_acc.symbols - line_start_symbols, length_acc.bits() - line_start_bits);
 
-        // calculate symbol index value
-        pos = charToAlphabet(buffer.back());
+    result.symbols = length_acc.symbols;
+    result.unpredicted = length_acc.unpredicted;
+    result.bits = length_acc.bits();
 
-        // calculate index given the context
-        map_pos = mapPosCalc(buffer);
+    timer.symbols = result.symbols;
+    return result;
+}
+
+template<class alphabet>
+void fcm<alphabet>::prepareScoring() {
+
+    phaseTimer timer(phase::probabilities);
+
+    if (powers[k] > SCORE_TABLE_CELLS / alphabet::length) {
+        code_lengths.clear();
+        return;
+    }
+
+    // contexts never seen: uniform, which is what alpha gives them too
+    const float uniform_bits = (float) log2((double) alphabet::length);
+    code_lengths.assign(powers[k] * alphabet::length, alpha > 0 ? uniform_bits : -uniform_bits);
+
+    p_statMatrix->forEach([&](uint64_t context, const unsigned int *row) {
+        float *lengths = &code_lengths[context * alphabet::length];
+        unsigned int total = accumulate(row, row + alphabet::length, 0u);
+
+        for (unsigned int symbol = 0; symbol < alphabet::length; symbol++) {
+            double p = PROBABILITY(row[symbol], total, alpha);
+            lengths[symbol] = p > 0 ? (float) -log2(p) : -uniform_bits;
+        }
+    });
+
+    timer.contexts = p_statMatrix->size();
+    timer.symbols = code_lengths.size();
+}
+
+template<class alphabet>
+documentScore fcm<alphabet>::scoreText(const char *text, size_t length) const {
+
+    uint8_t codes[NORMALIZE_BLOCK_LENGTH + NORMALIZE_SLACK];
+    uint64_t map_pos = 0;
+    unsigned int filled = 0;
+    codeLength length_acc;
+    documentScore result;
+
+    for (size_t offset = 0; offset < length; offset += NORMALIZE_BLOCK_LENGTH) {
+        size_t n = alphabet::normalize(text + offset, min(length - offset, (size_t) NORMALIZE_BLOCK_LENGTH), codes);
+        scoreCodes(codes, n, map_pos, filled, length_acc);
+    }
+
+    result.symbols = length_acc.symbols;
+    result.unpredicted = length_acc.unpredicted;
+    result.bits = length_acc.bits();
+    return result;
+}
+
+template<class alphabet>
+double fcm<alphabet>::probability(uint64_t context, unsigned int symbol) const {
+
+    unsigned int total;
+    unsigned int count = p_statMatrix->lookup(context, symbol, total);
 
-        // debug information: print circular buffer contents
-        for (int j = 0; j < buffer.size(); j++)
-            clog << "buffer[" << j << "]=" << buffer[j] << " ";
-        clog << endl;
+    if (total == 0)
+        return alpha == 0 ? 0 : 1.0 / alphabet::length;
 
-        // check if for the given context+symbol there's already data
-        if (p_statMatrix->count(map_pos) == 0) {
-            // initialize the array
-            vector<unsigned int> array(ALPHABET_LENGTH, 0);
+    return PROBABILITY(count, (double) total, alpha);
+}
+
+template<class alphabet>
+void fcm<alphabet>::prepareTopSymbols(unsigned int width) {
+
+    phaseTimer timer(phase::probabilities);
+    topIndex &index = top_index;
+    vector<pair<unsigned int, unsigned int>> ranked;
+    bool by_slot = powers[k] <= TOP_INDEX_SLOTS;
+
+    index = topIndex();
+    index.width = width;
+
+    if (by_slot)
+        index.slots.assign(powers[k], UINT32_MAX);
+    else
+        index.contexts.reserve(p_statMatrix->size());
 
-            // update counter at the symbol position
-            array[pos] += 1;
+    index.totals.reserve(p_statMatrix->size());
+    index.symbols.reserve(p_statMatrix->size() * width);
+    index.counts.reserve(p_statMatrix->size() * width);
 
-            // add to map
-            p_statMatrix->insert(pair<unsigned int, vector<unsigned int>>(map_pos, array));
+    // rows come in ascending context order, the contexts are sorted as they are appended
+    p_statMatrix->forEach([&](uint64_t context, const unsigned int *row) {
+        unsigned int total = 0;
 
+        ranked.clear();
+        for (unsigned int symbol = 0; symbol < alphabet::length; symbol++) {
+            if (row[symbol] != 0)
+                ranked.emplace_back(row[symbol], symbol);
+            total += row[symbol];
+        }
+
+        size_t kept = min((size_t) width, ranked.size());
+        partial_sort(ranked.begin(), ranked.begin() + kept, ranked.end(),
+                     [](const pair<unsigned int, unsigned int> &a, const pair<unsigned int, unsigned int> &b) {
+                         return a.first > b.first || (a.first == b.first && a.second < b.second);
+                     });
+
+        if (by_slot)
+            index.slots[context] = (uint32_t) index.totals.size();
+        else
+            index.contexts.push_back(context);
+
+        index.totals.push_back(total);
+        for (size_t i = 0; i < width; i++) {
+            index.symbols.push_back((uint8_t) (i < kept ? ranked[i].second : 0));
+            index.counts.push_back(i < kept ? ranked[i].first : 0);
+        }
+    });
+
+    timer.contexts = index.totals.size();
+    timer.symbols = index.totals.size() * alphabet::length;
+    timer.bytes = index.slots.size() * sizeof(uint32_t) + index.contexts.size() * sizeof(uint64_t)
+                  + index.totals.size() * sizeof(unsigned int) + index.counts.size() * (sizeof(unsigned int) + 1);
+}
+
+template<class alphabet>
+unsigned int fcm<alphabet>::topSymbols(uint64_t context, unsigned int n,
+                                       vector<pair<unsigned int, unsigned int>> &symbols) const {
+
+    const topIndex &index = top_index;
+
+    symbols.clear();
+
+    if (n <= index.width) {
+        size_t row;
+
+        if (!index.slots.empty()) {
+            if (context >= index.slots.size() || index.slots[context] == UINT32_MAX)
+                return 0;
+            row = index.slots[context];
         } else {
-            // retrieve current vector from map
-            vector<unsigned int> temp_vector = p_statMatrix->find(map_pos)->second;
+            auto it = lower_bound(index.contexts.begin(), index.contexts.end(), context);
+            if (it == index.contexts.end() || *it != context)
+                return 0;
+            row = (size_t) (it - index.contexts.begin());
+        }
+
+        const uint8_t *codes = &index.symbols[row * index.width];
+        const unsigned int *counts = &index.counts[row * index.width];
 
-            // debug information: show old a new value of the incremented counter
-            clog << "Incrementing value at position " << map_pos << " of " << temp_vector[pos] << " to "
-                 << temp_vector[pos] + 1 << endl;
+        for (unsigned int i = 0; i < n && counts[i] != 0; i++)
+            symbols.emplace_back(codes[i], counts[i]);
 
-            // increment counter in symbol pos
-            temp_vector[pos] += 1;
+        return index.totals[row];
+    }
 
-            // erase old vector and insert updated vector
-            p_statMatrix->erase(map_pos);
-            p_statMatrix->insert(pair<unsigned int, vector<unsigned int>>(map_pos, temp_vector));
+    // more symbols than indexed, ranked from the counters
+    unsigned int row[alphabet::length];
+    unsigned int total = 0;
 
-            // debug information: print the whole vector
-            for (int u = 0; u < temp_vector.size(); u++)
-                clog << temp_vector[u] << " ";
-            clog << endl;
+    if (!p_statMatrix->row(context, row))
+        return 0;
+
+    for (unsigned int symbol = 0; symbol < alphabet::length; symbol++) {
+        if (row[symbol] != 0)
+            symbols.emplace_back(symbol, row[symbol]);
+        total += row[symbol];
+    }
+
+    sort(symbols.begin(), symbols.end(),
+         [](const pair<unsigned int, unsigned int> &a, const pair<unsigned int, unsigned int> &b) {
+             return a.second > b.second || (a.second == b.second && a.first < b.first);
+         });
+
+    if (symbols.size() > n)
+        symbols.resize(n);
+
+    return total;
+}
+
+template<class alphabet>
+void fcm<alphabet>::scoreCodes(const uint8_t *codes, size_t length, uint64_t &map_pos, unsigned int &filled,
+                               codeLength &length_acc) const {
+
+    const double uniform = 1.0 / alphabet::length;
+    double mantissa = length_acc.mantissa;
+    uint64_t unpredicted = 0;
+    size_t i = 0;
+    int exponent;
+
+    // no full context yet, the symbols cost as much as with a uniform model
+    for (; i < length && filled < k; i++, filled++) {
+        map_pos = map_pos * alphabet::length + codes[i];
+        mantissa *= uniform;
+        unpredicted++;
+    }
+
+    if (!code_lengths.empty()) {
+        const float *lengths = code_lengths.data();
+        const uint64_t oldest_weight = powers[k - 1];
+        double summed = 0;
+
+        // (context, symbol) is the index of order k + 1. The context of the next symbol drops the oldest
+        // symbol, which is in the block past its first k codes, so there's no division per symbol
+        for (; i < length; i++) {
+            uint64_t oldest = i >= k ? codes[i - k] : map_pos / oldest_weight;
+            float bits = lengths[map_pos * alphabet::length + codes[i]];
+
+            if (bits < 0) {
+                bits = -bits;
+                unpredicted++;
+            }
+
+            summed += bits;
+            map_pos = (map_pos - oldest * oldest_weight) * alphabet::length + codes[i];
         }
 
-        i++; // increment loop counter
-        clog << "---------------------" << endl;
+        length_acc.summed += summed;
     }
 
+    for (size_t renormalize = i + SCORE_RENORMALIZE; i < length; i++) {
+        unsigned int total;
+        unsigned int occurrences = p_statMatrix->lookup(map_pos, codes[i], total);
+        double p = PROBABILITY(occurrences, total, alpha);
+
+        // never seen in the context and no alpha to smooth it
+        if (!(p > 0)) {
+            p = uniform;
+            unpredicted++;
+        }
+
+        mantissa *= p;
+
+        // a few probabilities can't underflow the mantissa, move its exponent out every so often
+        if (i == renormalize) {
+            mantissa = frexp(mantissa, &exponent);
+            length_acc.exponent += exponent;
+            renormalize += SCORE_RENORMALIZE;
+        }
+
+        map_pos = (map_pos % powers[k - 1]) * alphabet::length + codes[i];
+    }
+
+    length_acc.mantissa = frexp(mantissa, &exponent);
+    length_acc.exponent += exponent;
+    length_acc.symbols += length;
+    length_acc.unpredicted += unpredicted;
 }
 
-int fcm::charToAlphabet(char letter) {
+template<class alphabet>
+void fcm<alphabet>::countSpanParallel(vector<unique_ptr<countTable>> &tables, const char *data, size_t length,
+                            uint64_t &map_pos, unsigned int &filled) {
 
-    char c;
-    c = (char) tolower(letter);
-    string *alphabet = new string(ALPHABET);
+    size_t chunk = length / numThreads;
+    vector<thread> workers;
+    vector<spanSeconds> thread_seconds(numThreads);
+    auto start = chrono::steady_clock::now();
+    uint64_t last_map_pos = 0;
+    unsigned int last_filled = 0;
 
-    size_t found = alphabet->find(c);
+    // thread tables are created on the first parallel span and reused by the next ones
+    while (tables.size() < numThreads - 1)
+        tables.push_back(countTable::create(k, alphabet::length));
 
-    if (found == string::npos) {
-        clog << "Discarding non alphabet letter: '" << c << "'" << endl;
-        return -1;
-    } else {
-        return (static_cast<int>(found));       // there is no problem in static_cast, found will never overflow
-        // since map never goes beyond sizeof(unsigned int)
+    for (unsigned int t = 0; t < numThreads; t++) {
+
+        size_t begin = t * chunk;
+        size_t end = (t == numThreads - 1) ? length : begin + chunk;
+
+        workers.emplace_back([&, t, begin, end]() {
+
+            uint64_t chunk_map_pos = map_pos;
+            unsigned int chunk_filled = filled;
+
+            if (t > 0) {
+                // look backwards for the k symbols preceding the chunk
+                size_t start = begin;
+                unsigned int found = 0;
+
+                while (start > 0 && found < k)
+                    if (alphabet::valid(data[--start]))
+                        found++;
+
+                // the context is entirely within the span, otherwise it starts with the carried context
+                if (found == k) {
+                    chunk_map_pos = 0;
+                    chunk_filled = 0;
+                }
+
+                rollContext(data + start, begin - start, chunk_map_pos, chunk_filled);
+            }
+
+            countSpan(t == 0 ? *p_statMatrix : *tables[t - 1], data + begin, end - begin, chunk_map_pos, chunk_filled,
+                      &thread_seconds[t]);
+
+            if (t == numThreads - 1) {
+                last_map_pos = chunk_map_pos;
+                last_filled = chunk_filled;
+            }
+        });
     }
+
+    for (auto &worker : workers)
+        worker.join();
+
+    reportSpans(thread_seconds, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+
+    map_pos = last_map_pos;
+    filled = last_filled;
 }
 
-unsigned int fcm::mapPosCalc(circular_buffer<char> buffer) {
+template<class alphabet>
+int fcm<alphabet>::charToAlphabet(char letter) {
 
-    unsigned int i = 0;
-    unsigned int sum = 0;
+    return alphabet::valid(letter) ? alphabet::encode.code[(uint8_t) letter] : -1;
+}
 
-    while (i < k) {
-        sum += charToAlphabet(buffer[i]) * pow(ALPHABET_LENGTH, i);
+template<class alphabet>
+uint64_t fcm<alphabet>::mapPosCalc(const char *context) {
 
-        // debug info: print how we calc map position
-        clog << "(" << buffer[i] << " " << charToAlphabet(buffer[i]) << "*" << ALPHABET_LENGTH << "^" << i << ") + ";
+    uint64_t sum = 0;
+
+    for (unsigned int i = 0; i < k; i++) {
+        int pos = charToAlphabet(context[i]);
+
+        // the oldest symbol is the most significant digit
+        sum = sum * alphabet::length + (pos < 0 ? 0 : pos);
 
-        i++;
+        // debug info: print how we calc map position
+        TRACE("(" << context[i] << " " << pos << ") ");
     }
 
     // debug info: print how we calc map position
-    clog << "=" << int(sum) << endl;
+    TRACE("=" << sum);
 
     return sum;
 }
 
-string fcm::reverse_mapPosCalc(unsigned int number) {
+template<class alphabet>
+string fcm<alphabet>::reverse_mapPosCalc(uint64_t number) {
 
     string str = "";
     unsigned int key;
 
-    for (int i = 0; i < k; i++) {
-        key = ((unsigned int) (number / pow(ALPHABET_LENGTH, i)) % ALPHABET_LENGTH);
-        // TODO fix magic number
-        str += (key != 26) ? key + LOWER_DECIMAL_ASCII_LETTER : ' ';
-        number -= key * pow(ALPHABET_LENGTH, i);
+    for (unsigned int i = k; i > 0; i--) {
+        key = (unsigned int) ((number / powers[i - 1]) % alphabet::length);
+        str += alphabet::decode(key);
     }
 
     return str;
 
 }
 
-void fcm::printStats() {
+template<class alphabet>
+void fcm<alphabet>::printStats() {
 
     // print a table with database information
     cout << endl;
     cout << setw(8) << "|";
 
-    string *alphabet = new string(ALPHABET);
-
-    for (unsigned int i = 0; i < alphabet->length(); i++)
-        cout << setw(4) << alphabet->at(i) << " |";
+    for (unsigned int i = 0; i < alphabet::length; i++)
+        cout << setw(4) << printable(alphabet::decode(i)) << " |";
 
     cout << endl;
 
-    for (auto it : *p_statMatrix) {
+    p_statMatrix->forEach([this](uint64_t context, const unsigned int *row) {
 
-        cout << "|" << setw(6) << reverse_mapPosCalc(it.first) << "|";
-        vector<unsigned int> tmp = it.second;
+        cout << "|" << setw(6) << printable(reverse_mapPosCalc(context)) << "|";
 
-        for (auto i : tmp)
-            cout << setw(5) << i << " ";
+        for (unsigned int i = 0; i < alphabet::length; i++)
+            cout << setw(5) << row[i] << " ";
 
         cout << "|" << endl;
-    }
+    });
+
+    arenaUsage usage;
+    if (p_statMatrix->arenaStats(usage))
+        cout << "Arena: " << usage.slabs << " slabs, " << usage.reserved_bytes << " bytes reserved, "
+             << usage.live_bytes << " bytes in use, " << usage.allocations << " allocations (" << usage.reuses
+             << " reused)" << endl;
 }
 
-void fcm::printProbs() {
+template<class alphabet>
+void fcm<alphabet>::printProbs() {
 
     // print a table with database information
     cout << "Probabilistic Matrix:" << endl;
     cout << endl;
     cout << setw(8) << "|";
 
-    string *alphabet = new string(ALPHABET);
-
-    for (unsigned int i = 0; i < alphabet->length(); i++)
-        cout << setw(4) << alphabet->at(i) << " |";
+    for (unsigned int i = 0; i < alphabet::length; i++)
+        cout << setw(4) << printable(alphabet::decode(i)) << " |";
 
     cout << endl;
 
-    for (auto it : probMatrix) {
+    p_statMatrix->forEach([this](uint64_t context, const unsigned int *row) {
 
-        cout << "|" << setw(6) << reverse_mapPosCalc(it.first) << "|";
-        vector<double> tmp = it.second;
+        cout << "|" << setw(6) << printable(reverse_mapPosCalc(context)) << "|";
+        double total = p_statMatrix->rowTotal(context);
 
-        for (auto i : tmp)
-            cout << setw(5) << i << " ";
+        for (unsigned int i = 0; i < alphabet::length; i++)
+            cout << setw(5) << (row[i] == 0 ? 0 : PROBABILITY(row[i], total, alpha)) << " ";
 
         cout << "|" << endl;
-    }
+    });
 }
 
-unsigned int fcm::getSymbol(const char letter, const char *context) {
+template<class alphabet>
+unsigned int fcm<alphabet>::getSymbol(const char letter, const char *context) {
     unsigned int occurrences = 0;
 
-    // mapPosCalc needs circular buffer, so let's provide one
-    circular_buffer<char> buffer(k);
-
-    // fill the buffer with context
-    int i = 0;
-    while (i < k) {
-        buffer.push_back(context[i]);
-        i++;
-    }
-
     // calculate symbol index value
     int pos = charToAlphabet(letter);
 
     if (pos < 0) {
         // debug information
-        clog << "getSymbol(): Error trying to find a non-existent symbol in alphabet: " << letter << endl;
+        TRACE("getSymbol(): Error trying to find a non-existent symbol in alphabet: " << letter);
 
         return 0;
     }
 
-    unsigned int map_pos = mapPosCalc(buffer);
+    uint64_t map_pos = mapPosCalc(context);
+    unsigned int row[alphabet::length];
 
-    if (p_statMatrix->count(map_pos) == 0) {
-        clog << "No occurrences found" << endl;
+    if (!p_statMatrix->row(map_pos, row)) {
+        TRACE("No occurrences found");
         return 0;
     } else {
-        vector<unsigned int> temp_vector = p_statMatrix->find(map_pos)->second;
-        occurrences = temp_vector[pos];
+        occurrences = row[pos];
 
-        clog << "Symbol '" << letter << "' for context '" << context << "' occurrences is: " << occurrences << endl;
+        TRACE("Symbol '" << letter << "' for context '" << context << "' occurrences is: " << occurrences);
     }
 
     return occurrences;
 }
 
-double fcm::getEntropy() {
+template<class alphabet>
+double fcm<alphabet>::getProbability(const char letter, const char *context) {
+
+    int pos = charToAlphabet(letter);
+
+    if (pos < 0) {
+        TRACE("getProbability(): Error trying to find a non-existent symbol in alphabet: " << letter);
+        return 0;
+    }
+
+    uint64_t map_pos = mapPosCalc(context);
+    unsigned int row[alphabet::length];
+
+    if (!p_statMatrix->row(map_pos, row))
+        return alpha == 0 ? 0 : 1.0 / alphabet::length;
+
+    return PROBABILITY(row[pos], (double) accumulate(row, row + alphabet::length, 0u), alpha);
+}
+
+template<class alphabet>
+double fcm<alphabet>::getEntropy() {
+
+    double entropy;
+
+    if (p_statMatrix->runningEntropy(entropy))
+        return entropy;
+
+    return tableEntropy(*p_statMatrix, alpha, numThreads);
+}
+
+template<class alphabet>
+double fcm<alphabet>::tableEntropy(const countTable &table, double alpha, unsigned int num_threads) {
+
+    phaseTimer timer(phase::entropy);
+    unsigned int width = table.rowWidth();
+    double total_sum = (double) table.total();
+    vector<double> partial(ENTROPY_PARTS, 0);
+    atomic<unsigned int> next_part(0);
+
+    timer.symbols = (uint64_t) table.size() * width;
+    timer.bytes = timer.symbols * sizeof(unsigned int);
+
+    // one pass over the rows, totals are already known: ∑ Hi * Pi where Hi is the entropy of a row
+    auto entropyOfParts = [&]() {
+        for (unsigned int part; (part = next_part++) < ENTROPY_PARTS;) {
+            double sum = 0;
+
+            table.forEachInPart(part, ENTROPY_PARTS, [&](uint64_t, const unsigned int *row,
+                                                         unsigned int row_sum) {
+                double hi = 0;  // H(i)
 
-    string *alphabet = new string(ALPHABET);
-    double hi;  // H(i)
-    double sum = 0;
-    double p;
+                for (unsigned int i = 0; i < width; i++) {
 
-    generate_sum_prob_Matrix();
+                    if (row[i] == 0)
+                        continue;
 
-    for (auto it : *p_statMatrix) {
-        hi = 0;
-        auto mit = sum_stat_Matrix.find(it.first);
+                    // sum of Hi
+                    double p = (double) row[i] / row_sum;
+                    hi += -(p * log2(p));
+                }
 
-        for (unsigned int i = 0; i < alphabet->length(); i++) {
+                // ∑ Hi * Pi
+                sum += hi * PROBABILITY(row_sum, total_sum, alpha);
+            });
+
+            partial[part] = sum;
+        }
+    };
+
+    vector<thread> workers;
+    for (unsigned int t = 1; t < min(num_threads, (unsigned int) ENTROPY_PARTS); t++)
+        workers.emplace_back(entropyOfParts);
+
+    entropyOfParts();
+
+    for (auto &worker : workers)
+        worker.join();
+
+    // parts are added in the same order whatever the number of threads, so is the result
+    return accumulate(partial.begin(), partial.end(), 0.0);
+}
+
+template<class alphabet>
+vector<fileReport> fcm<alphabet>::trainFiles(const vector<string> &files, bool per_file_models,
+                                             const string &model_directory) {
+
+    vector<fileReport> reports(files.size());
+    vector<uint64_t> sizes(files.size(), 0);
+    vector<size_t> schedule(files.size());
+    unsigned int workers = (unsigned int) max((size_t) 1, min((size_t) numThreads, files.size()));
+    vector<unique_ptr<countTable>> thread_tables(workers);
+    vector<spanSeconds> thread_seconds(workers);
+    atomic<size_t> next(0);
+    size_t digits = to_string(files.size()).size();     // of the numbers of the per file models
+
+    // largest files first, so no thread is left alone with a large file at the end
+    for (size_t i = 0; i < files.size(); i++) {
+        struct stat info;
+        sizes[i] = stat(files[i].c_str(), &info) == 0 ? (uint64_t) info.st_size : 0;
+    }
 
-            if (it.second[i] == 0)
+    iota(schedule.begin(), schedule.end(), 0);
+    stable_sort(schedule.begin(), schedule.end(), [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+    // a model used in place from its file is read only, counts go to a copy
+    if (!per_file_models && dynamic_cast<const mappedCountTable *>(p_statMatrix.get()) != nullptr) {
+        unique_ptr<countTable> table = countTable::create(k, alphabet::length);
+        table->merge(*p_statMatrix);
+        p_statMatrix = move(table);
+    }
+
+    auto worker = [&](unsigned int t) {
+        for (size_t i; (i = next.fetch_add(1)) < files.size();) {
+            size_t f = schedule[i];
+            fileReport &report = reports[f];
+            inputSource file;
+            uint64_t map_pos = 0;
+            unsigned int filled = 0;
+
+            if (!file.open(files[f]))
                 continue;
 
-            // sum of Hi
-            p = (double) it.second[i] / mit->second.first;
-            hi += -(p * log2(p));
+            // the symbols of a file can't visit more contexts than its size, a dense table would be mostly empty
+            unique_ptr<countTable> table = countTable::create(k, alphabet::length, sizes[f]);
+
+            if (!file.forEachBlock([&](const char *data, size_t length) {
+                countSpan(*table, data, length, map_pos, filled, workers > 1 ? &thread_seconds[t] : nullptr);
+            }))
+                continue;
 
+            // the first k symbols of the file fill its context and aren't counted
+            report.symbols = table->total() + filled;
+            report.contexts = table->size();
+            report.entropy = tableEntropy(*table, alpha, 1);
+            report.ok = true;
+
+            if (per_file_models) {
+                if (model_directory.empty())
+                    continue;
+
+                // the position in the batch keeps the names apart, the same file name can come from two directories
+                string number = to_string(f + 1);
+                string name = string(digits - number.size(), '0') + number + "_"
+                              + files[f].substr(files[f].find_last_of('/') + 1);
+                report.ok = saveModel(*table, k, alphabet::name, model_directory + "/" + name + ".dat") == 0;
+            } else {
+                if (thread_tables[t] == nullptr)
+                    thread_tables[t] = countTable::create(k, alphabet::length);
+                thread_tables[t]->merge(*table);
+            }
         }
-        // ∑ Hi * Pi
-        sum += hi * mit->second.second;
+    };
+
+    vector<thread> threads;
+    for (unsigned int t = 1; t < workers; t++)
+        threads.emplace_back(worker, t);
+
+    worker(0);
+
+    for (auto &t : threads)
+        t.join();
+
+    // every worker is busy until the last file, the spans take as much of the wall time as of the time of the workers
+    if (workers > 1) {
+        double seconds = 0;
+        for (auto &span : thread_seconds)
+            seconds += span.normalize + span.count;
+        reportSpans(thread_seconds, seconds / workers);
     }
 
-    return sum;
+    for (auto &table : thread_tables)
+        if (table != nullptr)
+            p_statMatrix->merge(*table);
+
+    return reports;
 }
 
-void fcm::generate_sum_prob_Matrix() {
+template<class alphabet>
+pruneReport fcm<alphabet>::prune(const pruneLimits &limits) {
+
+    pruneReport report;
+    report.contexts_before = p_statMatrix->size();
+    report.counts_before = p_statMatrix->total();
+    report.entropy_before = getEntropy();
 
-    unsigned int total_sum = 0;
-    unsigned int vector_sum = 0;
+    phaseTimer timer(phase::prune);
+    vector<unsigned int> totals;    // totals of the contexts over min_count
+    size_t keep = report.contexts_before;
 
-    for (auto it : *p_statMatrix) {
+    totals.reserve(keep);
+    p_statMatrix->forEachInPart(0, 1, [&](uint64_t, const unsigned int *, unsigned int total) {
+        if (total >= limits.min_count)
+            totals.push_back(total);
+    });
 
-        vector_sum = (unsigned int) accumulate(it.second.begin(), it.second.end(), 0);
+    keep = totals.size();
 
-        pair<unsigned int, double> sum_probl(vector_sum, 0);
-        sum_stat_Matrix.insert(pair<unsigned int, pair<unsigned int, double>>(it.first, sum_probl));
+    if (limits.top_contexts > 0)
+        keep = min(keep, limits.top_contexts);
+
+    if (limits.target_bytes > 0) {
+        size_t rows = (limits.target_bytes - min(limits.target_bytes, sizeof(modelHeader)))
+                      / (sizeof(uint64_t) + (alphabet::length + 1) * sizeof(unsigned int));
+        while (rows > 0 && modelFileSize(rows, alphabet::length) > limits.target_bytes)
+            rows--;
+        keep = min(keep, rows);
+    }
 
-        total_sum += vector_sum;
+    // the contexts seen more than the keep-th most seen one are kept, then the ties in context order
+    unsigned int threshold = max(limits.min_count, 1u);
+    size_t ties = keep;
+
+    // the keep-th most seen total is put in its place, the ones before it are the larger ones
+    if (keep == 0) {
+        threshold = UINT_MAX;
+        ties = 0;
+    } else if (keep < totals.size()) {
+        nth_element(totals.begin(), totals.begin() + keep - 1, totals.end(), greater<unsigned int>());
+        threshold = totals[keep - 1];
+        ties = keep - (size_t) count_if(totals.begin(), totals.begin() + keep,
+                                        [&](unsigned int total) { return total > threshold; });
     }
 
-    // now that we have H(i) we can calculate P(i)
-    for (auto it : sum_stat_Matrix) {
+    totals = vector<unsigned int>();
 
-        unsigned int pos = it.first;
-        pair<unsigned int, double> tmp(it.second.first, PROBABILITY(it.second.first, (double) total_sum, alpha));
+    // forEach() visits in ascending context order, so the ties kept are the first contexts
+    unique_ptr<countTable> pruned = countTable::create(k, alphabet::length);
+    p_statMatrix->forEach([&](uint64_t context, const unsigned int *row) {
+        unsigned int total = accumulate(row, row + alphabet::length, 0u);
 
-        sum_stat_Matrix.erase(it.first);
+        if (total > threshold || (total == threshold && ties > 0 && ties--))
+            pruned->add(context, row);
+    });
 
-        sum_stat_Matrix.insert(pair<unsigned int, pair<unsigned int, double>>(pos, tmp));
+    p_statMatrix = move(pruned);
+    sampler_slots = 0;
+    code_lengths.clear();
+    top_index = topIndex();
+
+    timer.contexts = report.contexts_before;
+    timer.symbols = (uint64_t) report.contexts_before * alphabet::length;
+    timer.bytes = timer.symbols * sizeof(unsigned int);
+
+    report.contexts_after = p_statMatrix->size();
+    report.counts_after = p_statMatrix->total();
+    report.entropy_after = getEntropy();
+
+    return report;
+}
+
+template<class alphabet>
+int fcm<alphabet>::trainStream(inputSource *stream, const streamSettings &settings,
+                               const function<void(const streamSnapshot &)> &publish) {
+
+    vector<uint8_t> codes(NORMALIZE_BLOCK_LENGTH + NORMALIZE_SLACK);
+    uint64_t map_pos = 0;       // rolling index in the map of the last k symbols
+    unsigned int filled = 0;    // number of symbols in the context
+    uint64_t next_decay = settings.decay_symbols > 0 ? settings.decay_symbols : UINT64_MAX;
+    uint64_t next_snapshot = settings.snapshot_symbols > 0 ? settings.snapshot_symbols : UINT64_MAX;
+    uint64_t published = UINT64_MAX;   // symbols of the last snapshot
+    streamSnapshot snapshot;
+    int status = 0;
+
+    // a model used in place from its file is read only, counts go to a copy
+    if (dynamic_cast<const mappedCountTable *>(p_statMatrix.get()) != nullptr) {
+        unique_ptr<countTable> table = countTable::create(k, alphabet::length);
+        table->merge(*p_statMatrix);
+        p_statMatrix = move(table);
+    }
+
+    auto takeSnapshot = [&]() {
+        snapshot.contexts = p_statMatrix->size();
+        snapshot.counts = p_statMatrix->total();
+        snapshot.entropy = getEntropy();
+        topContexts(settings.top_contexts, snapshot.top);
+
+        // saveModel() writes aside and renames, readers of the model file never see half of it
+        snapshot.saved = !settings.model_file.empty() && save(settings.model_file) == 0;
+        if (!settings.model_file.empty() && !snapshot.saved)
+            status = 1;
+
+        publish(snapshot);
+        published = snapshot.symbols;
+    };
+
+    auto decay = [&]() {
+        phaseTimer timer(phase::decay);
+        size_t dropped = 0;
+
+        timer.contexts = p_statMatrix->size();
+        timer.symbols = timer.contexts * alphabet::length;
+        timer.bytes = timer.symbols * sizeof(unsigned int);
+
+        p_statMatrix->decay(dropped);
+        snapshot.decays++;
+        snapshot.dropped += dropped;
+    };
+
+    // symbols are counted in pieces ending where a snapshot or a halving is due, so they fall on the same
+    // symbols however the stream is split in reads. A snapshot due with a halving is taken before it
+    bool ok = stream->forEachBlock([&](const char *data, size_t length) {
+        for (size_t offset = 0; offset < length; offset += NORMALIZE_BLOCK_LENGTH) {
+            size_t n = alphabet::normalize(data + offset, min(length - offset, (size_t) NORMALIZE_BLOCK_LENGTH),
+                                           codes.data());
+
+            for (size_t i = 0; i < n;) {
+                size_t piece = (size_t) min((uint64_t) (n - i), min(next_decay, next_snapshot) - snapshot.symbols);
+
+                countCodes(*p_statMatrix, codes.data() + i, piece, map_pos, filled);
+                i += piece;
+                snapshot.symbols += piece;
+
+                if (snapshot.symbols == next_snapshot) {
+                    takeSnapshot();
+                    next_snapshot += settings.snapshot_symbols;
+                }
+
+                if (snapshot.symbols == next_decay) {
+                    decay();
+                    next_decay += settings.decay_symbols;
+                }
+            }
+        }
+    });
+
+    if (!ok) {
+        cerr << "Error reading input data" << endl;
+        status = 1;
     }
 
-    /* TODO: table needs to be prettified
-    clog << "______|__sum___|_prob___" << endl;
-    for (auto it : sum_stat_Matrix) {
-        clog << it.first << " | " << it.second.first << " | " << it.second.second << endl;
-    }*/
+    // the last snapshot has what came after the previous one
+    if (published != snapshot.symbols)
+        takeSnapshot();
+
+    return status;
+}
+
+template<class alphabet>
+void fcm<alphabet>::topContexts(size_t count, vector<pair<string, unsigned int>> &top) {
+
+    vector<pair<unsigned int, uint64_t>> heap;  // (total, context) of the most seen so far, the least one first
+
+    // a context ranks before another if seen more, or as much with a lower index
+    auto before = [](const pair<unsigned int, uint64_t> &a, const pair<unsigned int, uint64_t> &b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    };
+
+    top.clear();
+    if (count == 0)
+        return;
+
+    p_statMatrix->forEachInPart(0, 1, [&](uint64_t context, const unsigned int *, unsigned int total) {
+        pair<unsigned int, uint64_t> candidate(total, context);
+
+        if (heap.size() < count) {
+            heap.push_back(candidate);
+            push_heap(heap.begin(), heap.end(), before);
+        } else if (before(candidate, heap.front())) {
+            pop_heap(heap.begin(), heap.end(), before);
+            heap.back() = candidate;
+            push_heap(heap.begin(), heap.end(), before);
+        }
+    });
+
+    sort_heap(heap.begin(), heap.end(), before);
+
+    for (auto &entry : heap)
+        top.emplace_back(printable(reverse_mapPosCalc(entry.second)), entry.first);
+}
+
+template<class alphabet>
+void fcm<alphabet>::orderCurve(inputSource *input, unsigned int min_order, unsigned int max_order, double alpha) {
 
+    vector<unique_ptr<countTable>> tables(max_order + 1);
+    vector<uint64_t> powers(max_order + 1, 1);
+    vector<uint8_t> codes(NORMALIZE_BLOCK_LENGTH + NORMALIZE_SLACK);
+    uint64_t map_pos = 0;       // rolling index of the last max_order symbols
+    unsigned int filled = 0;    // number of symbols in the context
+
+    for (unsigned int j = 1; j <= max_order; j++)
+        powers[j] = powers[j - 1] * alphabet::length;
+
+    for (unsigned int j = min_order; j <= max_order; j++)
+        tables[j] = countTable::create(j, alphabet::length);
+
+    // the context of order j is made of the j newest symbols, which are the j least significant digits
+    // of the max_order index, so a single rolling index serves every order
+    bool ok = input->forEachBlock([&](const char *data, size_t length) {
+        for (size_t offset = 0; offset < length; offset += NORMALIZE_BLOCK_LENGTH) {
+            size_t n = alphabet::normalize(data + offset, min(length - offset, (size_t) NORMALIZE_BLOCK_LENGTH),
+                                        codes.data());
+
+            for (size_t i = 0; i < n; i++) {
+                for (unsigned int j = min_order; j <= filled; j++)
+                    tables[j]->increment(map_pos % powers[j], codes[i]);
+
+                if (filled < max_order)
+                    filled++;
+
+                map_pos = (map_pos % powers[max_order - 1]) * alphabet::length + codes[i];
+            }
+        }
+    });
+
+    if (!ok)
+        cerr << "Error reading input data" << endl;
+
+    cout << setw(6) << "order" << setw(12) << "contexts" << setw(14) << "model bytes" << setw(12) << "entropy" << endl;
+
+    for (unsigned int j = min_order; j <= max_order; j++)
+        cout << setw(6) << j << setw(12) << tables[j]->size()
+             << setw(14) << modelFileSize(tables[j]->size(), alphabet::length)
+             << setw(12) << tableEntropy(*tables[j], alpha, 1) << endl;
 }
 
-void fcm::genText() {
+template<class alphabet>
+uint64_t fcm<alphabet>::chunkLines() const {
+    return max((uint64_t) 1, (uint64_t) GENERATION_CHUNK_SYMBOLS / (numChar + 1));
+}
+
+template<class alphabet>
+uint64_t fcm<alphabet>::chunkOffset(uint64_t chunk) const {
+
+    // the first chunk starts with its k symbol context
+    return (chunk > 0 ? k : 0) + chunk * chunkLines() * (numChar + 1);
+}
+
+template<class alphabet>
+bool fcm<alphabet>::startKeys(vector<uint64_t> &start_keys) {
+
+    // nothing learned, nothing to generate
+    if (p_statMatrix->size() == 0 || numLines == 0)
+        return false;
+
+    if (sampler_slots == 0)
+        calculateProbabilities();
+
+    start_keys.reserve(p_statMatrix->size());
+    p_statMatrix->forEach([&start_keys](uint64_t context, const unsigned int *) {
+        start_keys.push_back(context);
+    });
+
+    return true;
+}
 
-    string gText = "", str_key, alphabet = ALPHABET;    // text as a whole, needs buffer to capture the last symbols inserted(read below)
-    unsigned int l = 0, uint_key = 0;                   // text length
-    random_device rd;                                   // generator must have a random device to provide entropy
-    mt19937 gen(rd());                                  // Mersenne Twister Engine
-    int lastPrint_idx = 0;
+template<class alphabet>
+void fcm<alphabet>::genChunk(uint64_t chunk, const vector<uint64_t> &start_keys, samplerCache &cache, string &text) {
 
     /*                  Algorithm
-     * 1 - Insert the most occurring key on matrix.
-     * 2 - Convert string (with k size) to uint.
-     * 3 - Fetch corresponding prob vector with the latter uint
-     * 4 - Apply the vector to the distribution
-     * 5 - Generate an index associated to the next letter inserted on the text [0-26]
-     * 6 - Repeat from 2
+     * 1 - Start from a random context of the matrix, the rolling key is its index.
+     * 2 - Draw the next symbol with one random number, from the cached alias table of the key or,
+     *     for a cold key, straight from its counters.
+     * 3 - A key that keeps coming back gets its alias table built from the counters and cached.
+     * 4 - Roll the symbol into the key and repeat from 2.
+     * A context with no statistics (only seen at the end of the input) restarts from a random context.
      * */
 
-    auto it = sum_stat_Matrix.begin();
-    advance(it, rand() % sum_stat_Matrix.size());   // if rand is highlighted, just ignore. same err as atoi
-    auto random_key = it->first;
+    streamRng random(seed, chunk);
+    uint64_t lines = min(chunkLines(), numLines - chunk * chunkLines());
 
+    cache.slots.resize(sampler_slots);
+    for (auto &slot : cache.slots)
+        slot.context = slot.candidate = UINT64_MAX;
 
-    gText.append(reverse_mapPosCalc(random_key));   //get the first letters into the text, starting point
-    l = (unsigned int) gText.length();              //-as in (l)ength
+    text.clear();
+    text.reserve(k + lines * (numChar + 1));
 
-    str_key = gText.substr(l - k, l);
+    // get the first letters into the text, starting point
+    uint64_t key = start_keys[random.below(start_keys.size())];
+    if (chunk == 0)
+        text += reverse_mapPosCalc(key);
 
-    for (int j = numLines; j > 0; j--) {
-        for (int i = numChar; i > 0; i--) {
+    for (uint64_t j = lines; j > 0; j--) {
+        for (unsigned int i = numChar; i > 0; i--) {
 
-            circular_buffer<char> cb(str_key.size(), str_key.begin(), str_key.end());
-            uint_key = mapPosCalc(cb);                                  //row selection
+            unsigned int symbol;
 
-            vector<double> v_p = probMatrix.find(uint_key)->second;     //retrieve probabilities (from row)
-            discrete_distribution<> d(v_p.begin(), v_p.end());          //distribute probabilities into distribution
+            // dead end, jump somewhere else
+            if (!drawSymbol(cache, key, random(), symbol)) {
+                key = start_keys[random.below(start_keys.size())];
+                drawSymbol(cache, key, random(), symbol);
+            }
 
-            gText += alphabet.at(d(gen));                               //generate letter index with the latter
-            l++;                                                        //size has increased
+            text += alphabet::decode(symbol);
 
-            str_key = gText.substr(l - k, l);                           //update buffer, new key will arise
+            key = (key % powers[k - 1]) * alphabet::length + symbol;
         }
-        cout << gText.substr(lastPrint_idx, l) << endl;
-        lastPrint_idx = l;
+
+        text += '\n';
     }
+}
+
+template<class alphabet>
+void fcm<alphabet>::genText(ostream &out) {
+
+    phaseTimer timer(phase::generation);
+    vector<uint64_t> start_keys;                        // contexts a text can start from
+
+    if (!startKeys(start_keys))
+        return;
+
+    uint64_t chunks = (numLines + chunkLines() - 1) / chunkLines();
+    unsigned int workers = (unsigned int) min((uint64_t) max(numThreads, 1u), chunks);
+    vector<samplerCache> caches(workers);
+    vector<string> texts(workers);
+
+    // a round of a chunk per thread, written in order once they are all drawn
+    for (uint64_t first = 0; first < chunks; first += workers) {
+        unsigned int count = (unsigned int) min((uint64_t) workers, chunks - first);
+        vector<thread> threads;
+
+        for (unsigned int t = 1; t < count; t++)
+            threads.emplace_back([&, t] { genChunk(first + t, start_keys, caches[t], texts[t]); });
+
+        genChunk(first, start_keys, caches[0], texts[0]);
 
+        for (auto &t : threads)
+            t.join();
+
+        for (unsigned int t = 0; t < count; t++)
+            out.write(texts[t].data(), texts[t].size());
+    }
+
+    out.flush();
+
+    timer.symbols = (uint64_t) numLines * numChar;
+    timer.bytes = timer.symbols + numLines;
+    for (auto &cache : caches)
+        timer.contexts += cache.built;
 }
 
-void fcm::calculateProbabilities() {
+template<class alphabet>
+int fcm<alphabet>::genFile(const string &filename) {
+
+    phaseTimer timer(phase::generation);
+    vector<uint64_t> start_keys;
+    int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        cerr << "Fail opening file '" << filename << "' for writing" << endl;
+        return 1;
+    }
+
+    uint64_t chunks = startKeys(start_keys) ? (numLines + chunkLines() - 1) / chunkLines() : 0;
+    uint64_t length = chunks == 0 ? 0 : k + (uint64_t) numLines * (numChar + 1);
+    unsigned int workers = (unsigned int) min((uint64_t) max(numThreads, 1u), chunks);
+    vector<samplerCache> caches(workers);
+    atomic<uint64_t> next(0);
+    atomic<bool> failed(false);
 
-    vector<double> tmp_probabilities(ALPHABET_LENGTH);
-    unsigned int sum;
+    // the whole file is sized first, chunks are written in place as they are drawn
+    if (ftruncate(fd, (off_t) length) != 0)
+        failed = true;
 
-    for (auto it : *p_statMatrix) {
+    auto worker = [&](unsigned int t) {
+        string text;
 
-        sum = accumulate(it.second.begin(), it.second.end(), 0);
-        if (most_occurring.second < sum && reverse_mapPosCalc(most_occurring.first) != " ") {
-            most_occurring.first = it.first;
-            most_occurring.second = sum;
+        for (uint64_t chunk; !failed && (chunk = next.fetch_add(1)) < chunks;) {
+            genChunk(chunk, start_keys, caches[t], text);
+
+            if (!writeAt(fd, text.data(), text.size(), chunkOffset(chunk)))
+                failed = true;
         }
+    };
+
+    vector<thread> threads;
+    for (unsigned int t = 1; t < workers; t++)
+        threads.emplace_back(worker, t);
+
+    if (workers > 0)
+        worker(0);
 
-        for (int j = 0; j < it.second.size(); j++)
-            tmp_probabilities[j] = it.second[j] == 0 ? 0 : PROBABILITY(it.second[j], (double) sum, alpha);
+    for (auto &t : threads)
+        t.join();
 
-        probMatrix.insert(pair<unsigned int, vector<double> >(it.first, tmp_probabilities));
+    if (::close(fd) != 0 || failed) {
+        cerr << "Fail writing file '" << filename << "'" << endl;
+        return 1;
     }
-}
\ No newline at end of file
+
+    timer.symbols = chunks == 0 ? 0 : (uint64_t) numLines * numChar;
+    timer.bytes = length;
+    for (auto &cache : caches)
+        timer.contexts += cache.built;
+
+    return 0;
+}
+
+template<class alphabet>
+void fcm<alphabet>::calculateProbabilities() {
+
+    phaseTimer timer(phase::probabilities);
+    size_t slots = 1;
+
+    if (powers[k] <= SAMPLER_CACHE_SLOTS) {
+        // a slot for every possible context
+        slots = powers[k];
+        sampler_shift = 0;
+    } else {
+        // a power of two up to the number of contexts, to pick slots with a shift
+        for (sampler_shift = 64; slots < min(p_statMatrix->size(), (size_t) SAMPLER_CACHE_SLOTS); sampler_shift--)
+            slots *= 2;
+    }
+
+    // the caches themselves are made by each generating thread
+    sampler_slots = slots;
+    timer.contexts = slots;
+}
+
+template<class alphabet>
+bool fcm<alphabet>::drawSymbol(samplerCache &cache, uint64_t context, uint64_t random, unsigned int &symbol) {
+
+    size_t slot = context;
+
+    // multiplicative hash, the high bits pick the slot (a shift of 64 means a single slot)
+    if (sampler_shift > 0)
+        slot = sampler_shift == 64 ? 0 : (size_t) ((context * 0x9e3779b97f4a7c15ull) >> sampler_shift);
+
+    samplerSlot &cached = cache.slots[slot];
+
+    if (cached.context == context) {
+        symbol = cached.sampler.sample(random);
+        return true;
+    }
+
+    unsigned int row[alphabet::length];
+
+    if (!p_statMatrix->row(context, row))
+        return false;
+
+    // weights only need to be proportional to the probabilities, unseen symbols are kept out
+    double weights[alphabet::length];
+    double total = 0;
+
+    for (unsigned int j = 0; j < alphabet::length; j++) {
+        weights[j] = row[j] == 0 ? 0 : row[j] + alpha;
+        total += weights[j];
+    }
+
+    if (sampler_shift == 0 || cached.candidate == context) {
+        cached.sampler.build(weights, alphabet::length);
+        cached.context = context;
+        cache.built++;
+
+        symbol = cached.sampler.sample(random);
+        return true;
+    }
+
+    // cold row, not worth a sampler yet
+    cached.candidate = context;
+
+    double target = (random >> 11) * (1.0 / (1ull << 53)) * total;
+
+    for (symbol = 0; symbol < alphabet::length - 1; symbol++) {
+        target -= weights[symbol];
+        if (target < 0 && weights[symbol] > 0)
+            return true;
+    }
+
+    // rounding errors end up on the last symbol, step back to a seen one
+    while (weights[symbol] == 0)
+        symbol--;
+
+    return true;
+}
+
+template class fcm<englishAlphabet>;
+template class fcm<portugueseAlphabet>;
+template class fcm<dnaAlphabet>;
+template class fcm<byteAlphabet>;
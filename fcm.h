@@ -9,35 +9,119 @@
 #include <vector>
 #include <cmath>
 #include <iomanip>
-#include <boost/circular_buffer.hpp>
 #include <numeric>
 #include <random>
-#include <boost/foreach.hpp>
-//serialization includes
-#include <boost/archive/text_iarchive.hpp>
-#include <boost/archive/text_oarchive.hpp>
-#include <boost/serialization/vector.hpp>
-#include <boost/serialization/map.hpp>
+#include "counttable.h"
+#include "modelfile.h"
+#include "aliastable.h"
+#include "ingest.h"
+#include "alphabet.h"
+#include "rng.h"
 
 using namespace std;
-using namespace boost;
 
+/**
+ * Code length of a document under a model, see fcm::score()
+ */
+struct documentScore {
+    uint64_t symbols = 0;           // symbols scored
+    uint64_t unpredicted = 0;       // symbols without a full context or with probability 0, coded as uniform
+    double bits = 0;                // code length, -log2 P(symbol | context) summed over the symbols
+    vector<pair<uint64_t, double>> lines;   // symbols and bits of each line, when scored per line
+};
+
+/**
+ * Outcome of training on one file of a batch, see fcm::trainFiles()
+ */
+struct fileReport {
+    bool ok = false;                // read and, with per file models, saved
+    uint64_t symbols = 0;           // alphabet symbols of the file
+    size_t contexts = 0;            // contexts seen in the file
+    double entropy = 0;             // entropy of the file on its own, as getEntropy()
+};
+
+/**
+ * Time a thread spent in the spans it counted, see fcm::countSpan()
+ */
+struct spanSeconds {
+    double normalize = 0;
+    double count = 0;
+};
+
+/**
+ * Limits of a pruning pass, see fcm::prune(). Every limit set applies, 0 leaves it unset
+ */
+struct pruneLimits {
+    unsigned int min_count = 0;     // contexts seen fewer times are dropped
+    size_t top_contexts = 0;        // most contexts kept, the ones seen the most
+    size_t target_bytes = 0;        // largest model file, the contexts seen the most that fit are kept
+};
+
+/**
+ * Outcome of a pruning pass
+ */
+struct pruneReport {
+    size_t contexts_before = 0, contexts_after = 0;
+    uint64_t counts_before = 0, counts_after = 0;   // sum of the counters
+    double entropy_before = 0, entropy_after = 0;   // as getEntropy(), the latter over the kept contexts only
+};
+
+/**
+ * Intervals of streaming training, see fcm::trainStream(). 0 leaves an interval unset
+ */
+struct streamSettings {
+    uint64_t decay_symbols = 0;     // symbols between two halvings of every counter
+    uint64_t snapshot_symbols = 0;  // symbols between two snapshots
+    size_t top_contexts = 0;        // contexts listed in each snapshot, the ones seen the most
+    string model_file;              // if not empty, the model is saved to it with each snapshot
+};
+
+/**
+ * State of a streamed model, published at each snapshot
+ */
+struct streamSnapshot {
+    uint64_t symbols = 0;           // alphabet symbols read since the stream started
+    uint64_t decays = 0;            // halvings so far
+    size_t dropped = 0;             // contexts dropped by the halvings so far
+    size_t contexts = 0;            // contexts of the model
+    uint64_t counts = 0;            // sum of the counters, what the model still remembers of the input
+    double entropy = 0;             // as getEntropy()
+    bool saved = false;             // whether the model was saved to the model file
+    vector<pair<string, unsigned int>> top;     // contexts seen the most, printable, and their totals
+};
+
+/**
+ * Finite context model over one of the alphabet policies of alphabet.h. The hot loops are compiled for each
+ * alphabet, fcm.cpp instantiates the model for every alphabet available
+ * @tparam alphabet alphabet policy
+ */
+template<class alphabet>
 class fcm {
+
+    /**
+     * The benchmark suite times the phases of the model one by one
+     */
+    friend class fcmBench;
+
 public:
 
     /**
     * FCM constructor
-    * @param order to process the text
-    * @param input_file stream with the data to process
-    * @param save_file if given, save the results of the processing to a file
-    * @param load_file if given, load previous processing from a file
+    * @param order to process the text, up to alphabet::max_order
+    * @param input_source data to process, nullptr if there is nothing to process
+    * @param save_filename if not empty, save the results of the processing to this model file
+    * @param load_filename if not empty, load previous processing from this model file
     * @param number_characters number of characters of generated text to print every line
     * @param number_lines number of lines of generated text to print
     * @param probl_alpha probability estimation alpha value
+    * @param num_threads number of threads used to count the input
+    * @param memory_budget if not 0, bytes of an approximate count table (sketchCountTable) counting the input
+    * in a single thread, instead of the exact one
     * @return none
     */
-    fcm(unsigned int order, ifstream *input_file, fstream *save_file, fstream *load_file,
-        unsigned int number_characters, unsigned int number_lines, double probl_alpha);
+    fcm(unsigned int order, inputSource *input_source, const string &save_filename, const string &load_filename,
+        unsigned int number_characters, unsigned int number_lines, double probl_alpha, unsigned int num_threads,
+        size_t memory_budget = 0);
 
 
     /**
@@ -49,18 +133,127 @@ public:
     unsigned int getSymbol(const char letter, const char *context);
 
     /**
-    * Converts the statistics of each occurrence to probabilities.
-    * The probability matrix will provide the chance of a certain symbol to occur.
+     * Returns the probability of a symbol given a context, (occurrences + alpha) / (total + alphabet length * alpha),
+     * computed from the counters
+     * @param letter symbol to look for
+     * @param context the k symbols of the context, oldest first
+     * @return probability, 0 for a context never seen when alpha is 0
+     */
+    double getProbability(const char letter, const char *context);
+
+    /**
+    * Prepares the probability model for genText(): probabilities are derived on demand from the counters and
+    * their totals, only the samplers of the hot rows are kept, in a cache bounded by the number of contexts
     */
     void calculateProbabilities();
 
     /**
      * Calculates the accumulated entropy of the text already processed using the foruma ∑ Hi*Pi, where Hi is -Sum from
-     * a to z of P(i)*Log2(P(i)) and P(i) : probability of the occurece of the symbol
+     * a to z of P(i)*Log2(P(i)) and P(i) : probability of the occurece of the symbol.
+     * An approximate count table gives the estimate it kept while counting, without alpha
      * @return accumulated entropy
      */
     double getEntropy();
 
+    /**
+     * Trains on a batch of files, numThreads at a time. Each thread takes the largest file left, counts it in a
+     * table of its own to report its entropy, then adds it to the table of the thread. The thread tables are
+     * summed into the model once every file is done, so the model is the same as with the files concatenated
+     * but for the contexts spanning two files
+     * @param files files to train on
+     * @param per_file_models whether to keep each file in a model of its own instead, the model is left as is
+     * @param model_directory with per_file_models, if not empty, where to save the model of each file, named
+     * after its position in files, zero padded, '_', its name and .dat, e.g. 03_notes.txt.dat
+     * @return report of each file, in the order of files
+     */
+    vector<fileReport> trainFiles(const vector<string> &files, bool per_file_models, const string &model_directory);
+
+    /**
+     * Trains on a stream as it arrives, until it ends, forgetting the old input: every decay_symbols symbols the
+     * counters are halved and the contexts left empty dropped, so the model follows the recent statistics of the
+     * stream in memory bounded by the interval, however long the stream runs. Every snapshot_symbols symbols,
+     * and once the stream ends, a snapshot is taken and the model saved. The stream adds to the model loaded,
+     * if any, copied to a writable table first
+     * @param stream data to process, read as it comes
+     * @param settings intervals of the halvings and snapshots
+     * @param publish callback receiving each snapshot, called from the thread reading the stream
+     * @return 0 once the stream ended, 1 if it couldn't be read or the model saved
+     */
+    int trainStream(inputSource *stream, const streamSettings &settings,
+                    const function<void(const streamSnapshot &)> &publish);
+
+    /**
+     * Drops the contexts out of the limits: the ones seen less than min_count times, then the least seen
+     * ones past top_contexts or past what fits target_bytes. Contexts seen as often as the last one kept are
+     * kept in context order. The kept rows are copied to a new table, so a model used in place from its file
+     * can be pruned and saved to another one
+     * @param limits limits of the model
+     * @return contexts, counts and entropy before and after
+     */
+    pruneReport prune(const pruneLimits &limits);
+
+    /**
+     * Code length of a document under the model: -log2 P(symbol | context) summed over the symbols, with the
+     * probabilities of getProbability(). The first k symbols of the document, which have no full context, and the
+     * symbols of probability 0 (alpha 0 only) are coded as uniform, log2 of the alphabet length bits each.
+     * Only reads the model, so several documents can be scored concurrently. Call prepareScoring() first
+     * @param document data to score
+     * @param per_line whether to keep the score of each line, lines end at '\n' bytes
+     * @return score of the document
+     */
+    documentScore score(inputSource *document, bool per_line) const;
+
+    /**
+     * Prepares the model for score(): when every (context, symbol) pair of the order fits a table, the code
+     * length of each one is computed once, so scoring a symbol is a single load. Larger orders look the
+     * counters up for each symbol
+     */
+    void prepareScoring();
+
+    /**
+     * Code length of a text held in memory, as score() without lines. Call prepareScoring() first
+     * @param text data to score
+     * @param length bytes of the text
+     * @return score of the text
+     */
+    documentScore scoreText(const char *text, size_t length) const;
+
+    /**
+     * Probability of a symbol after a context, as getProbability(), for concurrent lookups
+     * @param context index of the context
+     * @param symbol alphabet code of the symbol
+     * @return probability, 0 for a context never seen when alpha is 0
+     */
+    double probability(uint64_t context, unsigned int symbol) const;
+
+    /**
+     * Builds the index of topSymbols(): the width symbols seen the most after each context, sorted once so a
+     * lookup is a copy of a few entries. Rows are found by context index when every possible context fits
+     * TOP_INDEX_SLOTS, by binary search of the sorted contexts otherwise
+     * @param width most symbols indexed per context
+     */
+    void prepareTopSymbols(unsigned int width);
+
+    /**
+     * Symbols seen the most after a context, from the index of prepareTopSymbols() when it holds n of them,
+     * from the counters otherwise. Only reads the model, lookups can run concurrently
+     * @param context index of the context
+     * @param n most symbols listed
+     * @param symbols where to store the alphabet codes and counts, the most seen first, ties by code
+     * @return total of the context, 0 if it was never seen
+     */
+    unsigned int topSymbols(uint64_t context, unsigned int n, vector<pair<unsigned int, unsigned int>> &symbols) const;
+
+    /**
+     * Counts every order from min_order to max_order in a single scan of the input and prints, for each one,
+     * the number of contexts, the size of its model file and its entropy (as getEntropy())
+     * @param input data to process
+     * @param min_order lowest order to count
+     * @param max_order highest order to count
+     * @param alpha probability estimation alpha value
+     */
+    static void orderCurve(inputSource *input, unsigned int min_order, unsigned int max_order, double alpha);
+
     /**
      * Looks up the symbools table and prints to stdout in a table format
      */
@@ -73,9 +266,50 @@ public:
 
     /**
      * Generates text acording to the results gathered from the analyzed sources.
-     * The statistical matrix will provide the relation between each symbol and the respective chance of occurrence
+     * The statistical matrix will provide the relation between each symbol and the respective chance of occurrence.
+     * Each symbol costs one random number and, for hot contexts, one cached alias table lookup.
+     * The lines are split in chunks of about GENERATION_CHUNK_SYMBOLS symbols, each one drawn from its own
+     * stream of random numbers from a random context, numThreads chunks at a time. The text only depends on
+     * the seed, whatever the number of threads. The first chunk starts with the k symbols of its context
+     * @param out where to write the text, a chunk at a time
+     */
+    void genText(ostream &out = cout);
+
+    /**
+     * Generates the text of genText() straight into a file, sized beforehand: each thread writes the chunks it
+     * draws at their place in the file, in whatever order they are done
+     * @param filename file to write, replaced if it exists
+     * @return 0 if the text was written 1 otherwise
+     */
+    int genFile(const string &filename);
+
+    /**
+     * Sets the seed of genText(), a random one is used otherwise
+     * @param value seed
+     */
+    void setSeed(uint64_t value) { seed = value; }
+
+    /**
+     * Saves p_statMatrix to the specified model file
+     * @param filename model file to save
+     * @return 0 if save successsfull 1 if unsuccesful
+     */
+    int save(const string &filename);
+
+    /**
+     * @return number of contexts of the model
+     */
+    size_t contexts() const { return p_statMatrix->size(); }
+
+    /**
+     * @return count table of the model
+     */
+    const countTable &table() const { return *p_statMatrix; }
+
+    /**
+     * @return context order, the one of the model loaded if any
      */
-    void genText();
+    unsigned int order() const { return k; }
 
 
 private:
@@ -83,31 +317,76 @@ private:
     /**
      * Statistic matrix that contains the counter occurence for each symbol of the alphabet for a given context.
      * Therefore, each line represents a context and columns represent the symbol.
+     * The storage backend is chosen by countTable::create() according to the order.
+     */
+    unique_ptr<countTable> p_statMatrix;
+
+    /**
+     * Sampler of the probability row of a context
+     */
+    struct samplerSlot {
+        uint64_t context;       // context of the sampler, UINT64_MAX (never a context index) while empty
+        uint64_t candidate;     // last context that missed the slot, it gets the slot if it misses again
+        aliasTable sampler;
+    };
+
+    /**
+     * Cache of the samplers of the hot rows visited by genText(), one per generating thread. Probabilities are
+     * not stored anywhere else, they are computed on demand from the counters, so memory stays bounded by the
+     * count table. When every possible context has a slot, the context index is the slot. Otherwise the cache
+     * is direct mapped: a context can only be in one slot and takes it over when it misses twice in a row,
+     * cold rows are drawn straight from the counters. Emptied at the start of each chunk, so what is drawn
+     * doesn't depend on the chunks the thread did before
+     */
+    struct samplerCache {
+        vector<samplerSlot> slots;
+        uint64_t built = 0;     // samplers built, to profile the hit rate of the cache
+    };
+
+    /**
+     * Number of slots of each samplerCache, 0 until calculateProbabilities() sizes them
+     */
+    size_t sampler_slots;
+
+    /**
+     * Seed of the random streams of genText()
      */
-    unique_ptr<map<unsigned int, vector<unsigned int>>> p_statMatrix;
+    uint64_t seed;
 
     /**
-     * Analogous matrix to statMatrix, but the values are the computed probability of a symbol for the given context.
-     * This matrix is calculated using calculateProbabilities()
+     * Code length in bits of each symbol after each context, indexed by context * alphabet length + symbol.
+     * Negative for the symbols coded as uniform, see score(). Empty unless prepareScoring() built it
      */
-    map<unsigned int, vector<double> > probMatrix; //probabilities matrix, obtained through the latter
+    vector<float> code_lengths;
 
     /**
-     * Matrix containing statistical information computed from statMatrix. Each line represents a context and column
-     * has a pair with the sum of the line and the probability of that line
+     * Index of topSymbols(), width entries per row: the symbols seen the most after a context and their counts,
+     * rows with fewer symbols end with entries of count 0
      */
-    map<unsigned int, pair<unsigned int, double>> sum_stat_Matrix;
+    struct topIndex {
+        unsigned int width = 0;         // entries per row, 0 until prepareTopSymbols() builds the index
+        vector<uint32_t> slots;         // row of each possible context, UINT32_MAX if never seen, when they fit
+        vector<uint64_t> contexts;      // context of each row, ascending, when slots don't fit
+        vector<unsigned int> totals;    // total of each row
+        vector<uint8_t> symbols;        // alphabet codes of the entries
+        vector<unsigned int> counts;    // counts of the entries
+    } top_index;
 
     /**
-     * Stores the most occurring occurrence and it's context
+     * Shift turning a hashed context index into a slot of samplers, 0 if slots are context indexes
      */
-    pair<unsigned int, double> most_occurring;
+    unsigned int sampler_shift;
 
     /**
      * Context order
      */
     unsigned int k;
 
+    /**
+     * Integer powers of the alphabet length, from 0 to k
+     */
+    vector<uint64_t> powers;
+
     /**
      * Number of lines to generate by the text generator
      */
@@ -119,31 +398,69 @@ private:
     unsigned int numChar;
 
     /**
-     * Stream containing the input file to be processed
+     * Source of the input data to be processed
      */
-    ifstream *input;
+    inputSource *input;
 
     /**
-     * Stream to be used to save the databases
+     * Model file where to save the databases, empty if not saving
      */
-    fstream *outfile;
+    string outfile;
 
     /**
-     * Stream to read and load an stored database
+     * Model file to load a stored database from, empty if not loading
      */
-    fstream *infile;
+    string infile;
 
     /**
      * Alpha value to be used in the computed probabilities
      */
     double alpha;
 
+    /**
+     * Number of threads counting the input
+     */
+    unsigned int numThreads;
+
+
+    /**
+     * Code length of the symbols scored. Symbols looked up in the counters go into a running product of their
+     * probabilities, kept as a mantissa and a binary exponent so it never underflows: a single log2 per line
+     * instead of one per symbol. Code lengths read from code_lengths are summed as they are
+     */
+    struct codeLength {
+        double mantissa = 1;
+        int64_t exponent = 0;
+        double summed = 0;
+        uint64_t symbols = 0;
+        uint64_t unpredicted = 0;
+
+        /**
+         * @return bits of the symbols scored so far
+         */
+        double bits() const { return summed - (exponent + log2(mantissa)); }
+    };
+
+    /**
+     * Scores a block of alphabet codes, see score(). The context is carried between blocks
+     * @param codes alphabet codes, as converted by alphabet::normalize()
+     * @param length number of codes
+     * @param map_pos index of the current context, updated with the symbols of the block
+     * @param filled number of symbols already in the context (up to k), updated as well
+     * @param length_acc code length, updated with the symbols of the block
+     */
+    void scoreCodes(const uint8_t *codes, size_t length, uint64_t &map_pos, unsigned int &filled,
+                    codeLength &length_acc) const;
 
     /**
-     * Generates a new matrix containing two rows: the sum of the line and the probability of that line
-     * according to current context
+     * Calculates the accumulated entropy of a count table, see getEntropy(), in a single pass over the rows
+     * using the totals kept by the table. Parts of the table are summed concurrently
+     * @param table counters of the model
+     * @param alpha probability estimation alpha value
+     * @param num_threads number of threads summing parts of the table
+     * @return accumulated entropy
      */
-    void generate_sum_prob_Matrix();
+    static double tableEntropy(const countTable &table, double alpha, unsigned int num_threads);
 
     /**
     * 'Adding the occurence of a symbol to the model (updating the corresponding conditioning context)
@@ -152,41 +469,133 @@ private:
     void occurrenceCounter();
 
     /**
-     * Converts an character to our alphabet code using ASCII decimal values as reference
+     * Counts the occurrences of a span of input. The context is carried between spans
+     * @param table where to count the occurrences
+     * @param data start of the span
+     * @param length number of bytes in the span
+     * @param map_pos index of the current context, updated with the symbols of the span
+     * @param filled number of symbols already in the context (up to k), updated as well
+     * @param thread_seconds if given, a span counted along other threads: its time is added here and only to the
+     * thread time of the profile, the caller reports the wall time of the threads together with reportSpans()
+     */
+    void countSpan(countTable &table, const char *data, size_t length, uint64_t &map_pos, unsigned int &filled,
+                   spanSeconds *thread_seconds = nullptr);
+
+    /**
+     * Adds the wall time of spans counted by several threads to the profile, split between normalizing and
+     * counting as the time of the threads
+     * @param threads time of each thread, as added by countSpan()
+     * @param seconds wall time of the spans
+     */
+    static void reportSpans(const vector<spanSeconds> &threads, double seconds);
+
+    /**
+     * Counts the occurrences of a block of alphabet codes. The context is carried between blocks
+     * @param table where to count the occurrences
+     * @param codes alphabet codes, as converted by alphabet::normalize()
+     * @param length number of codes
+     * @param map_pos index of the current context, updated with the symbols of the block
+     * @param filled number of symbols already in the context (up to k), updated as well
+     */
+    void countCodes(countTable &table, const uint8_t *codes, size_t length, uint64_t &map_pos, unsigned int &filled);
+
+    /**
+     * Splits a span in one chunk per thread and counts them concurrently. Each chunk but the first one
+     * recovers its starting context from the k symbols preceding it, so counts equal the serial ones
+     * @param tables one table per thread but the first one, which counts into p_statMatrix
+     * @param data start of the span
+     * @param length number of bytes in the span
+     * @param map_pos index of the current context, updated with the symbols of the span
+     * @param filled number of symbols already in the context (up to k), updated as well
+     */
+    void countSpanParallel(vector<unique_ptr<countTable>> &tables, const char *data, size_t length,
+                           uint64_t &map_pos, unsigned int &filled);
+
+    /**
+     * Rolls the symbols of a span into the context without counting them
+     * @param data start of the span
+     * @param length number of bytes in the span
+     * @param map_pos index of the current context, updated with the symbols of the span
+     * @param filled number of symbols already in the context (up to k), updated as well
+     */
+    void rollContext(const char *data, size_t length, uint64_t &map_pos, unsigned int &filled);
+
+    /**
+     * Converts an character to our alphabet code using the symbol lookup table
      * @param letter to convert to decimal value according to alphabeet
      * @return the decimal code if possible and -1 when out of range
      */
     int charToAlphabet(char letter);
 
     /**
-     * Calculates the index in the map according the an order n using c character
-     * the formula to calculate index is: index = c1^n + c2^n-1 + ... + c
-     * Note that c1 should be converted according to charToAlphabet()
-     * @param buffer buffer of symbols including, context (symbol, if included, is discarded)
-     * @return index for the given context
+     * Prepares genText(), computing the samplers sizes if needed
+     * @param start_keys where to store the contexts a chunk can start from, in context order
+     * @return false if there is nothing to generate
      */
-    unsigned int mapPosCalc(circular_buffer<char> buffer);
+    bool startKeys(vector<uint64_t> &start_keys);
 
     /**
-     * Loads p_statMatrix from specified file
-     * @param s ofsteram to the file to load
-     * @return 0 if save successsfull 1 if unsuccesful
+     * @return lines of each chunk of genText()
      */
-    int load(fstream *s);
+    uint64_t chunkLines() const;
 
     /**
-     * Saves p_statMatrix to the specified file
-     * @param s ifstream to save
-     * @return 0 if save successsfull 1 if unsuccesful
+     * @return offset of a chunk of genText() in the text
      */
-    int save(fstream *s);
+    uint64_t chunkOffset(uint64_t chunk) const;
+
+    /**
+     * Draws a chunk of genText()
+     * @param chunk number of the chunk, also the number of its random stream
+     * @param start_keys contexts a chunk can start from, in context order
+     * @param cache sampler cache of the thread, emptied first
+     * @param text where to store the text of the chunk
+     */
+    void genChunk(uint64_t chunk, const vector<uint64_t> &start_keys, samplerCache &cache, string &text);
+
+    /**
+     * Draws the symbol following a context, with the cached sampler of the context or from its counters.
+     * Symbols never seen in the context are never drawn, the others with weights proportional to their probability
+     * @param cache sampler cache of the thread
+     * @param context index of the context
+     * @param random uniformly distributed 64 bit number
+     * @param symbol drawn symbol
+     * @return false if the context was never seen
+     */
+    bool drawSymbol(samplerCache &cache, uint64_t context, uint64_t random, unsigned int &symbol);
+
+    /**
+     * Calculates the index in the map of a context of order k
+     * the formula to calculate index is: index = c1*27^(k-1) + c2*27^(k-2) + ... + ck
+     * Note that c1 should be converted according to charToAlphabet()
+     * occurrenceCounter() keeps the same index rolling, one symbol at a time
+     * @param context the k symbols of the context, oldest first
+     * @return index for the given context
+     */
+    uint64_t mapPosCalc(const char *context);
+
+    /**
+     * Loads p_statMatrix from specified model file. The model is used straight from the memory mapped file
+     * when there is no input to process, and copied to a writable table otherwise.
+     * The order of the model replaces the order given to the constructor
+     * @param filename model file to load
+     * @return 0 if load successsfull 1 if unsuccesful
+     */
+    int load(const string &filename);
 
     /**
      * Decodes an enocoded string for printing stats table
      * @param number with encoded string
      * @return string of the encoded number
      */
-    string reverse_mapPosCalc(unsigned int number);
+    string reverse_mapPosCalc(uint64_t number);
+
+    /**
+     * Lists the contexts seen the most, ties in context order
+     * @param count most contexts listed
+     * @param top where to store the contexts, printable, and their totals, the most seen first
+     */
+    void topContexts(size_t count, vector<pair<string, unsigned int>> &top);
 
 };
 
@@ -0,0 +1,174 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include "ingest.h"
+
+// size of each read() for inputs that can't be mapped
+#define BLOCK_SIZE (4u << 20)
+
+inputSource::inputSource() : fd(-1), owns_fd(false), regular(false), p_map(nullptr), map_length(0) {
+}
+
+inputSource::~inputSource() {
+    close();
+}
+
+void inputSource::close() {
+
+    if (p_map != nullptr)
+        munmap(p_map, map_length);
+
+    if (owns_fd && fd >= 0)
+        ::close(fd);
+
+    fd = -1;
+    owns_fd = false;
+    regular = false;
+    p_map = nullptr;
+    map_length = 0;
+}
+
+bool inputSource::open(const string &filename) {
+
+    close();
+
+    if ((fd = ::open(filename.c_str(), O_RDONLY)) < 0)
+        return false;
+
+    owns_fd = true;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close();
+        return false;
+    }
+
+    regular = S_ISREG(st.st_mode);
+
+    // empty files can't be mapped, but there's nothing to read either
+    if (!regular || st.st_size == 0)
+        return true;
+
+    void *addr = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    // not mappable after all (special filesystems), fall back to block reads
+    if (addr == MAP_FAILED) {
+        regular = false;
+        return true;
+    }
+
+    p_map = static_cast<char *>(addr);
+    map_length = (size_t) st.st_size;
+
+    // input is scanned once from start to end
+    madvise(p_map, map_length, MADV_SEQUENTIAL);
+
+    return true;
+}
+
+void inputSource::openStdin() {
+
+    close();
+    fd = STDIN_FILENO;
+}
+
+bool inputSource::forEachBlock(const consumer &consume) {
+
+    if (p_map != nullptr) {
+        consume(p_map, map_length);
+        return true;
+    }
+
+    if (fd < 0)
+        return true;
+
+    block.resize(BLOCK_SIZE);
+
+    for (;;) {
+        ssize_t n = read(fd, block.data(), block.size());
+
+        if (n == 0)
+            return true;
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        consume(block.data(), (size_t) n);
+    }
+}
+
+/**
+ * Appends the regular files under a directory, in name order, see listFiles()
+ * @return false if the directory or one under it can't be read
+ */
+static bool listDirectory(const string &directory, vector<string> &files) {
+
+    DIR *dir = opendir(directory.c_str());
+    vector<string> names;
+
+    if (dir == nullptr) {
+        cerr << "Fail opening directory '" << directory << "'" << endl;
+        return false;
+    }
+
+    for (dirent *entry; (entry = readdir(dir)) != nullptr;)
+        if (entry->d_name[0] != '.')
+            names.emplace_back(entry->d_name);
+
+    closedir(dir);
+    sort(names.begin(), names.end());
+
+    for (auto &name : names) {
+        string path = directory + "/" + name;
+        struct stat info;
+
+        if (stat(path.c_str(), &info) != 0)
+            continue;
+
+        if (S_ISDIR(info.st_mode)) {
+            if (!listDirectory(path, files))
+                return false;
+        } else if (S_ISREG(info.st_mode)) {
+            files.push_back(path);
+        }
+    }
+
+    return true;
+}
+
+bool listFiles(const vector<string> &paths, vector<string> &files) {
+
+    for (auto &path : paths) {
+        struct stat info;
+
+        if (!path.empty() && path[0] == '@') {
+            ifstream list(path.substr(1));
+
+            if (!list.is_open()) {
+                cerr << "Fail opening file list '" << path.substr(1) << "'" << endl;
+                return false;
+            }
+
+            for (string line; getline(list, line);)
+                if (!line.empty())
+                    files.push_back(line);
+        } else if (stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+            if (!listDirectory(path, files))
+                return false;
+        } else {
+            // files that can't be opened are reported by the batch itself
+            files.push_back(path);
+        }
+    }
+
+    return true;
+}
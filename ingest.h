@@ -0,0 +1,112 @@
+#ifndef CAV_GMZ_INGEST_H
+#define CAV_GMZ_INGEST_H
+
+
+#include <string>
+#include <vector>
+#include <functional>
+
+using namespace std;
+
+/**
+ * Source of the bytes to process. Regular files are memory mapped and handed over as one contiguous span,
+ * anything else (stdin, pipes, sockets) is read in large blocks.
+ */
+class inputSource {
+public:
+
+    /**
+     * Callback receiving each span of input
+     */
+    typedef function<void(const char *data, size_t length)> consumer;
+
+    inputSource();
+
+    ~inputSource();
+
+    inputSource(const inputSource &) = delete;
+
+    inputSource &operator=(const inputSource &) = delete;
+
+    /**
+     * Opens a file for reading, mapping it in memory when possible
+     * @param filename path of the file
+     * @return true if the file was opened
+     */
+    bool open(const string &filename);
+
+    /**
+     * Uses the standard input as source
+     */
+    void openStdin();
+
+    /**
+     * Passes the whole input to the consumer, span after span
+     * @param consume callback called for each span
+     * @return false if a read error occurred
+     */
+    bool forEachBlock(const consumer &consume);
+
+    /**
+     * @return true if the input is memory mapped and available through data() and size()
+     */
+    bool isMapped() const { return p_map != nullptr; }
+
+    /**
+     * @return start of the mapped input
+     */
+    const char *data() const { return p_map; }
+
+    /**
+     * @return length of the mapped input
+     */
+    size_t size() const { return map_length; }
+
+private:
+
+    /**
+     * File descriptor of the input, -1 if not open
+     */
+    int fd;
+
+    /**
+     * Whether fd is owned (and closed) by this object
+     */
+    bool owns_fd;
+
+    /**
+     * Whether the input is a regular file
+     */
+    bool regular;
+
+    /**
+     * Memory mapped file contents, nullptr if the input isn't mapped
+     */
+    char *p_map;
+
+    /**
+     * Length of the mapped file
+     */
+    size_t map_length;
+
+    /**
+     * Buffer used for non mappable inputs
+     */
+    vector<char> block;
+
+    /**
+     * Releases the mapping and the file descriptor
+     */
+    void close();
+};
+
+/**
+ * Expands the paths of a batch to the files they name: a directory stands for every regular file under it,
+ * in name order, and a path starting with '@' for the paths listed in that file, one per line
+ * @param paths files, directories and lists
+ * @param files where to append the files
+ * @return false if a directory or list can't be read (the reason is printed to cerr)
+ */
+bool listFiles(const vector<string> &paths, vector<string> &files);
+
+#endif //CAV_GMZ_INGEST_H
@@ -1,16 +1,93 @@
 #include <iostream>
 #include <getopt.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <sys/stat.h>
 #include "fcm.h"
+#include "ppm.h"
+#include "codec.h"
+#include "sketch.h"
+#include "server.h"
+#include "profile.h"
 
 #define PROGRAM_NAME "FCM"
 #define VERSION 20161010
 
+#define STREAM_INTERVAL (1u << 20)      // default symbols between two halvings of a streamed model
+#define TOP_DEFAULT 10                  // default contexts listed by --stream, symbols indexed by --serve
+
 #define print_name_version() cout << PROGRAM_NAME << " version " << VERSION << endl
 
 using namespace std;
 
+/**
+ * Options of a run, shared by every alphabet
+ */
+struct runOptions {
+    unsigned int k = 1;             // order number
+    unsigned int nc = 100;          // number of characters
+    unsigned int nl = 10;           // number of lines
+    double alpha = 0.0;             //avoid 0-probabilities
+    unsigned int threads = 1;       // number of counting threads
+    unsigned int min_k = 0, max_k = 0;  // range of orders of the entropy curve
+
+    string infile;                  // model file to load
+    string outfile;                 // model file to save
+    string archive;                 // text archive to convert
+    string datafile;                // data to process, stdin if empty
+    vector<string> documents;       // documents to score, every file argument
+    bool printStats = false, scaling = false;
+    bool ppm = false;               // variable order model instead of the order k one
+    bool score = false, per_line = false;   // score documents with a saved model, and each of their lines
+    bool compress = false, decompress = false;  // code the input with a range coder, to stdout
+    bool merge = false;             // sum the models given as file arguments into outfile
+    bool batch = false, per_file = false;   // train on every file argument, into one model or one model each
+    bool seeded = false;            // whether the text is generated with the given seed
+    uint64_t seed = 0;
+    string gen_file;                // file to generate the text into, stdout if empty
+    size_t memory_budget = 0;       // bytes of the approximate count table, 0 for the exact one
+    bool pruning = false;           // prune the model, after training or as loaded, before saving it
+    pruneLimits prune;
+    bool stream = false;            // train on the input as it comes, halving the counters now and then
+    streamSettings stream_settings;
+    size_t top = TOP_DEFAULT;       // contexts listed by --stream, symbols per context indexed by --serve
+    string socket_path;             // Unix socket to answer queries on with the model of -f
+};
+
 void print_help();
 
+template<class alphabet>
+int run(const runOptions &options);
+
+template<class alphabet>
+int run_ppm(const runOptions &options);
+
+template<class alphabet>
+int run_score(const runOptions &options);
+
+template<class alphabet>
+int run_codec(const runOptions &options);
+
+template<class alphabet>
+int run_batch(const runOptions &options);
+
+template<class alphabet>
+int run_stream(const runOptions &options);
+
+template<class alphabet>
+int run_serve(const runOptions &options);
+
+template<class alphabet>
+int generate(fcm<alphabet> &n, const runOptions &options);
+
+template<class alphabet>
+int print_scaling(unsigned int k, const char *filename, unsigned int max_threads);
+
+void print_prune(const pruneReport &report, unsigned int alphabet_length);
+
 int main(int argc, char **argv) {
 
     if (argc == 1){
@@ -18,95 +95,226 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    // FCM variables
-    unsigned int k = 1;             // order number
-    unsigned int nc = 100;          // number of characters
-    unsigned int nl = 10;           // number of lines
-    double alpha = 0.0;             //avoid 0-probabilities
-
-    ifstream indata;                // data to process
-    fstream infile;                 // hashtable data file
-    fstream outfile;                // hashtable save file
-    fstream *p_infile = &infile;
-    fstream *p_outfile = &outfile;
-    string filename_save_load;
-    bool printStats = false, debugMode = false;
+    runOptions options;
+    options.stream_settings.decay_symbols = STREAM_INTERVAL;
+    string alphabet_name = englishAlphabet::name;
+    bool debugMode = false;
 
     // Read options from arguments
     int opt;
     extern int opterr; // suppress getopt error message
     opterr = 0;
 
-    while ((opt = getopt(argc, argv, "k:f:o:c:l:a:shvd")) != -1) {
+    static struct option long_options[] = {
+            {"scaling", no_argument,       nullptr, 'S'},
+            {"convert", required_argument, nullptr, 'C'},
+            {"alphabet", required_argument, nullptr, 'A'},
+            {"profile", no_argument,       nullptr, 'P'},
+            {"ppm", no_argument,           nullptr, 'M'},
+            {"score", no_argument,         nullptr, 'T'},
+            {"lines", no_argument,         nullptr, 'L'},
+            {"compress", no_argument,      nullptr, 'Z'},
+            {"decompress", no_argument,    nullptr, 'X'},
+            {"merge", no_argument,         nullptr, 'G'},
+            {"mem", required_argument,     nullptr, 'B'},
+            {"prune-min", required_argument, nullptr, 'N'},
+            {"prune-top", required_argument, nullptr, 'U'},
+            {"prune-size", required_argument, nullptr, 'Y'},
+            {"batch", no_argument,         nullptr, 'W'},
+            {"per-file", no_argument,      nullptr, 'F'},
+            {"seed", required_argument,    nullptr, 'R'},
+            {"gen-file", required_argument, nullptr, 'O'},
+            {"stream", no_argument,        nullptr, 'Q'},
+            {"decay", required_argument,   nullptr, 'D'},
+            {"snapshot", required_argument, nullptr, 'E'},
+            {"top", required_argument,     nullptr, 'I'},
+            {"serve", required_argument,   nullptr, 'V'},
+            {"verify", no_argument,        nullptr, 'H'},
+            {nullptr, 0,             nullptr, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "k:K:f:o:c:l:a:j:A:shvd", long_options, nullptr)) != -1) {
         switch (opt) {
             case 'd':
                 debugMode = true;
                 break;
             case 'k': {
-                if ((k = (unsigned) atoi(optarg)) == 0) {
+                // the highest order depends on the alphabet, it is checked once all options are read
+                if ((options.k = (unsigned) atoi(optarg)) == 0) {
                     cerr << "K argument '" << optarg << "' is invalid." << endl;
                     return 1;
                 }
                 //clog << "Using order (k): " << optarg << endl;
                 break;
             }
+            case 'K': {
+                // either a range "1..8" or just the highest order
+                const char *range = strstr(optarg, "..");
+                options.min_k = range == nullptr ? 1 : (unsigned) atoi(optarg);
+                options.max_k = (unsigned) atoi(range == nullptr ? optarg : range + 2);
+
+                if (options.min_k == 0 || options.max_k < options.min_k) {
+                    cerr << "K argument '" << optarg << "' is invalid." << endl;
+                    return 1;
+                }
+                break;
+            }
             case 'f': {
-                if (strcmp(filename_save_load.c_str(), optarg) == 0) {
-                    // same file for save and loading, reusing stream
-                    p_infile = p_outfile;
-                } else {
-                    infile.open(optarg, ios::out | ios::in);
-
-                    if (infile.fail()) {
-                        cerr << "Fail opening file '" << optarg << "' for reading" << endl;
-                        return 1;
-                    }
-
-                    filename_save_load = optarg;
+                if (access(optarg, R_OK) != 0) {
+                    cerr << "Fail opening file '" << optarg << "' for reading" << endl;
+                    return 1;
                 }
+
+                options.infile = optarg;
                 break;
             }
             case 'o': {
-                if (strcmp(filename_save_load.c_str(), optarg) == 0) {
-                    // same file for save and loading, reusing stream
-                    p_outfile = p_infile;
-                } else {
-                    outfile.open(optarg, ios::out);
-
-                    if (outfile.fail()) {
-                        cerr << "Fail opening file '" << optarg << "' for writing" << endl;
-                        return 1;
-                    }
-
-                    //clog << "Output file is: " << optarg << endl;
-                }
+                // models are written aside and renamed, so the same file can be loaded and saved
+                options.outfile = optarg;
                 break;
             }
+            case 'C':
+                options.archive = optarg;
+                break;
             case 's':
                 /* program behaviour:
                  * run for file and print stats
                  */
-                printStats = true;
+                options.printStats = true;
                 break;
             case 'c':
-                if ((nc = (unsigned) atoi(optarg)) == 0) {
+                if ((options.nc = (unsigned) atoi(optarg)) == 0) {
                     cerr << "C argument '" << optarg << "' is invalid." << endl;
                     return 1;
                 }
                 break;
             case 'l':
-                if ((nl = (unsigned) atoi(optarg)) == 0) {
+                if ((options.nl = (unsigned) atoi(optarg)) == 0) {
                     cerr << "L argument '" << optarg << "' is invalid." << endl;
                     return 1;
                 }
                 //clog << "Using order (k): " << optarg << endl;
                 break;
             case 'a':
-                if ((alpha = (double) stod(optarg)) == 0) {
+                if ((options.alpha = (double) stod(optarg)) == 0) {
                     cerr << "Alpha argument '" << optarg << "' is invalid." << endl;
                     return 1;
                 }
                 break;
+            case 'j':
+                if ((options.threads = (unsigned) atoi(optarg)) == 0) {
+                    cerr << "J argument '" << optarg << "' is invalid." << endl;
+                    return 1;
+                }
+                break;
+            case 'S':
+                options.scaling = true;
+                break;
+            case 'A':
+                alphabet_name = optarg;
+                break;
+            case 'P':
+                profiler::enable();
+                break;
+            case 'M':
+                options.ppm = true;
+                break;
+            case 'T':
+                options.score = true;
+                break;
+            case 'L':
+                options.per_line = true;
+                break;
+            case 'Z':
+                options.compress = true;
+                break;
+            case 'X':
+                options.decompress = true;
+                break;
+            case 'G':
+                options.merge = true;
+                break;
+            case 'B':
+                if ((options.memory_budget = parseMemory(optarg)) == 0) {
+                    cerr << "Memory argument '" << optarg << "' is invalid." << endl;
+                    return 1;
+                }
+                break;
+            case 'N':
+                if ((options.prune.min_count = (unsigned) atoi(optarg)) == 0) {
+                    cerr << "Prune argument '" << optarg << "' is invalid." << endl;
+                    return 1;
+                }
+                options.pruning = true;
+                break;
+            case 'U':
+                if ((options.prune.top_contexts = (size_t) atoll(optarg)) == 0) {
+                    cerr << "Prune argument '" << optarg << "' is invalid." << endl;
+                    return 1;
+                }
+                options.pruning = true;
+                break;
+            case 'Y':
+                if ((options.prune.target_bytes = parseMemory(optarg)) == 0) {
+                    cerr << "Prune argument '" << optarg << "' is invalid." << endl;
+                    return 1;
+                }
+                options.pruning = true;
+                break;
+            case 'W':
+                options.batch = true;
+                break;
+            case 'R': {
+                char *end;
+                options.seed = strtoull(optarg, &end, 0);
+
+                if (*optarg == '\0' || *end != '\0') {
+                    cerr << "Seed argument '" << optarg << "' is invalid." << endl;
+                    return 1;
+                }
+                options.seeded = true;
+                break;
+            }
+            case 'O':
+                options.gen_file = optarg;
+                break;
+            case 'F':
+                options.batch = options.per_file = true;
+                break;
+            case 'Q':
+                options.stream = true;
+                break;
+            case 'D':
+                // symbols, with the suffixes of memory sizes
+                if ((options.stream_settings.decay_symbols = parseMemory(optarg)) == 0) {
+                    cerr << "Decay argument '" << optarg << "' is invalid." << endl;
+                    return 1;
+                }
+                options.stream = true;
+                break;
+            case 'E':
+                if ((options.stream_settings.snapshot_symbols = parseMemory(optarg)) == 0) {
+                    cerr << "Snapshot argument '" << optarg << "' is invalid." << endl;
+                    return 1;
+                }
+                options.stream = true;
+                break;
+            case 'I': {
+                char *end;
+                options.top = (size_t) strtoull(optarg, &end, 10);
+
+                if (*optarg == '\0' || *end != '\0') {
+                    cerr << "Top argument '" << optarg << "' is invalid." << endl;
+                    return 1;
+                }
+                break;
+            }
+            case 'V':
+                options.socket_path = optarg;
+                break;
+            case 'H':
+                mappedCountTable::verifyChecksums();
+                break;
             case 'h':
                 print_help();
                 return 0;
@@ -119,53 +327,582 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (optind == argc) {
-        if (printStats && infile.is_open()) {
+    if (!debugMode) {
+        clog.setstate(ios::failbit);
+    }
+
+    if (optind < argc)
+        options.datafile = argv[argc - 1];
+
+    options.documents.assign(argv + optind, argv + argc);
+
+    int status;
+
+    if (alphabet_name == englishAlphabet::name)
+        status = run<englishAlphabet>(options);
+    else if (alphabet_name == portugueseAlphabet::name)
+        status = run<portugueseAlphabet>(options);
+    else if (alphabet_name == dnaAlphabet::name)
+        status = run<dnaAlphabet>(options);
+    else if (alphabet_name == byteAlphabet::name)
+        status = run<byteAlphabet>(options);
+    else {
+        cerr << "Alphabet '" << alphabet_name << "' is unknown (english, portuguese, dna or bytes)" << endl;
+        return 1;
+    }
+
+    // the profile goes to stderr, apart from the results
+    if (profiler::enabled())
+        profiler::print(cerr);
+
+    return status;
+}
+
+/**
+ * Runs the program with the model specialized for an alphabet
+ * @param options parsed command line
+ * @return exit status
+ */
+template<class alphabet>
+int run(const runOptions &options) {
+
+    unsigned int k = options.k;
+
+    if (options.memory_budget > 0 && (!options.infile.empty() || !options.outfile.empty() || options.max_k > 0
+                                      || options.scaling || options.ppm || options.pruning || options.batch
+                                      || options.stream || !options.socket_path.empty())) {
+        cerr << "--mem models only keep their heavy hitters exactly, they can't be used with -f, -o, -K, --scaling,"
+             << " --ppm, --prune, --batch, --stream or --serve" << endl;
+        return 1;
+    }
+
+    if (options.ppm)
+        return run_ppm<alphabet>(options);
+
+    if (options.score)
+        return run_score<alphabet>(options);
 
-            fcm n = fcm(k, &indata, &*p_outfile, &*p_infile, nc, nl, alpha);
+    if (!options.socket_path.empty())
+        return run_serve<alphabet>(options);
 
-            n.printStats();
-            n.calculateProbabilities();
-            n.genText();
+    if (k > alphabet::max_order || options.max_k > alphabet::max_order) {
+        cerr << "Order is invalid for the alphabet '" << alphabet::name << "' (1 to " << alphabet::max_order << ")."
+             << endl;
+        return 1;
+    }
 
-            return 0;
+    if (options.compress || options.decompress)
+        return run_codec<alphabet>(options);
+
+    if (options.batch)
+        return run_batch<alphabet>(options);
+
+    if (options.stream)
+        return run_stream<alphabet>(options);
+
+    if (options.merge) {
+        if (options.outfile.empty() || options.documents.empty()) {
+            cerr << "Merging needs the models to sum as file arguments and an output model (-o)" << endl;
+            return 1;
+        }
+        return mergeModels(options.documents, alphabet::name, alphabet::length, options.outfile, options.threads);
+    }
+
+    if (!options.archive.empty()) {
+        if (options.outfile.empty()) {
+            cerr << "Converting a text archive needs an output model (-o)" << endl;
+            return 1;
         }
+        return convertArchive(options.archive, k, alphabet::name, alphabet::length, options.outfile);
+    }
 
-        cerr << "No file for processing specified nor printing stats from saved file" << endl;
+    if (options.scaling) {
+        if (options.datafile.empty()) {
+            cerr << "Scaling report needs a file to process" << endl;
+            return 1;
+        }
+        return print_scaling<alphabet>(k, options.datafile.c_str(), options.threads);
+    }
+
+    inputSource indata;             // data to process
+    bool curve = options.max_k > 0;
+
+    if (options.pruning && curve) {
+        cerr << "Pruning applies to a single order, it can't be used with -K" << endl;
         return 1;
+    }
+
+    if (options.datafile.empty()) {
+        if (options.pruning && !options.infile.empty()) {
+
+            // prune a saved model, used in place from its file
+            fcm<alphabet> n(k, nullptr, "", options.infile, 0, 0, options.alpha, options.threads);
+
+            print_prune(n.prune(options.prune), alphabet::length);
+
+            if (options.printStats)
+                n.printStats();
+
+            return options.outfile.empty() ? 0 : n.save(options.outfile);
+        }
+
+        if ((options.printStats || !options.gen_file.empty()) && !options.infile.empty() && !curve) {
+
+            fcm<alphabet> n(k, nullptr, options.outfile, options.infile, options.nc, options.nl, options.alpha,
+                            options.threads);
+
+            if (options.printStats)
+                n.printStats();
+
+            return generate(n, options);
+        }
+
+        clog << "Using standard input for processing" << endl;
+        indata.openStdin();
     } else {
-        string filename = argv[argc - 1];
-        indata.open(filename);
+        if (!indata.open(options.datafile)) {
+            cerr << "Fail opening file '" << options.datafile << "' for reading" << endl;
+            return 1;
+        }
 
-        if (indata.fail()) {
-            cerr << "Fail opening file '" << filename << "' for reading" << endl;
+        clog << "Using input stream for processing: " << options.datafile << endl;
+    }
+
+    if (curve) {
+        fcm<alphabet>::orderCurve(&indata, options.min_k, options.max_k, options.alpha);
+        return 0;
+    }
+
+    // a pruned model is saved once pruned
+    fcm<alphabet> n(k, &indata, options.pruning ? "" : options.outfile, options.infile, options.nc, options.nl,
+                    options.alpha, options.threads, options.memory_budget);
+
+    if (options.pruning) {
+        print_prune(n.prune(options.prune), alphabet::length);
+
+        if (!options.outfile.empty() && n.save(options.outfile) != 0)
+            return 1;
+    }
+
+    if (options.printStats) {
+        n.printStats();
+
+        auto sketch = dynamic_cast<const sketchCountTable *>(&n.table());
+        if (sketch != nullptr)
+            cout << "Sketch: " << sketch->memoryBytes() << " bytes, " << sketch->size() << " heavy hitters of "
+                 << sketch->heavyCapacity() << ", estimated entropy" << endl;
+
+        cout << "Entropy: " << n.getEntropy() << endl;
+    }
+
+    if (options.nl > 0) {
+        cout << "Calculating probabilities... " << endl;
+        n.calculateProbabilities();       //get probability matrix
+        // n.printProbs(); TODO: prettify print
+        cout << "Generating " << options.nl << " lines with " << options.nc << " chars:" << endl;
+        return generate(n, options);
+    }
+
+    return 0;
+}
+
+/**
+ * Generates the text of a model, -j chunks at a time, to stdout or to the file of --gen-file
+ * @param n trained model
+ * @param options parsed command line
+ * @return exit status
+ */
+template<class alphabet>
+int generate(fcm<alphabet> &n, const runOptions &options) {
+
+    if (options.seeded)
+        n.setSeed(options.seed);
+
+    if (!options.gen_file.empty())
+        return n.genFile(options.gen_file);
+
+    n.genText();
+    return 0;
+}
+
+/**
+ * Runs the variable order model, trained on the data file or the standard input
+ * @param options parsed command line, k is the longest context
+ * @return exit status
+ */
+template<class alphabet>
+int run_ppm(const runOptions &options) {
+
+    if (options.k > PPM_MAX_DEPTH) {
+        cerr << "Order is invalid for --ppm (1 to " << PPM_MAX_DEPTH << ")." << endl;
+        return 1;
+    }
+
+    if (!options.infile.empty() || !options.outfile.empty() || !options.archive.empty() || options.max_k > 0
+        || options.scaling) {
+        cerr << "--ppm models are not saved or loaded and can't be used with -f, -o, -K, --convert or --scaling"
+             << endl;
+        return 1;
+    }
+
+    inputSource indata;             // data to process
+
+    if (options.datafile.empty()) {
+        clog << "Using standard input for processing" << endl;
+        indata.openStdin();
+    } else {
+        if (!indata.open(options.datafile)) {
+            cerr << "Fail opening file '" << options.datafile << "' for reading" << endl;
             return 1;
         }
 
-        if (!debugMode) {
-            clog.setstate(ios::failbit);
+        clog << "Using input stream for processing: " << options.datafile << endl;
+    }
+
+    ppm<alphabet> model(options.k);
+    model.train(&indata);
+
+    if (options.printStats) {
+        model.printStats();
+        cout << "Entropy: " << model.getEntropy() << endl;
+    }
+
+    if (options.nl > 0) {
+        cout << "Generating " << options.nl << " lines with " << options.nc << " chars:" << endl;
+        model.genText(options.nl, options.nc, options.seeded ? options.seed : streamRng::randomSeed());
+    }
+
+    return 0;
+}
+
+/**
+ * Scores every document with a saved model, -j documents at a time, and prints the code length of each one
+ * @param options parsed command line, infile is the model
+ * @return exit status
+ */
+template<class alphabet>
+int run_score(const runOptions &options) {
+
+    if (options.infile.empty()) {
+        cerr << "Scoring needs a model (-f)" << endl;
+        return 1;
+    }
+
+    // the model is used in place from the mapped file
+    fcm<alphabet> n(options.k, nullptr, "", options.infile, 0, 0, options.alpha, options.threads);
+
+    if (n.contexts() == 0) {
+        cerr << "Model '" << options.infile << "' has nothing to score with" << endl;
+        return 1;
+    }
+
+    n.prepareScoring();
+
+    vector<string> names = options.documents;
+    if (names.empty())
+        names.emplace_back("-");
+
+    vector<documentScore> scores(names.size());
+    vector<char> opened(names.size(), false);
+    atomic<size_t> next(0);
+
+    // each thread takes the next document left until there is none
+    auto worker = [&]() {
+        for (size_t i; (i = next.fetch_add(1)) < names.size();) {
+            inputSource document;
+
+            if (names[i] == "-")
+                document.openStdin();
+            else if (!document.open(names[i]))
+                continue;
+
+            opened[i] = true;
+            scores[i] = n.score(&document, options.per_line);
         }
+    };
+
+    vector<thread> threads;
+    for (unsigned int t = 1; t < min((size_t) options.threads, names.size()); t++)
+        threads.emplace_back(worker);
+
+    worker();
 
-        clog << "Using input stream for processing: " << filename << endl;
+    for (auto &t : threads)
+        t.join();
 
-        fcm n = fcm(k, &indata, &*p_outfile, &*p_infile, nc, nl, alpha);
+    int status = 0;
+    documentScore total;
 
-        if (printStats) {
-            n.printStats();
-            cout << "Entropy: " << n.getEntropy() << endl;
+    cout << fixed << setprecision(4);
+
+    for (size_t i = 0; i < names.size(); i++) {
+        if (!opened[i]) {
+            cerr << "Fail opening file '" << names[i] << "' for reading" << endl;
+            status = 1;
+            continue;
         }
 
-        if (nl > 0) {
-            cout << "Calculating probabilities... " << endl;
-            n.calculateProbabilities();       //get probability matrix
-            // n.printProbs(); TODO: prettify print
-            cout << "Generating " << nl << " lines with " << nc << " chars:" << endl;
-            n.genText();
+        for (size_t line = 0; line < scores[i].lines.size(); line++) {
+            auto &score = scores[i].lines[line];
+            cout << names[i] << ":" << line + 1 << "\t" << score.first << "\t" << score.second << "\t"
+                 << (score.first == 0 ? 0 : score.second / score.first) << endl;
         }
 
+        total.symbols += scores[i].symbols;
+        total.unpredicted += scores[i].unpredicted;
+        total.bits += scores[i].bits;
     }
 
-    return 0;
+    cout << setw(16) << "bits" << setw(14) << "symbols" << setw(14) << "bits/symbol" << setw(14) << "unpredicted"
+         << "  document" << endl;
+
+    auto print = [](const documentScore &score, const string &name) {
+        cout << setw(16) << score.bits << setw(14) << score.symbols << setw(14)
+             << (score.symbols == 0 ? 0 : score.bits / score.symbols) << setw(14) << score.unpredicted << "  "
+             << name << endl;
+    };
+
+    for (size_t i = 0; i < names.size(); i++)
+        if (opened[i])
+            print(scores[i], names[i]);
+
+    if (names.size() > 1)
+        print(total, "total");
+
+    return status;
+}
+
+/**
+ * Trains on every file named by the file arguments, -j files at a time, into one model saved to -o, or into a
+ * model per file saved to the directory -o, and prints the symbols, contexts and entropy of each file
+ * @param options parsed command line
+ * @return exit status
+ */
+template<class alphabet>
+int run_batch(const runOptions &options) {
+
+    vector<string> files;
+    struct stat info;
+
+    if (options.max_k > 0 || options.scaling || options.pruning || !options.archive.empty()) {
+        cerr << "--batch can't be used with -K, --scaling, --prune or --convert" << endl;
+        return 1;
+    }
+
+    if (options.documents.empty()) {
+        cerr << "Batch training needs files, directories or @lists of files as arguments" << endl;
+        return 1;
+    }
+
+    if (options.per_file && !options.infile.empty()) {
+        cerr << "Per file models start empty, they can't be used with -f" << endl;
+        return 1;
+    }
+
+    if (options.per_file && !options.outfile.empty()
+        && (stat(options.outfile.c_str(), &info) != 0 || !S_ISDIR(info.st_mode))) {
+        cerr << "Per file models are saved to a directory, '" << options.outfile << "' isn't one" << endl;
+        return 1;
+    }
+
+    if (!listFiles(options.documents, files))
+        return 1;
+
+    fcm<alphabet> n(options.k, nullptr, "", options.infile, 0, 0, options.alpha, options.threads);
+    vector<fileReport> reports = n.trainFiles(files, options.per_file, options.per_file ? options.outfile : "");
+
+    int status = 0;
+    fileReport total;
+    double bits = 0;
+
+    cout << setw(14) << "symbols" << setw(12) << "contexts" << setw(12) << "entropy" << "  file" << endl;
+    cout << fixed << setprecision(4);
+
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!reports[i].ok) {
+            cerr << "Fail training on file '" << files[i] << "'" << endl;
+            status = 1;
+            continue;
+        }
+
+        cout << setw(14) << reports[i].symbols << setw(12) << reports[i].contexts << setw(12) << reports[i].entropy
+             << "  " << files[i] << endl;
+
+        total.symbols += reports[i].symbols;
+        total.contexts += reports[i].contexts;
+        bits += reports[i].entropy * reports[i].symbols;
+    }
+
+    // files on their own, their entropy weighted by their symbols, then the model they make together
+    cout << setw(14) << total.symbols << setw(12) << total.contexts << setw(12)
+         << (total.symbols == 0 ? 0 : bits / total.symbols) << "  files" << endl;
+
+    if (!options.per_file) {
+        cout << setw(14) << n.table().total() << setw(12) << n.contexts() << setw(12) << n.getEntropy()
+             << "  model" << endl;
+
+        if (!options.outfile.empty() && n.save(options.outfile) != 0)
+            return 1;
+    }
+
+    return status;
+}
+
+/**
+ * Trains on the data file or the standard input as it comes, until it ends, halving the counters every --decay
+ * symbols. Prints a row of the model and its most seen contexts every --snapshot symbols and at the end,
+ * saving it to -o each time
+ * @param options parsed command line
+ * @return exit status
+ */
+template<class alphabet>
+int run_stream(const runOptions &options) {
+
+    if (options.max_k > 0 || options.scaling || options.pruning || !options.archive.empty() || options.merge) {
+        cerr << "--stream can't be used with -K, --scaling, --prune, --convert or --merge" << endl;
+        return 1;
+    }
+
+    inputSource indata;             // data to process
+
+    if (options.datafile.empty()) {
+        clog << "Using standard input for processing" << endl;
+        indata.openStdin();
+    } else if (!indata.open(options.datafile)) {
+        cerr << "Fail opening file '" << options.datafile << "' for reading" << endl;
+        return 1;
+    }
+
+    streamSettings settings = options.stream_settings;
+    settings.model_file = options.outfile;
+    settings.top_contexts = options.top;
+
+    fcm<alphabet> n(options.k, nullptr, "", options.infile, 0, 0, options.alpha, options.threads);
+
+    cout << setw(14) << "symbols" << setw(14) << "counts" << setw(12) << "contexts" << setw(12) << "dropped"
+         << setw(12) << "entropy" << endl;
+
+    // flushed at each snapshot, whoever reads the output gets it as it comes
+    int status = n.trainStream(&indata, settings, [](const streamSnapshot &snapshot) {
+        cout << fixed << setprecision(4) << setw(14) << snapshot.symbols << setw(14) << snapshot.counts
+             << setw(12) << snapshot.contexts << setw(12) << snapshot.dropped << setw(12) << snapshot.entropy
+             << (snapshot.saved ? "  saved" : "") << endl;
+
+        for (auto &context : snapshot.top)
+            cout << setw(28) << context.second << "  \"" << context.first << "\"" << endl;
+
+        cout.flush();
+    });
+
+    if (options.printStats)
+        n.printStats();
+
+    return status;
+}
+
+/**
+ * Answers queries on the model of -f over the Unix socket of --serve until stopped, -j connections at a time,
+ * see fcmServer. The model is used in place from its file, with its top --top symbols of each context indexed
+ * @param options parsed command line
+ * @return exit status
+ */
+template<class alphabet>
+int run_serve(const runOptions &options) {
+
+    if (options.infile.empty()) {
+        cerr << "Serving needs a model (-f)" << endl;
+        return 1;
+    }
+
+    if (options.max_k > 0 || options.scaling || options.pruning || options.batch || options.stream || options.merge
+        || !options.archive.empty() || !options.datafile.empty()) {
+        cerr << "--serve only answers queries on the model of -f, it can't be used with -K, --scaling, --prune,"
+             << " --batch, --stream, --merge, --convert or data files" << endl;
+        return 1;
+    }
+
+    if (options.top == 0 || options.top > alphabet::length) {
+        cerr << "--serve indexes 1 to " << alphabet::length << " symbols per context (--top)" << endl;
+        return 1;
+    }
+
+    fcm<alphabet> n(options.k, nullptr, "", options.infile, 0, 0, options.alpha, options.threads);
+
+    if (n.contexts() == 0) {
+        cerr << "Model '" << options.infile << "' has nothing to answer with" << endl;
+        return 1;
+    }
+
+    n.prepareScoring();
+    n.prepareTopSymbols((unsigned int) options.top);
+
+    fcmServer<alphabet> server(n, options.threads);
+    int status = server.serve(options.socket_path);
+
+    if (status == 0 && options.printStats) {
+        serverStats stats = server.stats();
+        cout << stats.connections << " connections, " << stats.queries << " queries in " << stats.batches
+             << " batches, " << stats.errors << " errors" << endl;
+    }
+
+    return status;
+}
+
+/**
+ * Compresses or decompresses the data file or the standard input to the standard output
+ * @param options parsed command line, k is the order of the model compressing
+ * @return exit status
+ */
+template<class alphabet>
+int run_codec(const runOptions &options) {
+
+    if (options.compress && options.decompress) {
+        cerr << "Either --compress or --decompress" << endl;
+        return 1;
+    }
+
+    inputSource indata;             // data to process
+
+    if (options.datafile.empty()) {
+        indata.openStdin();
+    } else if (!indata.open(options.datafile)) {
+        cerr << "Fail opening file '" << options.datafile << "' for reading" << endl;
+        return 1;
+    }
+
+    fcmCodec<alphabet> codec(options.k, options.alpha, options.threads);
+    codecStats stats;
+    int status;
+    auto start = chrono::steady_clock::now();
+
+    if (options.compress) {
+        status = codec.compress(&indata, cout, stats);
+    } else if (indata.isMapped()) {
+        status = codec.decompress(indata.data(), indata.size(), cout, stats);
+    } else {
+        // blocks are found from the headers before decoding, so a stream is read whole first
+        vector<char> compressed;
+        indata.forEachBlock([&compressed](const char *data, size_t length) {
+            compressed.insert(compressed.end(), data, data + length);
+        });
+        status = codec.decompress(compressed.data(), compressed.size(), cout, stats);
+    }
+
+    cout.flush();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // stdout has the data, the statistics go to stderr
+    if (status == 0 && options.printStats) {
+        uint64_t coded = options.compress ? stats.output_bytes : stats.input_bytes;
+        uint64_t plain = options.compress ? stats.input_bytes : stats.output_bytes;
+
+        cerr << stats.symbols << " symbols, " << stats.input_bytes << " bytes in, " << stats.output_bytes
+             << " bytes out, " << stats.blocks << " blocks" << endl;
+        cerr << "Bits per symbol: " << (stats.symbols == 0 ? 0 : coded * 8.0 / stats.symbols) << endl;
+        cerr << "Seconds: " << seconds << ", MB/s: " << plain / seconds / (1 << 20) << endl;
+    }
+
+    return status;
 }
 
 void print_help() {
@@ -173,6 +910,7 @@ void print_help() {
     cout << endl;
     cout << "Usage options:" << endl;
     cout << " -k       : specify order (default: 1)" << endl;
+    cout << " -K       : entropy of every order in a range, e.g. 1..8, in a single pass" << endl;
     cout << " -f       : read data from file (default: none)" << endl;
     cout << " -o       : save data to file (default: none)" << endl;
     cout << " -s       : print statistics (optional)" << endl;
@@ -180,6 +918,42 @@ void print_help() {
     cout << " -l       : number of lines to generate text" << endl;
     cout << " -d       : print all debug messages" << endl;
     cout << " -a       : specify alpha for probability calculation (default: 0)" << endl;
+    cout << " -j       : number of threads counting the input (default: 1)" << endl;
+    cout << " -A       : alphabet: english, portuguese (latin-1), dna or bytes (default: english)" << endl;
+    cout << " --scaling: print training throughput from 1 to -j threads" << endl;
+    cout << " --profile: print wall and thread time, symbols, contexts, allocated bytes and throughput of each phase to stderr"
+         << endl;
+    cout << " --ppm    : variable order model (PPM) with contexts up to -k symbols, escaping to shorter ones" << endl;
+    cout << " --score  : code length of each file argument under the model of -f, -j files at a time" << endl;
+    cout << " --lines  : with --score, also print the code length of each line" << endl;
+    cout << " --compress  : compress the alphabet symbols of the input to stdout, -k order model, -a alpha (default:"
+         << " 1/32), -j threads" << endl;
+    cout << " --decompress: decompress to stdout, -s prints sizes and throughput to stderr" << endl;
+    cout << " --mem    : approximate counts within a memory budget, e.g. 512M or 2G, for orders too high to count"
+         << endl;
+    cout << " --prune-min : drop the contexts seen fewer times than this, after training or from the model of -f"
+         << endl;
+    cout << " --prune-top : keep only this many contexts, the ones seen the most" << endl;
+    cout << " --prune-size: keep the contexts seen the most that fit a model file of this size, e.g. 64M" << endl;
+    cout << " --batch  : train on every file, directory (recursively) and @list of files given, -j files at a time,"
+         << " print the entropy of each file and save their sum to -o" << endl;
+    cout << " --per-file  : with --batch, a model per file, saved to the directory -o" << endl;
+    cout << " --stream : train on the input as it comes until it ends, halving the counters every --decay symbols"
+         << endl;
+    cout << " --decay  : symbols between two halvings of --stream, e.g. 4M (default: 1M)" << endl;
+    cout << " --snapshot  : symbols between two rows of --stream, saving the model to -o (default: at the end)"
+         << endl;
+    cout << " --top    : contexts seen the most listed with each row of --stream, symbols indexed per context by"
+         << " --serve (default: 10)" << endl;
+    cout << " --serve  : answer COUNT, PROB, TOPN and CODELEN queries on the model of -f over this Unix socket,"
+         << " -j connections at a time" << endl;
+    cout << " --seed   : seed of the generated text, the same seed gives the same text whatever -j" << endl;
+    cout << " --gen-file  : generate the text into this file, -j threads writing chunks in place" << endl;
+    cout << " --merge  : sum the models given as file arguments into the model of -o, -j key ranges at a time"
+         << endl;
+    cout << " --verify : check the checksum of the models loaded, which reads them whole (always done by --merge)"
+         << endl;
+    cout << " --convert: convert a text archive of previous versions to a model (needs -k and -o)" << endl;
     cout << " -h       : display this help" << endl;
     cout << " (file)   : file to read from (if not specified read from stdin)" << endl;
     cout << endl;
@@ -195,4 +969,94 @@ void print_help() {
     cout << endl;
     cout << " Print stats from saved file" << endl;
     cout << " ./fcm -f save.dat -s" << endl;
+    cout << endl;
+    cout << " Entropy and model size of the orders 1 to 8 of \"os_maias.txt\"" << endl;
+    cout << " ./fcm -K 1..8 os_maias.txt" << endl;
+    cout << endl;
+    cout << " Convert an order 3 text archive \"old_hash\" to the model \"save.dat\"" << endl;
+    cout << " ./fcm -k 3 --convert old_hash -o save.dat" << endl;
+    cout << endl;
+    cout << " Entropy of order 12 of the DNA sequence \"genome.txt\"" << endl;
+    cout << " ./fcm -A dna -k 12 -s genome.txt" << endl;
+    cout << endl;
+    cout << " Report training throughput of order 5 with 1 to 8 threads" << endl;
+    cout << " ./fcm -k 5 -j 8 --scaling os_maias.txt" << endl;
+    cout << endl;
+    cout << " Bits per symbol of two documents under the model \"save.dat\", smoothed with alpha 0.01" << endl;
+    cout << " ./fcm -f save.dat -a 0.01 --score a.txt b.txt" << endl;
+    cout << endl;
+    cout << " Shrink the model \"save.dat\" to 64 MB, dropping the contexts seen once" << endl;
+    cout << " ./fcm -f save.dat --prune-min 2 --prune-size 64M -o small.dat" << endl;
+    cout << endl;
+    cout << " Entropy of every file under \"corpus\" and a model of all of them, 8 files at a time" << endl;
+    cout << " ./fcm -k 5 -j 8 --batch -o save.dat corpus" << endl;
+    cout << endl;
+    cout << " Follow a log as it grows: halve the counts every 4M symbols, report and save every 1M" << endl;
+    cout << " tail -F app.log | ./fcm -k 5 --stream --decay 4M --snapshot 1M -o live.dat" << endl;
+    cout << endl;
+    cout << " Answer queries on the model \"save.dat\" over the socket \"fcm.sock\", 4 connections at a time" << endl;
+    cout << " ./fcm -f save.dat -j 4 --serve fcm.sock" << endl;
+    cout << endl;
+    cout << " Generate 1 GB of text from the model \"save.dat\" with 8 threads, the same for every run" << endl;
+    cout << " ./fcm -f save.dat -j 8 -l 10000000 -c 99 --seed 42 --gen-file synthetic.txt" << endl;
+    cout << endl;
+    cout << " Sum the models of two shards into \"save.dat\"" << endl;
+    cout << " ./fcm --merge -o save.dat shard1.dat shard2.dat" << endl;
+    cout << endl;
+    cout << " Compress \"os_maias.txt\" with an order 3 model, in 4 lanes coded at once, and decompress it" << endl;
+    cout << " ./fcm -A bytes -k 3 -j 4 --compress os_maias.txt > os_maias.fcmz" << endl;
+    cout << " ./fcm -A bytes -j 4 --decompress os_maias.fcmz > os_maias.txt" << endl;
+    cout << endl;
+    cout << " Code length and 5 generated lines of a PPM model with contexts up to 16 symbols" << endl;
+    cout << " ./fcm --ppm -k 16 -s -l 5 os_maias.txt" << endl;
+}
+
+/**
+ * Prints how much a pruning pass took off the model and how the entropy changed
+ * @param report outcome of fcm::prune()
+ * @param alphabet_length number of symbols of the alphabet
+ */
+void print_prune(const pruneReport &report, unsigned int alphabet_length) {
+
+    double kept = report.counts_before == 0 ? 1 : (double) report.counts_after / report.counts_before;
+
+    // the counts of the dropped contexts cost log2(L) bits each once their contexts are unknown, see score()
+    double code_length = report.entropy_after * kept + log2(alphabet_length) * (1 - kept);
+
+    cout << "Pruned contexts: " << report.contexts_before << " -> " << report.contexts_after << endl;
+    cout << "Counts kept: " << kept * 100 << "%" << endl;
+    cout << "Model file: " << modelFileSize(report.contexts_before, alphabet_length) << " -> "
+         << modelFileSize(report.contexts_after, alphabet_length) << " bytes" << endl;
+    cout << "Entropy: " << report.entropy_before << " -> " << report.entropy_after << " over the kept contexts, "
+         << code_length << " with the dropped counts coded as uniform" << endl;
+}
+
+template<class alphabet>
+int print_scaling(unsigned int k, const char *filename, unsigned int max_threads) {
+
+    double serial_time = 0;
+
+    cout << setw(8) << "threads" << setw(12) << "seconds" << setw(12) << "MB/s" << setw(10) << "speedup" << endl;
+
+    for (unsigned int t = 1; t <= max_threads; t++) {
+        inputSource indata;
+
+        if (!indata.open(filename)) {
+            cerr << "Fail opening file '" << filename << "' for reading" << endl;
+            return 1;
+        }
+
+        auto start = chrono::steady_clock::now();
+        fcm<alphabet> n(k, &indata, "", "", 0, 0, 0, t);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        if (t == 1)
+            serial_time = seconds;
+
+        cout << setw(8) << t << setw(12) << fixed << setprecision(4) << seconds
+             << setw(12) << setprecision(1) << indata.size() / seconds / (1 << 20)
+             << setw(10) << setprecision(2) << serial_time / seconds << endl;
+    }
+
+    return 0;
 }
@@ -0,0 +1,608 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <queue>
+#include <thread>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <stdexcept>
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/serialization/vector.hpp>
+#include <boost/serialization/map.hpp>
+#include "modelfile.h"
+
+// bytes of each counter in the files written by this version
+#define COUNT_WIDTH sizeof(unsigned int)
+
+#define MERGE_PARTS_PER_THREAD 8        // key ranges of a merge per thread, to even out their sizes
+#define MERGE_BUFFER_ROWS (1u << 14)    // rows of a merge range buffered before being written
+#define CHECKSUM_CHUNK_WORDS (1u << 17) // words read at once while summing the checksum of a merged model
+
+uint64_t modelChecksum(const uint64_t *words, size_t count, size_t first) {
+
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        // splitmix64 finalizer over the word and its position
+        uint64_t z = words[i] ^ ((first + i) * 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        sum += z ^ (z >> 31);
+    }
+
+    return sum;
+}
+
+bool mappedCountTable::verify_checksums = false;
+
+size_t modelFileSize(size_t rows, unsigned int width) {
+    return sizeof(modelHeader) + rows * sizeof(uint64_t) + (rows * (width + 1) * COUNT_WIDTH + 7) / 8 * 8;
+}
+
+/**
+ * Writes the payload of a model file while computing its checksum
+ */
+class payloadWriter {
+public:
+
+    explicit payloadWriter(ofstream &stream) : out(stream), words(0), checksum(0), pending(0) {
+    }
+
+    void write(const void *data, size_t length) {
+
+        const char *bytes = static_cast<const char *>(data);
+
+        out.write(bytes, length);
+
+        while (length > 0) {
+            size_t n = min(length, sizeof(uint64_t) - pending);
+            memcpy(reinterpret_cast<char *>(&word) + pending, bytes, n);
+            pending += n;
+            bytes += n;
+            length -= n;
+
+            if (pending == sizeof(uint64_t)) {
+                checksum += modelChecksum(&word, 1, words++);
+                pending = 0;
+            }
+        }
+    }
+
+    /**
+     * Pads the payload with zeros up to a whole word
+     * @return checksum of the payload
+     */
+    uint64_t finish() {
+
+        const char zeros[sizeof(uint64_t)] = {0};
+
+        if (pending > 0)
+            write(zeros, sizeof(uint64_t) - pending);
+
+        return checksum;
+    }
+
+private:
+    ofstream &out;
+    size_t words;
+    uint64_t checksum;
+    uint64_t word;
+    size_t pending;
+};
+
+int saveModel(const countTable &table, unsigned int order, const char *alphabet, const string &filename) {
+
+    string tmp_filename = filename + ".tmp";
+    ofstream out(tmp_filename, ios::out | ios::binary | ios::trunc);
+
+    if (out.fail()) {
+        cerr << "Fail opening file '" << tmp_filename << "' for writing" << endl;
+        return 1;
+    }
+
+    modelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+    header.version = MODEL_VERSION;
+    header.order = order;
+    header.alphabet_length = table.rowWidth();
+    header.count_width = COUNT_WIDTH;
+    header.rows = table.size();
+    strncpy(header.alphabet, alphabet, sizeof(header.alphabet) - 1);
+
+    // the checksum is only known at the end, header is written again then
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    vector<uint64_t> keys;
+    vector<unsigned int> totals;
+    vector<unsigned int> counts(table.rowWidth());
+    keys.reserve(table.size());
+    totals.reserve(table.size());
+
+    // rows may be copies only valid while visited, keys and totals go first so rows are fetched again afterwards
+    table.forEach([&](uint64_t context, const unsigned int *row) {
+        keys.push_back(context);
+        totals.push_back(accumulate(row, row + table.rowWidth(), 0u));
+        header.total_count += totals.back();
+    });
+
+    payloadWriter payload(out);
+    payload.write(keys.data(), keys.size() * sizeof(uint64_t));
+    payload.write(totals.data(), totals.size() * COUNT_WIDTH);
+
+    for (auto context : keys) {
+        table.row(context, counts.data());
+        payload.write(counts.data(), table.rowWidth() * COUNT_WIDTH);
+    }
+
+    header.checksum = payload.finish();
+
+    out.seekp(0);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.close();
+
+    if (out.fail() || rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        cerr << "Fail writing model to '" << filename << "'" << endl;
+        remove(tmp_filename.c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+mappedCountTable::mappedCountTable(void *map, size_t length) : countTable(0), p_map(map), map_length(length) {
+
+    p_header = static_cast<const modelHeader *>(map);
+    p_keys = reinterpret_cast<const uint64_t *>(p_header + 1);
+    p_totals = reinterpret_cast<const unsigned int *>(p_keys + p_header->rows);
+    p_counts = p_totals + p_header->rows;
+    width = p_header->alphabet_length;
+    total_count = p_header->total_count;
+}
+
+mappedCountTable::~mappedCountTable() {
+    munmap(p_map, map_length);
+}
+
+unique_ptr<mappedCountTable> mappedCountTable::open(const string &filename, const char *alphabet,
+                                                    unsigned int alphabet_length, bool verify) {
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        cerr << "Fail opening file '" << filename << "' for reading" << endl;
+        return nullptr;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(modelHeader))
+        map = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        cerr << "File '" << filename << "' is not a model" << endl;
+        return nullptr;
+    }
+
+    size_t length = (size_t) st.st_size;
+    unique_ptr<mappedCountTable> table(new mappedCountTable(map, length));
+    const modelHeader &header = *table->p_header;
+
+    if (memcmp(header.magic, MODEL_MAGIC, sizeof(header.magic)) != 0) {
+        cerr << "File '" << filename << "' is not a model (text archives must be converted with --convert)" << endl;
+        return nullptr;
+    }
+
+    if (header.version != MODEL_VERSION || header.count_width != COUNT_WIDTH) {
+        cerr << "Model '" << filename << "' has an unsupported version" << endl;
+        return nullptr;
+    }
+
+    if (strncmp(header.alphabet, alphabet, sizeof(header.alphabet)) != 0 || header.alphabet_length != alphabet_length) {
+        cerr << "Model '" << filename << "' was trained with the alphabet '"
+             << string(header.alphabet, strnlen(header.alphabet, sizeof(header.alphabet))) << "'" << endl;
+        return nullptr;
+    }
+
+    size_t payload_length = modelFileSize((size_t) header.rows, header.alphabet_length) - sizeof(modelHeader);
+
+    if (length != sizeof(modelHeader) + payload_length) {
+        cerr << "Model '" << filename << "' is truncated" << endl;
+        return nullptr;
+    }
+
+    // the checksum reads the whole file, without it only the pages of the rows used are
+    if (verify && modelChecksum(table->p_keys, payload_length / sizeof(uint64_t), 0) != header.checksum) {
+        cerr << "Model '" << filename << "' is corrupted (checksum mismatch)" << endl;
+        return nullptr;
+    }
+
+    return table;
+}
+
+void mappedCountTable::increment(uint64_t, unsigned int) {
+    throw logic_error("mapped models are read only");
+}
+
+void mappedCountTable::add(uint64_t, const unsigned int *) {
+    throw logic_error("mapped models are read only");
+}
+
+bool mappedCountTable::row(uint64_t context, unsigned int *counts) const {
+
+    const uint64_t *end = p_keys + p_header->rows;
+    const uint64_t *it = lower_bound(p_keys, end, context);
+
+    if (it == end || *it != context)
+        return false;
+
+    copy_n(p_counts + (size_t) (it - p_keys) * width, width, counts);
+    return true;
+}
+
+unsigned int mappedCountTable::rowTotal(uint64_t context) const {
+
+    const uint64_t *end = p_keys + p_header->rows;
+    const uint64_t *it = lower_bound(p_keys, end, context);
+
+    if (it == end || *it != context)
+        return 0;
+
+    return p_totals[it - p_keys];
+}
+
+unsigned int mappedCountTable::lookup(uint64_t context, unsigned int symbol, unsigned int &row_total) const {
+
+    const uint64_t *end = p_keys + p_header->rows;
+    const uint64_t *it = lower_bound(p_keys, end, context);
+
+    if (it == end || *it != context) {
+        row_total = 0;
+        return 0;
+    }
+
+    size_t i = (size_t) (it - p_keys);
+    row_total = p_totals[i];
+    return p_counts[i * width + symbol];
+}
+
+void mappedCountTable::forEach(const visitor &visit) const {
+
+    for (size_t i = 0; i < p_header->rows; i++)
+        visit(p_keys[i], p_counts + i * width);
+}
+
+void mappedCountTable::forEachInPart(unsigned int part, unsigned int parts, const totalVisitor &visit) const {
+
+    size_t first = p_header->rows * part / parts, last = p_header->rows * (part + 1) / parts;
+
+    for (size_t i = first; i < last; i++)
+        visit(p_keys[i], p_counts + i * width, p_totals[i]);
+}
+
+/**
+ * Position of a k-way merge in the rows of one model
+ */
+struct mergeCursor {
+    const uint64_t *key;
+    const uint64_t *end;
+    const unsigned int *counts;     // counters of the row of key
+};
+
+/**
+ * Visits the contexts of several models in ascending order, once each
+ * @param cursors position in each model, moved to the end of its range
+ * @param width alphabet length
+ * @param visit called with each context and the indexes of the cursors at it, before they move on
+ */
+template<class visitor>
+static void mergeKeys(vector<mergeCursor> &cursors, unsigned int width, visitor visit) {
+
+    typedef pair<uint64_t, unsigned int> entry;
+    priority_queue<entry, vector<entry>, greater<entry>> heap;
+    vector<unsigned int> sources;
+
+    for (unsigned int i = 0; i < cursors.size(); i++)
+        if (cursors[i].key != cursors[i].end)
+            heap.emplace(*cursors[i].key, i);
+
+    while (!heap.empty()) {
+        uint64_t key = heap.top().first;
+
+        sources.clear();
+        while (!heap.empty() && heap.top().first == key) {
+            sources.push_back(heap.top().second);
+            heap.pop();
+        }
+
+        visit(key, sources);
+
+        for (auto i : sources) {
+            cursors[i].counts += width;
+            if (++cursors[i].key != cursors[i].end)
+                heap.emplace(*cursors[i].key, i);
+        }
+    }
+}
+
+bool writeAt(int fd, const void *data, size_t length, size_t offset) {
+
+    const char *bytes = static_cast<const char *>(data);
+
+    while (length > 0) {
+        ssize_t n = pwrite(fd, bytes, length, (off_t) offset);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        bytes += n;
+        length -= (size_t) n;
+        offset += (size_t) n;
+    }
+
+    return true;
+}
+
+/**
+ * Runs a worker in several threads
+ * @param num_threads number of threads, the calling one included
+ * @param work called with the number of the thread
+ */
+static void runThreads(unsigned int num_threads, const function<void(unsigned int)> &work) {
+
+    vector<thread> threads;
+    for (unsigned int t = 1; t < num_threads; t++)
+        threads.emplace_back(work, t);
+
+    work(0);
+
+    for (auto &t : threads)
+        t.join();
+}
+
+int mergeModels(const vector<string> &filenames, const char *alphabet, unsigned int alphabet_length,
+                const string &filename, unsigned int num_threads) {
+
+    vector<unique_ptr<mappedCountTable>> models;
+    size_t largest = 0;
+
+    for (auto &name : filenames) {
+        models.push_back(mappedCountTable::open(name, alphabet, alphabet_length, true));
+
+        if (models.back() == nullptr)
+            return 1;
+
+        if (models.back()->order() != models.front()->order()) {
+            cerr << "Model '" << name << "' has order " << models.back()->order() << ", not "
+                 << models.front()->order() << endl;
+            return 1;
+        }
+
+        if (models.back()->size() > models[largest]->size())
+            largest = models.size() - 1;
+    }
+
+    if (models.empty()) {
+        cerr << "No models to merge" << endl;
+        return 1;
+    }
+
+    num_threads = max(num_threads, 1u);
+    const unsigned int width = alphabet_length;
+
+    // ranges of keys split at the quantiles of the largest model, the last one has no upper bound
+    unsigned int parts = num_threads * MERGE_PARTS_PER_THREAD;
+    vector<uint64_t> bounds(parts + 1, 0);
+    const mappedCountTable &reference = *models[largest];
+
+    for (unsigned int p = 1; p < parts; p++)
+        bounds[p] = reference.size() == 0 ? 0 : reference.keys()[reference.size() * p / parts];
+
+    auto partCursors = [&](unsigned int p) {
+        vector<mergeCursor> cursors;
+
+        for (auto &model : models) {
+            const uint64_t *keys = model->keys(), *end = keys + model->size();
+            const uint64_t *first = p == 0 ? keys : lower_bound(keys, end, bounds[p]);
+            const uint64_t *last = p + 1 == parts ? end : lower_bound(keys, end, bounds[p + 1]);
+
+            cursors.push_back({first, last, model->counts() + (size_t) (first - keys) * width});
+        }
+
+        return cursors;
+    };
+
+    // first pass: contexts of each range, which tells where its rows go
+    vector<size_t> first_row(parts + 1, 0);
+    atomic<unsigned int> next(0);
+
+    runThreads(num_threads, [&](unsigned int) {
+        for (unsigned int p; (p = next.fetch_add(1)) < parts;) {
+            vector<mergeCursor> cursors = partCursors(p);
+            size_t rows = 0;
+
+            mergeKeys(cursors, width, [&rows](uint64_t, const vector<unsigned int> &) { rows++; });
+            first_row[p + 1] = rows;
+        }
+    });
+
+    partial_sum(first_row.begin(), first_row.end(), first_row.begin());
+    const size_t rows = first_row[parts];
+
+    string tmp_filename = filename + ".tmp";
+    int fd = ::open(tmp_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0 || ftruncate(fd, (off_t) modelFileSize(rows, width)) != 0) {
+        cerr << "Fail opening file '" << tmp_filename << "' for writing" << endl;
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+
+    // second pass: sums and writes the rows of each range at their place
+    const size_t keys_offset = sizeof(modelHeader), totals_offset = keys_offset + rows * sizeof(uint64_t);
+    const size_t counts_offset = totals_offset + rows * COUNT_WIDTH;
+    atomic<bool> failed(false);
+    atomic<uint64_t> saturated(0), total_count(0);
+    next = 0;
+
+    runThreads(num_threads, [&](unsigned int) {
+        vector<uint64_t> keys;
+        vector<unsigned int> totals, counts;
+        vector<uint64_t> sums(width);
+        uint64_t total = 0;
+
+        for (unsigned int p; (p = next.fetch_add(1)) < parts && !failed;) {
+            vector<mergeCursor> cursors = partCursors(p);
+            size_t row = first_row[p];
+
+            auto flush = [&]() {
+                if (!writeAt(fd, keys.data(), keys.size() * sizeof(uint64_t), keys_offset + row * sizeof(uint64_t))
+                    || !writeAt(fd, totals.data(), totals.size() * COUNT_WIDTH, totals_offset + row * COUNT_WIDTH)
+                    || !writeAt(fd, counts.data(), counts.size() * COUNT_WIDTH, counts_offset + row * width * COUNT_WIDTH))
+                    failed = true;
+
+                row += keys.size();
+                keys.clear();
+                totals.clear();
+                counts.clear();
+            };
+
+            mergeKeys(cursors, width, [&](uint64_t key, const vector<unsigned int> &sources) {
+                fill(sums.begin(), sums.end(), 0);
+
+                for (auto i : sources)
+                    for (unsigned int s = 0; s < width; s++)
+                        sums[s] += cursors[i].counts[s];
+
+                // the total of a row is the sum of its saturated counters, saturated as well
+                uint64_t row_total = 0;
+
+                keys.push_back(key);
+                for (auto sum : sums) {
+                    if (sum > UINT32_MAX)
+                        saturated++;
+                    counts.push_back((unsigned int) min(sum, (uint64_t) UINT32_MAX));
+                    row_total += counts.back();
+                }
+                totals.push_back((unsigned int) min(row_total, (uint64_t) UINT32_MAX));
+                total += totals.back();
+
+                if (keys.size() == MERGE_BUFFER_ROWS)
+                    flush();
+            });
+
+            flush();
+        }
+
+        total_count += total;
+    });
+
+    // the checksum adds up words independently of each other, chunks of the payload are summed concurrently
+    const size_t words = (modelFileSize(rows, width) - sizeof(modelHeader)) / sizeof(uint64_t);
+    const size_t chunks = (words + CHECKSUM_CHUNK_WORDS - 1) / CHECKSUM_CHUNK_WORDS;
+    atomic<uint64_t> checksum(0);
+    atomic<size_t> next_chunk(0);
+
+    if (!failed) {
+        runThreads(num_threads, [&](unsigned int) {
+            vector<uint64_t> buffer(CHECKSUM_CHUNK_WORDS);
+            uint64_t sum = 0;
+
+            for (size_t c; (c = next_chunk.fetch_add(1)) < chunks && !failed;) {
+                size_t first = c * CHECKSUM_CHUNK_WORDS, count = min((size_t) CHECKSUM_CHUNK_WORDS, words - first);
+                size_t length = count * sizeof(uint64_t);
+
+                if (pread(fd, buffer.data(), length, (off_t) (keys_offset + first * sizeof(uint64_t)))
+                    != (ssize_t) length)
+                    failed = true;
+                else
+                    sum += modelChecksum(buffer.data(), count, first);
+            }
+
+            checksum += sum;
+        });
+    }
+
+    modelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+    header.version = MODEL_VERSION;
+    header.order = models.front()->order();
+    header.alphabet_length = width;
+    header.count_width = COUNT_WIDTH;
+    header.rows = rows;
+    header.checksum = checksum;
+    header.total_count = total_count;
+    strncpy(header.alphabet, alphabet, sizeof(header.alphabet) - 1);
+
+    // inputs are unmapped before the output may replace one of them
+    models.clear();
+
+    if (failed || !writeAt(fd, &header, sizeof(header), 0) || close(fd) != 0
+        || rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        cerr << "Fail writing model to '" << filename << "'" << endl;
+        remove(tmp_filename.c_str());
+        return 1;
+    }
+
+    if (saturated > 0)
+        cerr << saturated << " counters of the merged model went past 32 bits and were saturated" << endl;
+
+    return 0;
+}
+
+int convertArchive(const string &archive_filename, unsigned int order, const char *alphabet,
+                   unsigned int alphabet_length, const string &filename) {
+
+    ifstream in(archive_filename);
+
+    if (in.fail()) {
+        cerr << "Fail opening file '" << archive_filename << "' for reading" << endl;
+        return 1;
+    }
+
+    unsigned int width = alphabet_length;
+    map<uint64_t, vector<unsigned int>> stat_map;
+
+    try {
+        boost::archive::text_iarchive ia(in);
+        ia >> stat_map;
+    } catch (const exception &e) {
+        cerr << "File '" << archive_filename << "' is not a text archive: " << e.what() << endl;
+        return 1;
+    }
+
+    unique_ptr<countTable> table = countTable::create(order, width);
+
+    for (auto &it : stat_map) {
+
+        if (it.second.size() != width) {
+            cerr << "Archive '" << archive_filename << "' was trained with another alphabet" << endl;
+            return 1;
+        }
+
+        // archives index the oldest symbol as the least significant digit, models the other way around
+        uint64_t legacy = it.first, context = 0;
+        for (unsigned int i = 0; i < order; i++) {
+            context = context * width + legacy % width;
+            legacy /= width;
+        }
+
+        table->add(context, it.second.data());
+    }
+
+    return saveModel(*table, order, alphabet, filename);
+}
@@ -0,0 +1,201 @@
+#ifndef CAV_GMZ_MODELFILE_H
+#define CAV_GMZ_MODELFILE_H
+
+
+#include <string>
+#include "counttable.h"
+
+#define MODEL_MAGIC "FCMMODEL"
+#define MODEL_VERSION 3
+
+/**
+ * Header of a binary model file. The file layout, in native byte order, is:
+ *  - this header
+ *  - rows context indexes (uint64_t), in ascending order
+ *  - rows row totals of count_width bytes, in the order of the contexts
+ *  - rows * alphabet_length counters of count_width bytes, row after row, zero padded to 8 bytes
+ * The checksum covers everything after the header, see modelChecksum()
+ */
+struct modelHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;
+    uint32_t alphabet_length;
+    uint32_t count_width;
+    uint64_t rows;
+    uint64_t checksum;
+    uint64_t total_count;   // sum of every counter
+    char alphabet[256];     // name of the alphabet policy
+};
+
+/**
+ * Read only count table backed by a memory mapped model file. Rows are used in place, there is no parse step
+ */
+class mappedCountTable : public countTable {
+public:
+
+    ~mappedCountTable() override;
+
+    /**
+     * Maps a model file and checks its header and size. Only the pages used are read, unless the checksum
+     * is verified, which reads the whole file
+     * @param filename path of the model
+     * @param alphabet name of the alphabet the model must have been trained with
+     * @param alphabet_length number of symbols of the alphabet
+     * @param verify whether to check the checksum, by default as set by verifyChecksums()
+     * @return the table or nullptr if the file is not a valid model (the reason is printed to cerr)
+     */
+    static unique_ptr<mappedCountTable> open(const string &filename, const char *alphabet,
+                                             unsigned int alphabet_length, bool verify = verify_checksums);
+
+    /**
+     * Makes open() check the checksum of every model it maps by default
+     */
+    static void verifyChecksums() { verify_checksums = true; }
+
+    /**
+     * Not supported, mapped models are read only
+     */
+    void increment(uint64_t context, unsigned int symbol) override;
+
+    /**
+     * Not supported, mapped models are read only
+     */
+    void add(uint64_t context, const unsigned int *counts) override;
+
+    bool row(uint64_t context, unsigned int *counts) const override;
+
+    unsigned int rowTotal(uint64_t context) const override;
+
+    unsigned int lookup(uint64_t context, unsigned int symbol, unsigned int &row_total) const override;
+
+    void forEach(const visitor &visit) const override;
+
+    void forEachInPart(unsigned int part, unsigned int parts, const totalVisitor &visit) const override;
+
+    size_t size() const override { return (size_t) p_header->rows; }
+
+    /**
+     * @return order of the mapped model
+     */
+    unsigned int order() const { return p_header->order; }
+
+    /**
+     * @return sorted context indexes, size() of them
+     */
+    const uint64_t *keys() const { return p_keys; }
+
+    /**
+     * @return counters, row after row in the order of keys()
+     */
+    const unsigned int *counts() const { return p_counts; }
+
+private:
+
+    mappedCountTable(void *map, size_t length);
+
+    /**
+     * Whole mapped file
+     */
+    void *p_map;
+
+    /**
+     * Length of the mapping
+     */
+    size_t map_length;
+
+    /**
+     * File header, at the start of the mapping
+     */
+    const modelHeader *p_header;
+
+    /**
+     * Sorted context indexes
+     */
+    const uint64_t *p_keys;
+
+    /**
+     * Total of each row, in the order of p_keys
+     */
+    const unsigned int *p_totals;
+
+    /**
+     * Counters, row after row
+     */
+    const unsigned int *p_counts;
+
+    /**
+     * Whether open() checks the checksum when not told otherwise
+     */
+    static bool verify_checksums;
+};
+
+/**
+ * Checksum of a model payload: sum of every 64 bit word mixed with its position, so ranges of the payload
+ * can be summed independently and added together
+ * @param words payload words
+ * @param count number of words
+ * @param first position of the first word in the payload
+ * @return checksum of the words
+ */
+uint64_t modelChecksum(const uint64_t *words, size_t count, size_t first);
+
+/**
+ * Size of the model file of a table
+ * @param rows number of contexts
+ * @param width alphabet length
+ * @return bytes of the file written by saveModel()
+ */
+size_t modelFileSize(size_t rows, unsigned int width);
+
+/**
+ * Writes a whole buffer at an offset of a file, retrying short and interrupted writes
+ * @param fd file descriptor open for writing
+ * @param data bytes to write
+ * @param length number of bytes
+ * @param offset position in the file
+ * @return false if the write failed
+ */
+bool writeAt(int fd, const void *data, size_t length, size_t offset);
+
+/**
+ * Writes a count table as a binary model file. The file is written aside and renamed over the target,
+ * so it is safe to replace a model that is currently mapped
+ * @param table counters to save
+ * @param order order of the model
+ * @param alphabet name of the alphabet
+ * @param filename path of the model
+ * @return 0 if save successful 1 if unsuccessful
+ */
+int saveModel(const countTable &table, unsigned int order, const char *alphabet, const string &filename);
+
+/**
+ * Sums saved models of the same order and alphabet into a new model, with a k-way merge of their sorted
+ * contexts. The checksums of the inputs are always verified: they are read whole anyway, and the sum of a
+ * corrupted one would get a valid checksum. The key space is split in ranges merged concurrently: a first pass counts the contexts of each
+ * range, which places its rows in the output, and a second one writes the summed rows there through small
+ * buffers, so memory doesn't grow with the models. Counters past 32 bits are saturated
+ * @param filenames paths of the models to sum
+ * @param alphabet name of the alphabet
+ * @param alphabet_length number of symbols of the alphabet
+ * @param filename path of the model to write, it may be one of the inputs
+ * @param num_threads number of threads merging ranges
+ * @return 0 if merge successful 1 if unsuccessful
+ */
+int mergeModels(const vector<string> &filenames, const char *alphabet, unsigned int alphabet_length,
+                const string &filename, unsigned int num_threads);
+
+/**
+ * Converts a model saved as a boost text archive by previous versions to the binary format.
+ * Those archives index contexts with the oldest symbol as the least significant digit
+ * @param archive_filename path of the text archive
+ * @param order order the archive was trained with
+ * @param alphabet name of the alphabet
+ * @param alphabet_length number of symbols of the alphabet
+ * @param filename path of the binary model to write
+ * @return 0 if conversion successful 1 if unsuccessful
+ */
+int convertArchive(const string &archive_filename, unsigned int order, const char *alphabet,
+                   unsigned int alphabet_length, const string &filename);
+
+#endif //CAV_GMZ_MODELFILE_H
@@ -0,0 +1,189 @@
+#include "alphabet.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NORMALIZE_X86
+#include <immintrin.h>
+#endif
+
+size_t normalizeWithTable(const symbolTable &table, const char *data, size_t length, uint8_t *codes) {
+
+    size_t n = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        uint8_t code = table.code[(uint8_t) data[i]];
+
+        // always store, only advance over alphabet symbols
+        codes[n] = code;
+        n += (code != NOT_IN_ALPHABET);
+    }
+
+    return n;
+}
+
+/**
+ * Scalar letters and space kernel, one table lookup per byte
+ */
+static size_t normalizeScalar(const char *data, size_t length, uint8_t *codes) {
+    return normalizeWithTable(englishAlphabet::encode, data, length, codes);
+}
+
+#ifdef NORMALIZE_X86
+
+/**
+ * Shuffle masks packing the bytes flagged in an 8 bit mask to the start of a 64 bit word.
+ * Unused positions select nothing (0x80)
+ */
+struct packTable {
+
+    uint64_t shuffle[256];
+
+    constexpr packTable() : shuffle() {
+        for (int mask = 0; mask < 256; mask++) {
+            uint64_t value = 0x8080808080808080ull;
+            int out = 0;
+
+            for (int bit = 0; bit < 8; bit++) {
+                if (mask & (1 << bit)) {
+                    value &= ~(0xffull << (out * 8));
+                    value |= (uint64_t) bit << (out * 8);
+                    out++;
+                }
+            }
+
+            shuffle[mask] = value;
+        }
+    }
+};
+
+static constexpr packTable PACK_TABLE;
+
+/**
+ * SSE2 kernel: blocks of 16 alphabet bytes are converted at once, blocks with bytes to drop fall back
+ * to the lookup table
+ */
+static size_t normalizeSSE2(const char *data, size_t length, uint8_t *codes) {
+
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i before_a = _mm_set1_epi8('a' - 1);
+    const __m128i after_z = _mm_set1_epi8('z' + 1);
+    const __m128i code_a = _mm_set1_epi8('a');
+    const __m128i code_space = _mm_set1_epi8(englishAlphabet::length - 1);
+    const __m128i space_byte = _mm_set1_epi8(' ');
+
+    size_t i = 0, n = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        __m128i lower = _mm_or_si128(c, case_bit);
+
+        // letters are 'a'..'z' once lower cased, bytes above 0x7f are negative and never match
+        __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, before_a), _mm_cmplt_epi8(lower, after_z));
+        __m128i space = _mm_cmpeq_epi8(c, space_byte);
+
+        if (_mm_movemask_epi8(_mm_or_si128(letter, space)) != 0xffff) {
+            n += normalizeScalar(data + i, 16, codes + n);
+            continue;
+        }
+
+        __m128i code = _mm_or_si128(_mm_and_si128(letter, _mm_sub_epi8(lower, code_a)),
+                                    _mm_andnot_si128(letter, code_space));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(codes + n), code);
+        n += 16;
+    }
+
+    return n + normalizeScalar(data + i, length - i, codes + n);
+}
+
+/**
+ * Packs the codes flagged in a 16 bit mask to the output
+ * @return number of codes written
+ */
+__attribute__((target("avx2")))
+static inline size_t packCodes(__m128i code, unsigned int mask, uint8_t *codes) {
+
+    unsigned int low = mask & 0xff, high = mask >> 8;
+
+    // second half selects bytes 8 to 15, unused positions keep the high bit set
+    __m128i shuffle = _mm_set_epi64x((long long) (PACK_TABLE.shuffle[high] + 0x0808080808080808ull),
+                                     (long long) PACK_TABLE.shuffle[low]);
+    __m128i packed = _mm_shuffle_epi8(code, shuffle);
+
+    size_t n = (size_t) __builtin_popcount(low);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(codes), packed);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(codes + n), _mm_srli_si128(packed, 8));
+
+    return n + __builtin_popcount(high);
+}
+
+/**
+ * AVX2 kernel: converts 32 bytes at once and packs the codes of the alphabet bytes with shuffles
+ */
+__attribute__((target("avx2")))
+static size_t normalizeAVX2(const char *data, size_t length, uint8_t *codes) {
+
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    const __m256i before_a = _mm256_set1_epi8('a' - 1);
+    const __m256i after_z = _mm256_set1_epi8('z' + 1);
+    const __m256i code_a = _mm256_set1_epi8('a');
+    const __m256i code_space = _mm256_set1_epi8(englishAlphabet::length - 1);
+    const __m256i space_byte = _mm256_set1_epi8(' ');
+
+    size_t i = 0, n = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        __m256i lower = _mm256_or_si256(c, case_bit);
+
+        __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(lower, before_a), _mm256_cmpgt_epi8(after_z, lower));
+        __m256i space = _mm256_cmpeq_epi8(c, space_byte);
+        __m256i code = _mm256_blendv_epi8(code_space, _mm256_sub_epi8(lower, code_a), letter);
+
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(letter, space));
+
+        if (mask == 0xffffffffu) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(codes + n), code);
+            n += 32;
+            continue;
+        }
+
+        n += packCodes(_mm256_castsi256_si128(code), mask & 0xffff, codes + n);
+        n += packCodes(_mm256_extracti128_si256(code, 1), mask >> 16, codes + n);
+    }
+
+    return n + normalizeScalar(data + i, length - i, codes + n);
+}
+
+#endif
+
+vector<normalizeKernelInfo> normalizeKernels() {
+
+    vector<normalizeKernelInfo> kernels = {{"scalar", normalizeScalar}};
+
+#ifdef NORMALIZE_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2"))
+        kernels.push_back({"sse2", normalizeSSE2});
+
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back({"avx2", normalizeAVX2});
+#endif
+
+    return kernels;
+}
+
+/**
+ * Fastest kernel supported by the running CPU, selected on first use
+ */
+static const normalizeKernelInfo &bestKernel() {
+    static const normalizeKernelInfo best = normalizeKernels().back();
+    return best;
+}
+
+size_t normalizeLetters(const char *data, size_t length, uint8_t *codes) {
+    return bestKernel().kernel(data, length, codes);
+}
+
+const char *normalizeKernelName() {
+    return bestKernel().name;
+}
@@ -0,0 +1,98 @@
+#ifndef CAV_GMZ_NORMALIZE_H
+#define CAV_GMZ_NORMALIZE_H
+
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Code given to the bytes that don't belong to the alphabet
+ */
+#define NOT_IN_ALPHABET 0xff
+
+/**
+ * Extra room the normalization kernels may write past the last code
+ */
+#define NORMALIZE_SLACK 32
+
+/**
+ * Lookup table converting a byte to its alphabet code, NOT_IN_ALPHABET for bytes outside the alphabet
+ */
+struct symbolTable {
+
+    uint8_t code[256];
+
+    /**
+     * @param symbols symbols of the alphabet, the code of each one is its position
+     * @param length number of symbols
+     * @param upper_case alternative byte of each symbol (e.g. its upper case), 0 for none. nullptr if none
+     */
+    constexpr symbolTable(const char *symbols, unsigned int length, const char *upper_case) : code() {
+
+        for (int c = 0; c < 256; c++)
+            code[c] = NOT_IN_ALPHABET;
+
+        for (unsigned int i = 0; i < length; i++) {
+            code[(uint8_t) symbols[i]] = (uint8_t) i;
+
+            if (upper_case != nullptr && upper_case[i] != 0)
+                code[(uint8_t) upper_case[i]] = (uint8_t) i;
+        }
+    }
+
+    /**
+     * Table of the alphabet made of every byte, where each byte is its own code
+     */
+    constexpr symbolTable() : code() {
+        for (int c = 0; c < 256; c++)
+            code[c] = (uint8_t) c;
+    }
+};
+
+/**
+ * Scalar normalization kernel for any alphabet, one table lookup per byte
+ * @param table lookup table of the alphabet
+ * @param data bytes to convert
+ * @param length number of bytes
+ * @param codes output, room for length + NORMALIZE_SLACK codes
+ * @return number of codes written
+ */
+size_t normalizeWithTable(const symbolTable &table, const char *data, size_t length, uint8_t *codes);
+
+/**
+ * Converts a block of bytes to the codes of the letters and space alphabet (letters of either case to 0-25,
+ * space to 26), dropping the bytes that don't belong to the alphabet.
+ * Uses the fastest kernel supported by the running CPU
+ * @param data bytes to convert
+ * @param length number of bytes
+ * @param codes output, room for length + NORMALIZE_SLACK codes
+ * @return number of codes written
+ */
+size_t normalizeLetters(const char *data, size_t length, uint8_t *codes);
+
+/**
+ * Kernel converting bytes to letters and space codes, same contract as normalizeLetters()
+ */
+typedef size_t (*normalizeKernel)(const char *data, size_t length, uint8_t *codes);
+
+struct normalizeKernelInfo {
+    const char *name;
+    normalizeKernel kernel;
+};
+
+/**
+ * Lists the letters and space kernels supported by the running CPU, from the scalar one to the fastest one,
+ * which is the one used by normalizeLetters()
+ * @return supported kernels
+ */
+vector<normalizeKernelInfo> normalizeKernels();
+
+/**
+ * @return name of the kernel used by normalizeLetters()
+ */
+const char *normalizeKernelName();
+
+#endif //CAV_GMZ_NORMALIZE_H
@@ -0,0 +1,81 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include "alphabet.h"
+#include "ingest.h"
+
+#define DEFAULT_LENGTH (64u << 20)
+
+/**
+ * Microbenchmark of the letters and space normalization kernels: converts the same input with every kernel
+ * supported by the CPU, checks that they agree with the scalar one and prints their throughput.
+ *
+ * Usage: fcm_normalize_bench [file]
+ * Without a file, a synthetic text with letters, spaces and punctuation is used.
+ */
+int main(int argc, char **argv) {
+
+    vector<char> text;
+
+    if (argc > 1) {
+        inputSource source;
+
+        if (!source.open(argv[1])) {
+            cerr << "Fail opening file '" << argv[1] << "' for reading" << endl;
+            return 1;
+        }
+
+        source.forEachBlock([&text](const char *data, size_t length) {
+            text.insert(text.end(), data, data + length);
+        });
+    } else {
+        // mostly lower case words, some capitals, punctuation and line breaks
+        const char symbols[] = "etaoinshrdlucmfwypvbgkjqxz      ETAOIN,.;'\n";
+        mt19937 gen(42);
+        uniform_int_distribution<size_t> pick(0, sizeof(symbols) - 2);
+
+        text.resize(DEFAULT_LENGTH);
+        for (auto &c : text)
+            c = symbols[pick(gen)];
+    }
+
+    vector<uint8_t> expected(text.size() + NORMALIZE_SLACK), codes(text.size() + NORMALIZE_SLACK);
+    size_t expected_length = 0;
+    double scalar_time = 0;
+
+    cout << "input: " << text.size() << " bytes" << endl;
+    cout << setw(8) << "kernel" << setw(12) << "seconds" << setw(12) << "MB/s" << setw(10) << "speedup" << endl;
+
+    for (auto &info : normalizeKernels()) {
+
+        // best of a few runs
+        double best = 0;
+        size_t length = 0;
+
+        for (int run = 0; run < 5; run++) {
+            auto start = chrono::steady_clock::now();
+            length = info.kernel(text.data(), text.size(), codes.data());
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            if (run == 0 || seconds < best)
+                best = seconds;
+        }
+
+        if (scalar_time == 0) {
+            scalar_time = best;
+            expected_length = length;
+            memcpy(expected.data(), codes.data(), length);
+        } else if (length != expected_length || memcmp(expected.data(), codes.data(), length) != 0) {
+            cerr << "Kernel '" << info.name << "' output differs from the scalar kernel" << endl;
+            return 1;
+        }
+
+        cout << setw(8) << info.name << setw(12) << fixed << setprecision(4) << best
+             << setw(12) << setprecision(1) << text.size() / best / (1 << 20)
+             << setw(10) << setprecision(2) << scalar_time / best << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,312 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include "ppm.h"
+#include "profile.h"
+#include "rng.h"
+
+#define PPM_BLOCK_LENGTH (1u << 16)     // bytes normalized at once before counting
+#define PPM_BUFFER_LENGTH (1u << 16)    // generated text is written in blocks of this size
+#define NO_SUCCESSOR UINT32_MAX
+
+template<class alphabet>
+ppm<alphabet>::ppm(unsigned int max_depth) : depth(max_depth), recent(max_depth, 0), filled(0), code_length(0),
+                                             coded(0) {
+
+    // the empty context
+    nodes.push_back(contextNode{0, 0, NO_SUCCESSOR, 0, 0, 0});
+}
+
+template<class alphabet>
+void ppm<alphabet>::train(inputSource *input) {
+
+    phaseTimer timer(phase::count);
+    vector<uint8_t> codes(PPM_BLOCK_LENGTH + NORMALIZE_SLACK);
+    size_t start_contexts = nodes.size();
+
+    bool ok = input->forEachBlock([&](const char *data, size_t length) {
+        for (size_t offset = 0; offset < length; offset += PPM_BLOCK_LENGTH) {
+            size_t n = alphabet::normalize(data + offset, min(length - offset, (size_t) PPM_BLOCK_LENGTH),
+                                           codes.data());
+
+            for (size_t i = 0; i < n; i++)
+                update(codes[i]);
+
+            timer.symbols += n;
+        }
+    });
+
+    if (!ok)
+        cerr << "Error reading input data" << endl;
+
+    timer.contexts = nodes.size() - start_contexts;
+}
+
+template<class alphabet>
+double ppm<alphabet>::getEntropy() const {
+    return coded == 0 ? 0 : code_length / coded;
+}
+
+template<class alphabet>
+unsigned int ppm<alphabet>::findPath(const uint8_t *older, unsigned int length, uint32_t *path) const {
+
+    unsigned int found = 1;
+    path[0] = 0;
+
+    // one symbol older at each step, as long as the trie has the context
+    for (unsigned int j = 0; j < length; j++) {
+        uint32_t node = nodes[path[j]].child;
+
+        while (node != 0 && nodes[node].symbol != older[j])
+            node = nodes[node].sibling;
+
+        if (node == 0)
+            break;
+
+        path[found++] = node;
+    }
+
+    return found;
+}
+
+template<class alphabet>
+uint32_t ppm<alphabet>::child(uint32_t parent, uint8_t symbol) {
+
+    for (uint32_t node = nodes[parent].child; node != 0; node = nodes[node].sibling)
+        if (nodes[node].symbol == symbol)
+            return node;
+
+    uint32_t node = (uint32_t) nodes.size();
+    nodes.push_back(contextNode{0, nodes[parent].child, NO_SUCCESSOR, 0, 0, symbol});
+    nodes[parent].child = node;
+
+    return node;
+}
+
+template<class alphabet>
+void ppm<alphabet>::count(uint32_t node, uint8_t symbol) {
+
+    contextNode &context = nodes[node];
+    context.total++;
+
+    for (uint32_t s = context.successors; s != NO_SUCCESSOR; s = successors[s].next) {
+        if (successors[s].symbol == symbol) {
+            successors[s].count++;
+            return;
+        }
+    }
+
+    // first time the symbol follows the context
+    successors.push_back(successor{context.successors, 1, symbol});
+    context.successors = (uint32_t) (successors.size() - 1);
+    context.distinct++;
+}
+
+template<class alphabet>
+double ppm<alphabet>::pathProbability(const uint32_t *path, unsigned int found, unsigned int symbol) const {
+
+    bool excluded[alphabet::length] = {};
+    unsigned int n_excluded = 0;
+    double p = 1;
+
+    // from the longest context, escape (method C) to shorter ones excluding the symbols already predicted
+    for (unsigned int j = found; j-- > 0;) {
+        const contextNode &context = nodes[path[j]];
+        uint64_t total = 0, hit = 0;
+        unsigned int distinct = 0;
+
+        for (uint32_t s = context.successors; s != NO_SUCCESSOR; s = successors[s].next) {
+            if (excluded[successors[s].symbol])
+                continue;
+
+            total += successors[s].count;
+            distinct++;
+
+            if (successors[s].symbol == symbol)
+                hit = successors[s].count;
+        }
+
+        if (distinct == 0)
+            continue;
+
+        if (hit > 0)
+            return p * hit / (total + distinct);
+
+        p *= (double) distinct / (total + distinct);
+
+        for (uint32_t s = context.successors; s != NO_SUCCESSOR; s = successors[s].next) {
+            if (!excluded[successors[s].symbol]) {
+                excluded[successors[s].symbol] = true;
+                n_excluded++;
+            }
+        }
+    }
+
+    // no context saw the symbol, uniform over the symbols left
+    return p / (alphabet::length - n_excluded);
+}
+
+template<class alphabet>
+double ppm<alphabet>::probability(const uint8_t *history, size_t length, unsigned int symbol) const {
+
+    unsigned int used = (unsigned int) min(length, (size_t) depth);
+    uint8_t older[PPM_MAX_DEPTH];
+    uint32_t path[PPM_MAX_DEPTH + 1];
+
+    for (unsigned int j = 0; j < used; j++)
+        older[j] = history[length - 1 - j];
+
+    return pathProbability(path, findPath(older, used, path), symbol);
+}
+
+template<class alphabet>
+void ppm<alphabet>::update(uint8_t symbol) {
+
+    uint32_t path[PPM_MAX_DEPTH + 1];
+    unsigned int found = findPath(recent.data(), filled, path);
+
+    // code the symbol with what was learned before it
+    code_length -= log2(pathProbability(path, found, symbol));
+    coded++;
+
+    // count it in every context of the history, creating the ones the trie doesn't have yet
+    for (unsigned int j = 0; j <= filled; j++) {
+        if (j >= found)
+            path[j] = child(path[j - 1], recent[j - 1]);
+
+        count(path[j], symbol);
+    }
+
+    push(symbol);
+}
+
+template<class alphabet>
+void ppm<alphabet>::push(uint8_t symbol) {
+
+    if (depth == 0)
+        return;
+
+    memmove(recent.data() + 1, recent.data(), depth - 1);
+    recent[0] = symbol;
+
+    if (filled < depth)
+        filled++;
+}
+
+template<class alphabet>
+void ppm<alphabet>::genText(unsigned int lines, unsigned int chars, uint64_t seed, ostream &out) {
+
+    phaseTimer timer(phase::generation);
+    streamRng gen(seed, 0);                             // each symbol depends on the ones before, a single stream
+    char buffer[PPM_BUFFER_LENGTH];                     // output is written in blocks of this size
+    size_t used = 0;
+    uint32_t path[PPM_MAX_DEPTH + 1];
+
+    // text follows on the history of the training input
+    for (unsigned int j = lines; j > 0; j--) {
+        for (unsigned int i = chars; i > 0; i--) {
+
+            unsigned int found = findPath(recent.data(), filled, path);
+            bool excluded[alphabet::length] = {};
+            unsigned int n_excluded = 0;
+            int symbol = -1;
+
+            // draw a symbol of the longest context or escape to a shorter one, as pathProbability()
+            for (unsigned int d = found; d-- > 0 && symbol < 0;) {
+                const contextNode &context = nodes[path[d]];
+                uint64_t total = 0;
+                unsigned int distinct = 0;
+
+                for (uint32_t s = context.successors; s != NO_SUCCESSOR; s = successors[s].next) {
+                    if (!excluded[successors[s].symbol]) {
+                        total += successors[s].count;
+                        distinct++;
+                    }
+                }
+
+                if (distinct == 0)
+                    continue;
+
+                double target = (gen() >> 11) * (1.0 / (1ull << 53)) * (total + distinct);
+
+                for (uint32_t s = context.successors; s != NO_SUCCESSOR && symbol < 0; s = successors[s].next) {
+                    if (excluded[successors[s].symbol])
+                        continue;
+
+                    target -= successors[s].count;
+                    if (target < 0)
+                        symbol = successors[s].symbol;
+                }
+
+                for (uint32_t s = context.successors; s != NO_SUCCESSOR; s = successors[s].next) {
+                    if (!excluded[successors[s].symbol]) {
+                        excluded[successors[s].symbol] = true;
+                        n_excluded++;
+                    }
+                }
+            }
+
+            // escaped every context, uniform over the symbols left
+            if (symbol < 0) {
+                unsigned int nth = (unsigned int) gen.below(alphabet::length - n_excluded);
+
+                for (symbol = 0; excluded[symbol] || nth-- > 0; symbol++);
+            }
+
+            push((uint8_t) symbol);
+            buffer[used++] = alphabet::decode((unsigned int) symbol);
+
+            if (used == PPM_BUFFER_LENGTH) {
+                out.write(buffer, used);
+                used = 0;
+            }
+        }
+
+        buffer[used++] = '\n';
+        if (used == PPM_BUFFER_LENGTH) {
+            out.write(buffer, used);
+            used = 0;
+        }
+    }
+
+    out.write(buffer, used);
+    out.flush();
+
+    timer.symbols = (uint64_t) lines * chars;
+    timer.bytes = timer.symbols + lines;
+}
+
+template<class alphabet>
+size_t ppm<alphabet>::modelBytes() const {
+    return nodes.size() * sizeof(contextNode) + successors.size() * sizeof(successor);
+}
+
+template<class alphabet>
+void ppm<alphabet>::printStats() const {
+
+    vector<size_t> per_depth(depth + 1, 0);
+    vector<pair<uint32_t, unsigned int>> pending = {{0, 0}};
+
+    // walk the trie to count the contexts of each depth
+    while (!pending.empty()) {
+        auto node = pending.back();
+        pending.pop_back();
+        per_depth[node.second]++;
+
+        for (uint32_t c = nodes[node.first].child; c != 0; c = nodes[c].sibling)
+            pending.emplace_back(c, node.second + 1);
+    }
+
+    cout << "Contexts: " << nodes.size() << ", symbol counters: " << successors.size()
+         << ", model bytes: " << modelBytes() << endl;
+    cout << setw(6) << "depth" << setw(12) << "contexts" << endl;
+
+    for (unsigned int d = 0; d <= depth; d++)
+        cout << setw(6) << d << setw(12) << per_depth[d] << endl;
+}
+
+template class ppm<englishAlphabet>;
+template class ppm<portugueseAlphabet>;
+template class ppm<dnaAlphabet>;
+template class ppm<byteAlphabet>;
@@ -0,0 +1,183 @@
+#ifndef CAV_GMZ_PPM_H
+#define CAV_GMZ_PPM_H
+
+
+#include <iostream>
+#include <vector>
+#include "ingest.h"
+#include "alphabet.h"
+
+using namespace std;
+
+#define PPM_MAX_DEPTH 255
+
+/**
+ * Variable order model over one of the alphabet policies of alphabet.h: a trie of every context up to a maximum
+ * depth, predicting PPM style (method C with exclusions). A symbol is predicted by the longest context seen so far
+ * and escapes to shorter contexts, down to a uniform distribution, when that context never saw it.
+ *
+ * The trie is indexed by the history backwards: the children of a context are the contexts one symbol older.
+ * Every context node keeps the list of the symbols that followed it. Nodes and symbol lists come from two
+ * contiguous pools and link each other with 32 bit indexes
+ * @tparam alphabet alphabet policy
+ */
+template<class alphabet>
+class ppm {
+public:
+
+    /**
+     * @param max_depth longest context, up to PPM_MAX_DEPTH, no longer limited by 64 bit context indexes
+     */
+    explicit ppm(unsigned int max_depth);
+
+    /**
+     * Counts the input in every context up to the maximum depth. Each symbol is coded with the model learned
+     * from the symbols before it, getEntropy() gives the resulting code length
+     * @param input data to process
+     */
+    void train(inputSource *input);
+
+    /**
+     * Adaptive code length of the input processed, what an arithmetic coder driven by the model would spend
+     * @return bits per symbol
+     */
+    double getEntropy() const;
+
+    /**
+     * Probability of a symbol after a history, escaping from its longest context seen down to shorter ones
+     * @param history alphabet codes of the history, oldest first
+     * @param length number of codes in the history, only the last max_depth ones are used
+     * @param symbol alphabet code of the symbol
+     * @return probability of the symbol
+     */
+    double probability(const uint8_t *history, size_t length, unsigned int symbol) const;
+
+    /**
+     * Generates text drawing each symbol from the escape chain of its history
+     * @param lines number of lines
+     * @param chars symbols per line
+     * @param seed seed of the random numbers, the same seed after the same training gives the same text
+     * @param out where to write the text
+     */
+    void genText(unsigned int lines, unsigned int chars, uint64_t seed, ostream &out = cout);
+
+    /**
+     * Prints the size of the trie and the number of contexts of each depth
+     */
+    void printStats() const;
+
+    /**
+     * @return number of contexts in the trie, the empty one included
+     */
+    size_t contexts() const { return nodes.size(); }
+
+    /**
+     * @return bytes of the node pools
+     */
+    size_t modelBytes() const;
+
+private:
+
+    /**
+     * Context of the trie
+     */
+    struct contextNode {
+        uint32_t child;         // first context one symbol older, 0 if none (the root is never a child)
+        uint32_t sibling;       // next context with the same parent, 0 if none
+        uint32_t successors;    // first symbol that followed the context, NO_SUCCESSOR if none
+        uint32_t total;         // occurrences of the context
+        uint16_t distinct;      // number of different symbols that followed the context
+        uint8_t symbol;         // oldest symbol of the context, the one extending the parent
+    };
+
+    /**
+     * Symbol that followed a context and its count
+     */
+    struct successor {
+        uint32_t next;          // next symbol of the same context, NO_SUCCESSOR if none
+        uint32_t count;
+        uint8_t symbol;
+    };
+
+    /**
+     * Pool of contexts, the root (empty context) first
+     */
+    vector<contextNode> nodes;
+
+    /**
+     * Pool of the symbol lists of the contexts
+     */
+    vector<successor> successors;
+
+    /**
+     * Longest context
+     */
+    unsigned int depth;
+
+    /**
+     * Last depth symbols, newest first
+     */
+    vector<uint8_t> recent;
+
+    /**
+     * Number of symbols in recent, up to depth
+     */
+    unsigned int filled;
+
+    /**
+     * Code length of the symbols processed, in bits
+     */
+    double code_length;
+
+    /**
+     * Number of symbols processed
+     */
+    uint64_t coded;
+
+    /**
+     * Finds the contexts of a history, from the empty one to the longest one in the trie
+     * @param older symbols of the history, newest first
+     * @param length number of symbols of the history, up to depth
+     * @param path where to store the node of each depth
+     * @return number of nodes found, at least 1 (the root)
+     */
+    unsigned int findPath(const uint8_t *older, unsigned int length, uint32_t *path) const;
+
+    /**
+     * Finds or creates the context one symbol older than a context
+     * @param parent context to extend
+     * @param symbol older symbol
+     * @return node of the context
+     */
+    uint32_t child(uint32_t parent, uint8_t symbol);
+
+    /**
+     * Counts a symbol after a context
+     * @param node context
+     * @param symbol alphabet code of the symbol
+     */
+    void count(uint32_t node, uint8_t symbol);
+
+    /**
+     * Probability of a symbol along a path of contexts, see probability()
+     * @param path contexts from the empty one to the longest one
+     * @param found number of contexts in the path
+     * @param symbol alphabet code of the symbol
+     * @return probability of the symbol
+     */
+    double pathProbability(const uint32_t *path, unsigned int found, unsigned int symbol) const;
+
+    /**
+     * Codes a symbol with the model and counts it in every context of the history
+     * @param symbol alphabet code of the symbol
+     */
+    void update(uint8_t symbol);
+
+    /**
+     * Appends a symbol to the history
+     * @param symbol alphabet code of the symbol
+     */
+    void push(uint8_t symbol);
+};
+
+#endif //CAV_GMZ_PPM_H
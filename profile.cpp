@@ -0,0 +1,86 @@
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+#include "profile.h"
+
+/**
+ * Accumulated counters of a phase, updated concurrently by the counting threads
+ */
+struct phaseCounters {
+    atomic<uint64_t> runs;
+    atomic<uint64_t> nanoseconds;
+    atomic<uint64_t> thread_nanoseconds;
+    atomic<uint64_t> symbols;
+    atomic<uint64_t> contexts;
+    atomic<uint64_t> bytes;
+    atomic<uint64_t> allocated;
+};
+
+static const char *PHASE_NAMES[PROFILE_PHASES] = {"ingest", "normalize", "count", "probabilities", "entropy",
+                                                  "generation", "save", "load", "score", "compress",
+                                                  "decompress", "prune", "decay"};
+
+static phaseCounters counters[PROFILE_PHASES];
+
+bool profiler::enabled_flag = false;
+
+atomic<uint64_t> profiler::allocated_bytes(0);
+
+void profiler::add(phase p, double seconds, uint64_t symbols, uint64_t contexts, uint64_t bytes,
+                   uint64_t allocated, double thread_seconds) {
+
+    phaseCounters &c = counters[(unsigned int) p];
+
+    c.runs.fetch_add(1, memory_order_relaxed);
+    c.nanoseconds.fetch_add((uint64_t) (seconds * 1e9), memory_order_relaxed);
+    c.thread_nanoseconds.fetch_add((uint64_t) (thread_seconds * 1e9), memory_order_relaxed);
+    c.symbols.fetch_add(symbols, memory_order_relaxed);
+    c.contexts.fetch_add(contexts, memory_order_relaxed);
+    c.bytes.fetch_add(bytes, memory_order_relaxed);
+    c.allocated.fetch_add(allocated, memory_order_relaxed);
+}
+
+void profiler::print(ostream &out) {
+
+    out << setw(14) << "phase" << setw(12) << "seconds" << setw(12) << "thread s" << setw(14) << "symbols" << setw(12) << "contexts"
+        << setw(16) << "allocated" << setw(12) << "MB/s" << setw(16) << "symbols/s" << endl;
+
+    for (unsigned int i = 0; i < PROFILE_PHASES; i++) {
+        const phaseCounters &c = counters[i];
+
+        if (c.runs == 0)
+            continue;
+
+        double seconds = c.nanoseconds / 1e9;
+
+        out << setw(14) << PHASE_NAMES[i] << setw(12) << fixed << setprecision(4) << seconds
+            << setw(12) << c.thread_nanoseconds / 1e9
+            << setw(14) << c.symbols << setw(12) << c.contexts << setw(16) << c.allocated
+            << setw(12) << setprecision(1) << (seconds > 0 ? c.bytes / seconds / (1 << 20) : 0)
+            << setw(16) << setprecision(0) << (seconds > 0 ? c.symbols / seconds : 0) << endl;
+    }
+}
+
+/*
+ * Global allocation functions counting the bytes allocated for the profile, every other form of
+ * new and delete ends up in these ones
+ */
+
+void *operator new(size_t size) {
+
+    profiler::allocation(size);
+
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr)
+        throw bad_alloc();
+
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
@@ -0,0 +1,135 @@
+#ifndef CAV_GMZ_PROFILE_H
+#define CAV_GMZ_PROFILE_H
+
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+using namespace std;
+
+/**
+ * Phases reported by --profile
+ */
+enum class phase : unsigned int {
+    ingest,         // reading the input, mapped inputs are faulted in by normalize instead
+    normalize,      // converting bytes to alphabet codes
+    count,          // incrementing the counters, and merging the thread tables
+    probabilities,  // row sums and probability rows
+    entropy,
+    generation,
+    save,
+    load,
+    score,          // code length of documents under a model
+    compress,
+    decompress,
+    prune,          // picking the contexts to keep and copying them to a new table
+    decay           // halving the counters of a streamed model
+};
+
+#define PROFILE_PHASES 13
+
+/**
+ * Counters of every phase of a run. Disabled by default, then every call is a single test of a flag.
+ * The time of a phase is wall time, phases running in several threads also add up the time of each
+ * thread apart
+ */
+class profiler {
+public:
+
+    /**
+     * Starts collecting, the allocation counter included
+     */
+    static void enable() { enabled_flag = true; }
+
+    /**
+     * @return whether the counters are being collected
+     */
+    static bool enabled() { return enabled_flag; }
+
+    /**
+     * Adds to the counters of a phase
+     * @param p phase
+     * @param seconds wall time spent in the phase
+     * @param symbols symbols processed
+     * @param contexts contexts created
+     * @param bytes bytes processed
+     * @param allocated bytes allocated
+     * @param thread_seconds time spent in the phase by each thread, added up
+     */
+    static void add(phase p, double seconds, uint64_t symbols, uint64_t contexts, uint64_t bytes, uint64_t allocated,
+                    double thread_seconds);
+
+    /**
+     * Adds to the counters of a phase run by a single thread, its thread time is its wall time
+     */
+    static void add(phase p, double seconds, uint64_t symbols, uint64_t contexts, uint64_t bytes, uint64_t allocated) {
+        add(p, seconds, symbols, contexts, bytes, allocated, seconds);
+    }
+
+    /**
+     * @return bytes allocated by operator new since enable()
+     */
+    static uint64_t allocated() { return allocated_bytes.load(memory_order_relaxed); }
+
+    /**
+     * Counts an allocation, called by operator new
+     * @param size bytes allocated
+     */
+    static void allocation(size_t size) {
+        if (enabled_flag)
+            allocated_bytes.fetch_add(size, memory_order_relaxed);
+    }
+
+    /**
+     * Prints a table with a line per phase that did run: wall time, thread time, symbols, contexts,
+     * allocated bytes and throughput over the wall time
+     * @param out where to print
+     */
+    static void print(ostream &out);
+
+private:
+
+    static bool enabled_flag;
+
+    static atomic<uint64_t> allocated_bytes;
+};
+
+/**
+ * Times a scope as a phase: on destruction adds the elapsed time, the bytes allocated meanwhile and
+ * the symbols, contexts and bytes set by the scope. Does nothing unless the profiler is enabled
+ */
+class phaseTimer {
+public:
+
+    explicit phaseTimer(phase p) : p(p), active(profiler::enabled()) {
+        if (active) {
+            start = chrono::steady_clock::now();
+            start_allocated = profiler::allocated();
+        }
+    }
+
+    ~phaseTimer() {
+        if (active)
+            profiler::add(p, chrono::duration<double>(chrono::steady_clock::now() - start).count(),
+                          symbols, contexts, bytes, profiler::allocated() - start_allocated);
+    }
+
+    phaseTimer(const phaseTimer &) = delete;
+
+    phaseTimer &operator=(const phaseTimer &) = delete;
+
+    uint64_t symbols = 0;
+    uint64_t contexts = 0;
+    uint64_t bytes = 0;
+
+private:
+
+    phase p;
+    bool active;
+    chrono::steady_clock::time_point start;
+    uint64_t start_allocated = 0;
+};
+
+#endif //CAV_GMZ_PROFILE_H
@@ -0,0 +1,23 @@
+# Pruning to the contexts seen the most, run by ctest: trains an order ORDER model on INPUT with --prune-top TOP
+# and checks that exactly TOP contexts are left, or all of them when the model has fewer
+
+execute_process(COMMAND ${FCM} -k ${ORDER} --prune-top ${TOP} -l 1 ${INPUT}
+                OUTPUT_VARIABLE output RESULT_VARIABLE status)
+if (NOT status EQUAL 0)
+    message(FATAL_ERROR "Pruning failed: ${status}")
+endif ()
+
+if (NOT output MATCHES "Pruned contexts: ([0-9]+) -> ([0-9]+)")
+    message(FATAL_ERROR "No pruned contexts in the output:\n${output}")
+endif ()
+
+set(before ${CMAKE_MATCH_1})
+set(after ${CMAKE_MATCH_2})
+set(expected ${TOP})
+if (before LESS TOP)
+    set(expected ${before})
+endif ()
+
+if (NOT after EQUAL expected)
+    message(FATAL_ERROR "--prune-top ${TOP} left ${after} of ${before} contexts, not ${expected}")
+endif ()
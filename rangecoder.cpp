@@ -0,0 +1,34 @@
+#include "rangecoder.h"
+
+void rangeEncoder::shiftLow() {
+
+    // the top byte is final unless it can still take a carry, that is, unless it is 0xFF
+    if ((uint32_t) low < 0xFF000000u || (low >> 32) != 0) {
+        uint8_t carry = (uint8_t) (low >> 32);
+        uint8_t byte = cache;
+
+        do {
+            out.push_back((uint8_t) (byte + carry));
+            byte = 0xFF;
+        } while (--pending != 0);
+
+        cache = (uint8_t) (low >> 24);
+    }
+
+    pending++;
+    low = (low & 0x00FFFFFFu) << 8;
+}
+
+void rangeEncoder::finish() {
+
+    for (int i = 0; i < 5; i++)
+        shiftLow();
+}
+
+rangeDecoder::rangeDecoder(const uint8_t *data, size_t length) : p_data(data), p_end(data + length), code(0),
+                                                                 range(UINT32_MAX) {
+
+    // the first byte is the initial cache of the encoder, always 0
+    for (int i = 0; i < 5; i++)
+        code = (code << 8) | next();
+}
@@ -0,0 +1,126 @@
+#ifndef CAV_GMZ_RANGECODER_H
+#define CAV_GMZ_RANGECODER_H
+
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+using namespace std;
+
+#define RANGE_TOP (1u << 24)            // the range is renormalized a byte at a time below this
+#define RANGE_MAX_TOTAL (1u << 16)      // highest total frequency the coder takes
+
+/**
+ * Range coder encoding symbols given as [cumulative, cumulative + frequency) out of a total frequency.
+ * 32 bit range with a carry propagated through a cached byte and a run of pending 0xFF bytes, so the output
+ * never needs to be patched afterwards
+ */
+class rangeEncoder {
+public:
+
+    /**
+     * @param output where to append the coded bytes
+     */
+    explicit rangeEncoder(vector<uint8_t> &output) : out(output), low(0), range(UINT32_MAX), cache(0),
+                                                     pending(1) {}
+
+    /**
+     * Encodes a symbol
+     * @param cumulative sum of the frequencies of the symbols before it
+     * @param frequency frequency of the symbol, not 0
+     * @param total sum of every frequency, up to RANGE_MAX_TOTAL
+     */
+    void encode(uint32_t cumulative, uint32_t frequency, uint32_t total) {
+        range /= total;
+        low += (uint64_t) cumulative * range;
+        range *= frequency;
+
+        while (range < RANGE_TOP) {
+            range <<= 8;
+            shiftLow();
+        }
+    }
+
+    /**
+     * Writes the bytes still held by the coder, call once after the last symbol
+     */
+    void finish();
+
+private:
+
+    vector<uint8_t> &out;
+
+    /**
+     * Low end of the range, the bit over the low 32 bits is a carry into the bytes not written yet
+     */
+    uint64_t low;
+
+    uint32_t range;
+
+    /**
+     * Last byte out of low, held back until it is known whether a carry reaches it
+     */
+    uint8_t cache;
+
+    /**
+     * Number of bytes held back: the cached byte and the 0xFF bytes after it
+     */
+    uint64_t pending;
+
+    /**
+     * Moves the top byte of low out
+     */
+    void shiftLow();
+};
+
+/**
+ * Decoder of rangeEncoder. Reading past the end of the input reads zeros, a truncated input decodes to
+ * wrong symbols instead of reading out of bounds
+ */
+class rangeDecoder {
+public:
+
+    /**
+     * @param data coded bytes
+     * @param length number of coded bytes
+     */
+    rangeDecoder(const uint8_t *data, size_t length);
+
+    /**
+     * First step of decoding a symbol
+     * @param total sum of every frequency, as given to the encoder
+     * @return a value in [cumulative, cumulative + frequency) of the coded symbol
+     */
+    uint32_t target(uint32_t total) {
+        range /= total;
+        uint32_t value = code / range;
+        return value < total ? value : total - 1;
+    }
+
+    /**
+     * Second step of decoding a symbol, once the symbol of the target is known
+     * @param cumulative sum of the frequencies of the symbols before it
+     * @param frequency frequency of the symbol
+     */
+    void decode(uint32_t cumulative, uint32_t frequency) {
+        code -= cumulative * range;
+        range *= frequency;
+
+        while (range < RANGE_TOP) {
+            code = (code << 8) | next();
+            range <<= 8;
+        }
+    }
+
+private:
+
+    const uint8_t *p_data;
+    const uint8_t *p_end;
+    uint32_t code;
+    uint32_t range;
+
+    uint8_t next() { return p_data < p_end ? *p_data++ : 0; }
+};
+
+#endif //CAV_GMZ_RANGECODER_H
@@ -0,0 +1,63 @@
+#ifndef CAV_GMZ_RNG_H
+#define CAV_GMZ_RNG_H
+
+
+#include <cstdint>
+#include <random>
+
+using namespace std;
+
+/**
+ * Counter based random number generator: the n-th number of a stream is a hash (the SplitMix64 finalizer) of
+ * the seed, the stream and n. Streams are independent and need no state but their counter, so work split in
+ * numbered streams draws the same numbers whichever thread runs each stream, and in whatever order.
+ * Meets the uniform random bit generator requirements, but bounded draws should use below(), the standard
+ * distributions don't give the same numbers with every standard library
+ */
+class streamRng {
+public:
+
+    typedef uint64_t result_type;
+
+    /**
+     * @param seed seed shared by every stream of a job
+     * @param stream number of the stream
+     */
+    streamRng(uint64_t seed, uint64_t stream) : key(mix(seed ^ mix(stream + 0x9e3779b97f4a7c15ull))), counter(0) {}
+
+    /**
+     * @return next number of the stream
+     */
+    uint64_t operator()() { return mix(key + 0x9e3779b97f4a7c15ull * ++counter); }
+
+    /**
+     * @param bound number of values, not 0
+     * @return next number of the stream scaled to [0, bound), with the high bits of a 128 bit product
+     */
+    uint64_t below(uint64_t bound) { return (uint64_t) (((unsigned __int128) (*this)() * bound) >> 64); }
+
+    static constexpr uint64_t min() { return 0; }
+
+    static constexpr uint64_t max() { return UINT64_MAX; }
+
+    /**
+     * @return a seed that differs from run to run, for when none is given
+     */
+    static uint64_t randomSeed() {
+        random_device rd;
+        return ((uint64_t) rd() << 32) ^ rd();
+    }
+
+private:
+
+    uint64_t key;
+    uint64_t counter;
+
+    static uint64_t mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+};
+
+#endif //CAV_GMZ_RNG_H
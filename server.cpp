@@ -0,0 +1,376 @@
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "server.h"
+
+/**
+ * Listening socket of the running server, shut down by the signal handler to stop accepting
+ */
+static int listen_socket = -1;
+
+static volatile sig_atomic_t stopping = 0;
+
+/**
+ * Connection each thread of the running server is serving, -1 when it has none. Lock free atomics, so the
+ * signal handler can read them
+ */
+static atomic<int> *client_sockets = nullptr;
+
+static unsigned int client_slots = 0;
+
+/**
+ * SIGINT and SIGTERM handler: shutdown() is async signal safe, and wakes up every thread blocked in accept(),
+ * or in reading or writing a connection
+ */
+static void stopServing(int) {
+    stopping = 1;
+    shutdown(listen_socket, SHUT_RDWR);
+
+    for (unsigned int slot = 0; slot < client_slots; slot++) {
+        int fd = client_sockets[slot];
+        if (fd >= 0)
+            shutdown(fd, SHUT_RDWR);
+    }
+}
+
+/**
+ * @return value of a hex digit, -1 if it isn't one
+ */
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Appends a symbol of an answer, escaped, see fcmServer
+ */
+static void appendSymbol(char symbol, string &out) {
+
+    static const char digits[] = "0123456789abcdef";
+
+    if (symbol == '\t')
+        out += "\\t";
+    else if (symbol == '\n')
+        out += "\\n";
+    else if (symbol == '\\')
+        out += "\\\\";
+    else if (isprint((unsigned char) symbol))
+        out += symbol;
+    else {
+        out += "\\x";
+        out += digits[(unsigned char) symbol >> 4];
+        out += digits[(unsigned char) symbol & 15];
+    }
+}
+
+template<class alphabet>
+fcmServer<alphabet>::fcmServer(const fcm<alphabet> &trained, unsigned int num_threads) : model(trained),
+                                                                                        numThreads(max(num_threads, 1u)),
+                                                                                        connections(0), batches(0),
+                                                                                        queries(0), errors(0) {
+}
+
+template<class alphabet>
+string fcmServer<alphabet>::unescape(const char *text, size_t length) {
+
+    string raw;
+    raw.reserve(length);
+
+    // an escape that isn't one is taken as it is
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] != '\\' || i + 1 == length) {
+            raw += text[i];
+        } else if (text[i + 1] == 't' || text[i + 1] == 'n' || text[i + 1] == '\\') {
+            raw += text[i + 1] == 't' ? '\t' : text[i + 1] == 'n' ? '\n' : '\\';
+            i++;
+        } else if (text[i + 1] == 'x' && i + 3 < length && hexValue(text[i + 2]) >= 0 && hexValue(text[i + 3]) >= 0) {
+            raw += (char) (hexValue(text[i + 2]) * 16 + hexValue(text[i + 3]));
+            i += 3;
+        } else {
+            raw += text[i];
+        }
+    }
+
+    return raw;
+}
+
+template<class alphabet>
+void fcmServer<alphabet>::textCodes(const char *text, size_t length, vector<uint8_t> &codes) {
+
+    string raw = unescape(text, length);
+
+    codes.resize(raw.size() + NORMALIZE_SLACK);
+    codes.resize(alphabet::normalize(raw.data(), raw.size(), codes.data()));
+}
+
+template<class alphabet>
+uint64_t fcmServer<alphabet>::contextOf(const uint8_t *end) const {
+
+    uint64_t context = 0;
+
+    // the oldest symbol is the most significant digit, as fcm::mapPosCalc()
+    for (const uint8_t *code = end - model.order(); code < end; code++)
+        context = context * alphabet::length + *code;
+
+    return context;
+}
+
+template<class alphabet>
+void fcmServer<alphabet>::answer(const char *query, size_t length, string &answers) {
+
+    const char *space = (const char *) memchr(query, ' ', length);
+    string command(query, space == nullptr ? length : (size_t) (space - query));
+    const char *text = space == nullptr ? query + length : space + 1;
+    size_t text_length = (size_t) (query + length - text);
+    unsigned int k = model.order();
+    vector<uint8_t> codes;
+    char number[64];
+
+    queries++;
+
+    auto fail = [&](const char *reason) {
+        answers += "ERR\t";
+        answers += reason;
+        answers += '\n';
+        errors++;
+    };
+
+    if (command == "COUNT" || command == "PROB") {
+        textCodes(text, text_length, codes);
+
+        if (codes.size() < k + 1)
+            return fail("the text needs a context and a symbol");
+
+        uint64_t context = contextOf(&codes[codes.size() - 1]);
+        unsigned int symbol = codes.back(), total;
+
+        if (command == "COUNT") {
+            unsigned int count = model.table().lookup(context, symbol, total);
+            snprintf(number, sizeof(number), "OK\t%u\t%u\n", count, total);
+        } else {
+            snprintf(number, sizeof(number), "OK\t%.9g\n", model.probability(context, symbol));
+        }
+
+        answers += number;
+    } else if (command == "TOPN") {
+        char *end;
+        unsigned long n = strtoul(text, &end, 10);
+
+        if (!isdigit((unsigned char) *text) || n == 0 || (*end != ' ' && end != query + length))
+            return fail("TOPN needs a number of symbols and a text");
+
+        const char *context_text = end == query + length ? end : end + 1;
+        textCodes(context_text, (size_t) (query + length - context_text), codes);
+
+        if (codes.size() < k)
+            return fail("the text needs a context");
+
+        vector<pair<unsigned int, unsigned int>> symbols;
+        unsigned int total = model.topSymbols(contextOf(codes.data() + codes.size()),
+                                              (unsigned int) min(n, (unsigned long) alphabet::length), symbols);
+
+        snprintf(number, sizeof(number), "OK\t%u", total);
+        answers += number;
+
+        for (auto &entry : symbols) {
+            answers += '\t';
+            appendSymbol(alphabet::decode(entry.first), answers);
+            snprintf(number, sizeof(number), "\t%u", entry.second);
+            answers += number;
+        }
+
+        answers += '\n';
+    } else if (command == "CODELEN") {
+        string raw = unescape(text, text_length);
+        documentScore score = model.scoreText(raw.data(), raw.size());
+        snprintf(number, sizeof(number), "OK\t%.6f\t%llu\t%llu\n", score.bits, (unsigned long long) score.symbols,
+                 (unsigned long long) score.unpredicted);
+        answers += number;
+    } else {
+        fail("unknown query, COUNT, PROB, TOPN or CODELEN");
+    }
+}
+
+template<class alphabet>
+void fcmServer<alphabet>::serveConnection(int fd) {
+
+    vector<char> buffer(SERVER_READ_LENGTH);
+    string pending, answers;
+    bool skipping = false;      // whether the rest of a query too long is being dropped
+
+    for (;;) {
+        ssize_t n = read(fd, buffer.data(), buffer.size());
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return;
+
+        pending.append(buffer.data(), (size_t) n);
+        answers.clear();
+
+        size_t start = 0;
+        for (size_t end; (end = pending.find('\n', start)) != string::npos; start = end + 1) {
+            if (skipping) {
+                skipping = false;
+                continue;
+            }
+
+            // lines typed in a terminal may end with "\r\n"
+            size_t length = end - start;
+            if (length > 0 && pending[end - 1] == '\r')
+                length--;
+
+            answer(pending.data() + start, length, answers);
+        }
+
+        pending.erase(0, start);
+
+        if (pending.size() > SERVER_MAX_QUERY) {
+            if (!skipping) {
+                answers += "ERR\tquery too long\n";
+                queries++;
+                errors++;
+            }
+            pending.clear();
+            skipping = true;
+        }
+
+        if (answers.empty())
+            continue;
+
+        batches++;
+
+        for (size_t sent = 0; sent < answers.size();) {
+            ssize_t written = send(fd, answers.data() + sent, answers.size() - sent, MSG_NOSIGNAL);
+
+            if (written < 0 && errno == EINTR)
+                continue;
+
+            if (written <= 0)
+                return;
+
+            sent += (size_t) written;
+        }
+    }
+}
+
+template<class alphabet>
+int fcmServer<alphabet>::serve(const string &path) {
+
+    sockaddr_un address = {};
+    struct stat info;
+
+    if (path.size() >= sizeof(address.sun_path)) {
+        cerr << "Socket path '" << path << "' is too long" << endl;
+        return 1;
+    }
+
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+    // a socket left by a previous server is replaced, anything else is left alone
+    if (stat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+        unlink(path.c_str());
+
+    listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (listen_socket < 0 || bind(listen_socket, (const sockaddr *) &address, sizeof(address)) != 0
+        || listen(listen_socket, SOMAXCONN) != 0) {
+        cerr << "Fail listening on '" << path << "': " << strerror(errno) << endl;
+        if (listen_socket >= 0)
+            close(listen_socket);
+        listen_socket = -1;
+        return 1;
+    }
+
+    unique_ptr<atomic<int>[]> clients(new atomic<int>[numThreads]);
+    for (unsigned int slot = 0; slot < numThreads; slot++)
+        clients[slot] = -1;
+
+    client_sockets = clients.get();
+    client_slots = numThreads;
+
+    struct sigaction action = {};
+    action.sa_handler = stopServing;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    cout << "Serving on '" << path << "'" << endl;
+
+    // every thread takes the next connection and serves it until it closes or the server stops
+    auto worker = [&](unsigned int slot) {
+        while (!stopping) {
+            int fd = accept(listen_socket, nullptr, nullptr);
+
+            if (fd < 0) {
+                if (errno == EBADF || errno == EINVAL)
+                    return;
+                continue;
+            }
+
+            // a signal after the connection is published shuts it down, one before is seen by the check
+            connections++;
+            clients[slot] = fd;
+            if (!stopping)
+                serveConnection(fd);
+            clients[slot] = -1;
+            close(fd);
+        }
+    };
+
+    vector<thread> threads;
+    for (unsigned int t = 1; t < numThreads; t++)
+        threads.emplace_back(worker, t);
+
+    worker(0);
+
+    for (auto &t : threads)
+        t.join();
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    client_slots = 0;
+    client_sockets = nullptr;
+
+    close(listen_socket);
+    listen_socket = -1;
+    stopping = 0;
+    unlink(path.c_str());
+
+    return 0;
+}
+
+template<class alphabet>
+serverStats fcmServer<alphabet>::stats() const {
+
+    serverStats counters;
+
+    counters.connections = connections;
+    counters.batches = batches;
+    counters.queries = queries;
+    counters.errors = errors;
+
+    return counters;
+}
+
+template class fcmServer<englishAlphabet>;
+template class fcmServer<portugueseAlphabet>;
+template class fcmServer<dnaAlphabet>;
+template class fcmServer<byteAlphabet>;
@@ -0,0 +1,106 @@
+#ifndef CAV_GMZ_SERVER_H
+#define CAV_GMZ_SERVER_H
+
+
+#include <string>
+#include <atomic>
+#include "fcm.h"
+
+using namespace std;
+
+#define SERVER_READ_LENGTH (1u << 16)   // bytes read from a connection at once
+#define SERVER_MAX_QUERY (1u << 20)     // longest query, longer ones are answered with an error and skipped
+
+/**
+ * Counters of a server since it started
+ */
+struct serverStats {
+    uint64_t connections = 0;       // connections accepted
+    uint64_t batches = 0;           // reads answered, each one with every query it completed
+    uint64_t queries = 0;           // queries answered, errors included
+    uint64_t errors = 0;            // queries answered with an error
+};
+
+/**
+ * Server answering queries on a model loaded once, over a Unix domain socket. A query is a line and so is its
+ * answer, in the same order. The queries completed by a read are answered with a single write, so a client
+ * sending many lines at once gets them answered as a batch. Fields are separated by tabs, and in texts and
+ * symbols '\t', '\n', '\\' and the bytes that aren't printable are written \t, \n, \\ and \xHH.
+ * Symbols outside the alphabet are dropped from the texts, as when training:
+ *  - COUNT text: count of the last symbol of the text after the k symbols before it, OK count total
+ *  - PROB text: probability of the same, as getProbability(), OK probability
+ *  - TOPN n text: the n symbols seen the most after the last k symbols of the text, OK total symbol count ...
+ *  - CODELEN text: code length of the text, as --score, OK bits symbols unpredicted
+ * Anything else is answered ERR and the reason
+ * @tparam alphabet alphabet policy
+ */
+template<class alphabet>
+class fcmServer {
+public:
+
+    /**
+     * @param trained model answering, prepared with prepareScoring() and prepareTopSymbols()
+     * @param num_threads connections served at a time
+     */
+    fcmServer(const fcm<alphabet> &trained, unsigned int num_threads);
+
+    /**
+     * Listens on a socket until SIGINT or SIGTERM, which also shuts down the connections open then
+     * @param path path of the socket, replaced if it is a socket already
+     * @return 0 once stopped, 1 if the socket can't be listened on
+     */
+    int serve(const string &path);
+
+    /**
+     * Answers a query
+     * @param query line of the query, without its '\n'
+     * @param length bytes of the query
+     * @param answers where to append the answer, with its '\n'
+     */
+    void answer(const char *query, size_t length, string &answers);
+
+    /**
+     * @return counters since the server started
+     */
+    serverStats stats() const;
+
+private:
+
+    const fcm<alphabet> &model;
+
+    /**
+     * Number of connections served at a time
+     */
+    unsigned int numThreads;
+
+    atomic<uint64_t> connections, batches, queries, errors;
+
+    /**
+     * Answers the queries of a connection until the client closes it
+     * @param fd socket of the connection
+     */
+    void serveConnection(int fd);
+
+    /**
+     * Undoes the escapes of a text of a query, see fcmServer
+     * @param text text as written in the query
+     * @param length bytes of the text
+     * @return bytes of the text
+     */
+    static string unescape(const char *text, size_t length);
+
+    /**
+     * Converts a text of a query to alphabet codes, undoing the escapes first
+     * @param text text as written in the query
+     * @param length bytes of the text
+     * @param codes where to store the codes
+     */
+    static void textCodes(const char *text, size_t length, vector<uint8_t> &codes);
+
+    /**
+     * @return index of the context of the k codes before end
+     */
+    uint64_t contextOf(const uint8_t *end) const;
+};
+
+#endif //CAV_GMZ_SERVER_H
@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <numeric>
+#include "sketch.h"
+#include "aliastable.h"
+
+#define MIN_SKETCH_WIDTH 1024
+#define HEAVY_SLOT_OVERHEAD 48          // bytes of a heavy hitter besides its counters: hash node, total and slot
+#define NLOGN_TABLE_SIZE 4096           // n log2 n is looked up below this
+
+/**
+ * splitmix64 finalizer
+ */
+static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/**
+ * @return n log2 n, 0 for 0
+ */
+static double nlogn(uint64_t n) {
+
+    static const vector<double> table = [] {
+        vector<double> values(NLOGN_TABLE_SIZE, 0);
+        for (size_t i = 2; i < NLOGN_TABLE_SIZE; i++)
+            values[i] = i * log2((double) i);
+        return values;
+    }();
+
+    return n < NLOGN_TABLE_SIZE ? table[n] : n * log2((double) n);
+}
+
+sketchCountTable::sketchCountTable(unsigned int row_width, size_t memory_budget) : countTable(row_width),
+                                                                                   admission(0),
+                                                                                   context_nlogn(0),
+                                                                                   pair_nlogn(0) {
+
+    // widest power of two of counters within three quarters of the budget
+    for (sketch_width = MIN_SKETCH_WIDTH;
+         sketch_width * 2 * SKETCH_DEPTH * sizeof(uint32_t) <= memory_budget / 4 * 3; sketch_width *= 2);
+
+    sketch.assign(sketch_width * SKETCH_DEPTH, 0);
+
+    heavy_capacity = max((size_t) 1, memory_budget / 4 / (width * sizeof(unsigned int) + HEAVY_SLOT_OVERHEAD));
+    heavy.reserve(heavy_capacity);
+    heavy_rows.assign(heavy_capacity * width, 0);
+    heavy_totals.assign(heavy_capacity, 0);
+
+    free_slots.reserve(heavy_capacity);
+    for (size_t slot = heavy_capacity; slot > 0; slot--)
+        free_slots.push_back((uint32_t) (slot - 1));
+}
+
+void sketchCountTable::cellsOf(uint64_t context, unsigned int symbol, size_t *cells) const {
+
+    // double hashing: the rows step through the width from one hash by another
+    uint64_t hash = mix(context * (width + 1) + symbol);
+    uint64_t step = (hash >> 32) | 1;
+
+    for (unsigned int i = 0; i < SKETCH_DEPTH; i++)
+        cells[i] = i * sketch_width + ((hash + i * step) & (sketch_width - 1));
+}
+
+uint32_t sketchCountTable::estimate(const size_t *cells) const {
+
+    uint32_t smallest = sketch[cells[0]];
+
+    for (unsigned int i = 1; i < SKETCH_DEPTH; i++)
+        smallest = min(smallest, sketch[cells[i]]);
+
+    return smallest;
+}
+
+uint32_t sketchCountTable::conservativeAdd(const size_t *cells, unsigned int n) {
+
+    uint32_t before = estimate(cells);
+    uint32_t after = before > UINT32_MAX - n ? UINT32_MAX : before + n;
+
+    // counters already above the new estimate hold other pairs too, they are left alone
+    for (unsigned int i = 0; i < SKETCH_DEPTH; i++)
+        sketch[cells[i]] = max(sketch[cells[i]], after);
+
+    return before;
+}
+
+void sketchCountTable::count(uint64_t context, unsigned int symbol, unsigned int n) {
+
+    size_t pair_cells[SKETCH_DEPTH], total_cells[SKETCH_DEPTH];
+
+    total_count += n;
+
+    // the sketch counts everything, so a context dropped from the heavy hitters still has its estimates
+    cellsOf(context, symbol, pair_cells);
+    cellsOf(context, width, total_cells);
+    uint64_t pair_before = conservativeAdd(pair_cells, n);
+    uint64_t total_before = conservativeAdd(total_cells, n);
+
+    auto it = heavy.find(context);
+
+    if (it != heavy.end()) {
+        unsigned int &counter = heavy_rows[(size_t) it->second * width + symbol];
+        unsigned int &total = heavy_totals[it->second];
+
+        pair_nlogn += nlogn((uint64_t) counter + n) - nlogn(counter);
+        context_nlogn += nlogn((uint64_t) total + n) - nlogn(total);
+        counter += n;
+        total += n;
+        return;
+    }
+
+    pair_nlogn += nlogn(pair_before + n) - nlogn(pair_before);
+    context_nlogn += nlogn(total_before + n) - nlogn(total_before);
+
+    if (total_before + n > admission)
+        admit(context, symbol, n);
+}
+
+void sketchCountTable::admit(uint64_t context, unsigned int symbol, unsigned int n) {
+
+    if (free_slots.empty()) {
+        vector<unsigned int> totals;
+        totals.reserve(heavy.size());
+
+        for (auto &it : heavy)
+            totals.push_back(heavy_totals[it.second]);
+
+        // drop the lower half, the contexts below it have to get past it to come back
+        auto median = totals.begin() + totals.size() / 2;
+        nth_element(totals.begin(), median, totals.end());
+        admission = max(admission, *median);
+
+        for (auto it = heavy.begin(); it != heavy.end();) {
+            if (heavy_totals[it->second] <= admission) {
+                free_slots.push_back(it->second);
+                it = heavy.erase(it);
+            } else {
+                it++;
+            }
+        }
+
+        // a context as frequent as the ones just dropped doesn't get in either
+        if (free_slots.empty())
+            return;
+    }
+
+    uint32_t slot = free_slots.back();
+    free_slots.pop_back();
+    heavy.emplace(context, slot);
+
+    unsigned int *counts = &heavy_rows[(size_t) slot * width];
+
+    // with nothing standing out of the noise, only the count that got the context in is known
+    if (!sketchRow(context, counts)) {
+        fill_n(counts, width, 0);
+        counts[symbol] = n;
+    }
+
+    heavy_totals[slot] = accumulate(counts, counts + width, 0u);
+}
+
+void sketchCountTable::add(uint64_t context, const unsigned int *counts) {
+
+    for (unsigned int symbol = 0; symbol < width; symbol++)
+        if (counts[symbol] != 0)
+            count(context, symbol, counts[symbol]);
+}
+
+bool sketchCountTable::row(uint64_t context, unsigned int *counts) const {
+
+    auto it = heavy.find(context);
+
+    if (it != heavy.end()) {
+        copy_n(&heavy_rows[(size_t) it->second * width], width, counts);
+        return true;
+    }
+
+    return sketchRow(context, counts);
+}
+
+bool sketchCountTable::sketchRow(uint64_t context, unsigned int *counts) const {
+
+    size_t cells[SKETCH_DEPTH];
+    uint32_t estimates[MAX_SYMBOLS], sorted[MAX_SYMBOLS];
+    bool seen = false;
+
+    cellsOf(context, width, cells);
+    uint32_t total = estimate(cells);
+
+    for (unsigned int symbol = 0; symbol < width; symbol++) {
+        cellsOf(context, symbol, cells);
+        estimates[symbol] = sorted[symbol] = estimate(cells);
+    }
+
+    // most symbols never follow a context that isn't frequent, the median of its estimates is what collisions
+    // add to each one. An estimate has to be at least twice that to stand out of the noise, then the part above
+    // the noise is kept, up to the estimated total. Once the sketch is full, every estimate of a rare context
+    // is noise and the context is taken as never seen
+    nth_element(sorted, sorted + width / 2, sorted + width);
+    uint32_t noise = sorted[width / 2];
+    uint64_t kept = 0;
+
+    for (unsigned int symbol = 0; symbol < width; symbol++) {
+        counts[symbol] = estimates[symbol] <= 2 * noise ? 0 : min(estimates[symbol] - noise, total);
+        kept += counts[symbol];
+    }
+
+    // what the counters kept add up to past the total is overcount too, a symbol seen no more than that can't
+    // be told from a collision with a frequent pair
+    uint64_t excess = kept > total ? kept - total : 0;
+
+    for (unsigned int symbol = 0; symbol < width; symbol++) {
+        if (counts[symbol] <= excess)
+            counts[symbol] = 0;
+        seen |= counts[symbol] != 0;
+    }
+
+    return seen;
+}
+
+unsigned int sketchCountTable::rowTotal(uint64_t context) const {
+
+    unsigned int total;
+    lookup(context, 0, total);
+    return total;
+}
+
+unsigned int sketchCountTable::lookup(uint64_t context, unsigned int symbol, unsigned int &row_total) const {
+
+    auto it = heavy.find(context);
+
+    if (it != heavy.end()) {
+        row_total = heavy_totals[it->second];
+        return heavy_rows[(size_t) it->second * width + symbol];
+    }
+
+    unsigned int counts[MAX_SYMBOLS];
+
+    // the total of the estimates kept, so the probabilities of a row add up to one
+    if (!row(context, counts)) {
+        row_total = 0;
+        return 0;
+    }
+
+    row_total = accumulate(counts, counts + width, 0u);
+    return counts[symbol];
+}
+
+void sketchCountTable::forEach(const visitor &visit) const {
+
+    vector<pair<uint64_t, uint32_t>> sorted(heavy.begin(), heavy.end());
+    sort(sorted.begin(), sorted.end());
+
+    for (auto &it : sorted)
+        visit(it.first, &heavy_rows[(size_t) it.second * width]);
+}
+
+void sketchCountTable::forEachInPart(unsigned int part, unsigned int parts, const totalVisitor &visit) const {
+
+    // parts are ranges of buckets, as sparseCountTable
+    size_t first = heavy.bucket_count() * part / parts, last = heavy.bucket_count() * (part + 1) / parts;
+
+    for (size_t bucket = first; bucket < last; bucket++)
+        for (auto it = heavy.begin(bucket); it != heavy.end(bucket); ++it)
+            visit(it->first, &heavy_rows[(size_t) it->second * width], heavy_totals[it->second]);
+}
+
+bool sketchCountTable::runningEntropy(double &entropy) const {
+
+    // the two sums are nearly equal at low entropies, rounding can leave their difference below 0
+    entropy = total_count == 0 ? 0 : max(0.0, (context_nlogn - pair_nlogn) / total_count);
+    return true;
+}
+
+size_t sketchCountTable::memoryBytes() const {
+    return sketch.size() * sizeof(uint32_t) + heavy_capacity * (width * sizeof(unsigned int) + HEAVY_SLOT_OVERHEAD);
+}
+
+size_t parseMemory(const string &text) {
+
+    char *end;
+    double value = strtod(text.c_str(), &end);
+    string suffix = end;
+
+    if (value <= 0)
+        return 0;
+
+    if (suffix == "K" || suffix == "k")
+        value *= 1 << 10;
+    else if (suffix == "M" || suffix == "m")
+        value *= 1 << 20;
+    else if (suffix == "G" || suffix == "g")
+        value *= 1 << 30;
+    else if (!suffix.empty())
+        return 0;
+
+    return (size_t) value;
+}
@@ -0,0 +1,169 @@
+#ifndef CAV_GMZ_SKETCH_H
+#define CAV_GMZ_SKETCH_H
+
+
+#include <string>
+#include "counttable.h"
+
+#define SKETCH_DEPTH 4                  // rows of the sketch, each (context, symbol) has a counter in every one
+
+/**
+ * Approximate count table within a fixed memory budget, for orders whose contexts don't fit in memory.
+ *  - every (context, symbol) pair, and every context total, is counted in a count-min sketch with
+ *    conservative update: only the counters at the current minimum of the pair are incremented, so
+ *    estimates never undercount and overcount less than with plain count-min
+ *  - the most frequent contexts are counted exactly in a heavy hitter table. A context enters it when its
+ *    estimated total gets past the admission threshold, with the estimates of row() as its starting counters. When
+ *    the table is full, the half with the lowest totals is dropped and the threshold raised to their totals
+ *  - the entropy is kept while counting, as sum(T log T) of the contexts minus sum(n log n) of the
+ *    (context, symbol) pairs over the number of symbols, each term updated from the counter before the
+ *    increment, so no context ever has to be visited
+ * Only the heavy hitters are visited by forEach(), other contexts are answered from the sketch by row(): the
+ * estimates standing out of the noise of the context (the median estimate of its symbols), less the noise,
+ * dropping the ones no larger than what they add up to past the estimated total of the context.
+ * A quarter of the budget goes to the heavy hitters and the rest to the sketch
+ */
+class sketchCountTable : public countTable {
+public:
+
+    /**
+     * @param row_width alphabet length
+     * @param memory_budget bytes of the sketch and the heavy hitter table together
+     */
+    sketchCountTable(unsigned int row_width, size_t memory_budget);
+
+    void increment(uint64_t context, unsigned int symbol) override { count(context, symbol, 1); }
+
+    void add(uint64_t context, const unsigned int *counts) override;
+
+    bool row(uint64_t context, unsigned int *counts) const override;
+
+    unsigned int rowTotal(uint64_t context) const override;
+
+    unsigned int lookup(uint64_t context, unsigned int symbol, unsigned int &row_total) const override;
+
+    /**
+     * Visits the heavy hitters in ascending context order
+     */
+    void forEach(const visitor &visit) const override;
+
+    /**
+     * Visits the heavy hitters of one part of the table
+     */
+    void forEachInPart(unsigned int part, unsigned int parts, const totalVisitor &visit) const override;
+
+    /**
+     * @return number of heavy hitters
+     */
+    size_t size() const override { return heavy.size(); }
+
+    bool runningEntropy(double &entropy) const override;
+
+    /**
+     * @return bytes used by the sketch and the heavy hitter table
+     */
+    size_t memoryBytes() const;
+
+    /**
+     * @return most heavy hitters the table holds
+     */
+    size_t heavyCapacity() const { return heavy_capacity; }
+
+private:
+
+    /**
+     * Counters of the sketch, SKETCH_DEPTH rows of sketch_width counters one after the other
+     */
+    vector<uint32_t> sketch;
+
+    /**
+     * Counters of each row of the sketch, a power of two
+     */
+    size_t sketch_width;
+
+    /**
+     * Slot of each heavy hitter in heavy_rows
+     */
+    unordered_map<uint64_t, uint32_t> heavy;
+
+    /**
+     * Exact counters of the heavy hitters, a row of width counters per slot
+     */
+    vector<unsigned int> heavy_rows;
+
+    /**
+     * Total of each slot of heavy_rows
+     */
+    vector<unsigned int> heavy_totals;
+
+    /**
+     * Slots of heavy_rows not in use
+     */
+    vector<uint32_t> free_slots;
+
+    /**
+     * Number of slots of heavy_rows
+     */
+    size_t heavy_capacity;
+
+    /**
+     * Estimated total a context must get past to become a heavy hitter
+     */
+    unsigned int admission;
+
+    /**
+     * Sum of T log2 T over the context totals and of n log2 n over the (context, symbol) counters
+     */
+    double context_nlogn, pair_nlogn;
+
+    /**
+     * Adds to the counter of a symbol for a context, see increment()
+     */
+    void count(uint64_t context, unsigned int symbol, unsigned int n);
+
+    /**
+     * Positions of the counters of a (context, symbol) pair in each row of the sketch. Symbol width stands
+     * for the total of the context
+     * @param context index of the context
+     * @param symbol alphabet code of the symbol, or width
+     * @param cells where to store the SKETCH_DEPTH positions
+     */
+    void cellsOf(uint64_t context, unsigned int symbol, size_t *cells) const;
+
+    /**
+     * @return estimate of a pair, the smallest of its counters
+     */
+    uint32_t estimate(const size_t *cells) const;
+
+    /**
+     * Adds to a pair with conservative update
+     * @return estimate of the pair before the update
+     */
+    uint32_t conservativeAdd(const size_t *cells, unsigned int n);
+
+    /**
+     * Counters of a context estimated from the sketch, without the noise of the collisions, see row()
+     * @param context index of the context
+     * @param counts array where to store the width counters
+     * @return false if no estimate stands out of the noise
+     */
+    bool sketchRow(uint64_t context, unsigned int *counts) const;
+
+    /**
+     * Makes a context a heavy hitter, starting from its estimated counters. Drops the lower half of the
+     * table first if it is full
+     * @param context index of the context
+     * @param symbol symbol just counted after the context
+     * @param n occurrences just counted
+     */
+    void admit(uint64_t context, unsigned int symbol, unsigned int n);
+};
+
+/**
+ * Parses a memory size, in bytes or with a K, M or G suffix
+ * @param text size, like 512M or 2G
+ * @return bytes, 0 if the size is invalid
+ */
+size_t parseMemory(const string &text);
+
+#endif //CAV_GMZ_SKETCH_H
@@ -0,0 +1,18 @@
+#ifndef CAV_GMZ_TRACE_H
+#define CAV_GMZ_TRACE_H
+
+
+#include <iostream>
+
+/*
+ * Per symbol debug trace of the hot loops. It only exists in builds configured with -DFCM_TRACE=ON,
+ * otherwise the statement, including the formatting of its arguments, is compiled away.
+ * Like the other debug messages, it goes to clog and is shown with -d
+ */
+#ifdef FCM_TRACE
+#define TRACE(message) do { std::clog << message << std::endl; } while (0)
+#else
+#define TRACE(message) do { } while (0)
+#endif
+
+#endif //CAV_GMZ_TRACE_H